@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+"""
+Benchmarks for notmuch-sync on a large mail directory, e.g. the notmuch
+mailing list archive as in .github/workflows/notmuch-ml.yml. Local and remote
+are set up in a temporary directory as in test/test-integration.py and synced
+with --remote-cmd, and each scenario reports wall time, peak RSS, and bytes
+transferred, optionally compared against a stored baseline.
+"""
+
+import argparse
+import json
+import os
+import random
+import shutil
+import subprocess
+import sys
+import time
+
+from tempfile import TemporaryDirectory, TemporaryFile
+
+SYNC = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "src", "notmuch_sync.py")
+SCENARIOS = ["cold", "noop", "retag", "rename", "delete"]
+
+
+def write_conf(path):
+    conf_path = os.path.join(path, ".notmuch-config")
+    with open(conf_path, "w", encoding="utf-8") as f:
+        f.write(f'[database]\npath={path}\n[search]\nexclude_tags=deleted\n[new]\ntags=')
+    return conf_path
+
+
+def notmuch(conf, *args):
+    res = subprocess.run(["notmuch", *args], env=dict(os.environ, NOTMUCH_CONFIG=conf),
+                         capture_output=True, text=True, check=True)
+    return res.stdout
+
+
+def has_stats(script):
+    """
+    Whether a notmuch-sync script supports --stats; versions from before it
+    was added are benchmarked without bytes transferred and phase timings.
+    """
+    res = subprocess.run([sys.executable, script, "--help"], capture_output=True, text=True, check=True)
+    return "--stats" in res.stdout
+
+
+def sync(local_conf, remote_conf, stats, script=SYNC, delete=False):
+    """
+    Sync local with remote, returning wall time, peak RSS of notmuch-sync on
+    either side, and bytes transferred. Without stats (i.e. None), bytes
+    transferred are None and there are no phase timings.
+    """
+    flags = " --delete" if delete else ""
+    args = [sys.executable, script, "--remote-cmd",
+            f"bash -c 'NOTMUCH_CONFIG={remote_conf} {sys.executable} {script}{flags}'"]
+    if stats is not None:
+        args += ["--stats", stats]
+    if delete:
+        args.append("--delete")
+    with TemporaryFile("w+", encoding="utf-8") as err:
+        start = time.monotonic()
+        proc = subprocess.Popen(args, env=dict(os.environ, NOTMUCH_CONFIG=local_conf),
+                                stdout=subprocess.DEVNULL, stderr=err)
+        # wait4() reports the maximum over the process and the processes it
+        # waited for, i.e. the remote
+        _, status, usage = os.wait4(proc.pid, 0)
+        elapsed = time.monotonic() - start
+        proc.returncode = os.waitstatus_to_exitcode(status)
+        if proc.returncode != 0:
+            err.seek(0)
+            raise RuntimeError(f"Sync failed: {err.read()}")
+    if stats is None:
+        return {"seconds": elapsed, "peak_rss_kb": usage.ru_maxrss, "read": None, "write": None, "phases": {}}
+    with open(stats, "r", encoding="utf-8") as f:
+        report = json.loads(f.readlines()[-1])
+    return {"seconds": elapsed, "peak_rss_kb": usage.ru_maxrss,
+            "read": report["read"], "write": report["write"],
+            "phases": {"local": report["local"]["phases"], "remote": report["remote"]["phases"]}}
+
+
+def sample(conf, fraction, seed):
+    # queries of the form id:<message ID>
+    mids = notmuch(conf, "search", "--output=messages", "*").splitlines()
+    random.Random(seed).shuffle(mids)
+    return mids[:max(1, int(len(mids) * fraction))]
+
+
+def run(source, scenarios, fraction, seed, script=SYNC):
+    results = {}
+    with TemporaryDirectory() as tmpdir:
+        local = os.path.join(tmpdir, "local")
+        remote = os.path.join(tmpdir, "remote")
+        stats = os.path.join(tmpdir, "stats") if has_stats(script) else None
+        print(f"Copying {source}...", file=sys.stderr)
+        shutil.copytree(source, local, ignore=shutil.ignore_patterns(".notmuch"))
+        os.mkdir(remote)
+        local_conf = write_conf(local)
+        remote_conf = write_conf(remote)
+        notmuch(local_conf, "new")
+        notmuch(remote_conf, "new")
+
+        def _run(name, **kwargs):
+            if name in scenarios:
+                print(f"Running {name}...", file=sys.stderr)
+                results[name] = sync(local_conf, remote_conf, stats, script, **kwargs)
+            else:
+                # later scenarios start from the state after this one
+                sync(local_conf, remote_conf, stats, script, **kwargs)
+
+        # everything transferred to the empty remote
+        _run("cold")
+        # nothing changed
+        _run("noop")
+
+        # tags of many messages changed
+        with open(os.path.join(tmpdir, "batch"), "w", encoding="utf-8") as f:
+            for mid in sample(local_conf, fraction, seed):
+                f.write(f"+benchmark -- {mid}\n")
+        notmuch(local_conf, "tag", f"--input={os.path.join(tmpdir, 'batch')}")
+        _run("retag")
+
+        # many files renamed, like mbsync does when flags change
+        for mid in sample(local_conf, fraction, seed + 1):
+            for fname in notmuch(local_conf, "search", "--output=files", mid).splitlines():
+                os.rename(fname, fname + ",S")
+        notmuch(local_conf, "new")
+        _run("rename")
+
+        # some messages deleted locally, all IDs compared
+        for mid in sample(local_conf, fraction / 10, seed + 2):
+            notmuch(local_conf, "tag", "+deleted", "--", mid)
+        sync(local_conf, remote_conf, stats, script)
+        for fname in notmuch(local_conf, "search", "--output=files", "tag:deleted").splitlines():
+            os.remove(fname)
+        notmuch(local_conf, "new")
+        _run("delete", delete=True)
+    return results
+
+
+def compare(results, baseline, threshold):
+    """
+    Print results next to the baseline and return the scenarios whose wall
+    time regressed by more than the threshold.
+    """
+    def _bytes(value):
+        # unknown for versions without --stats
+        return "-" if value is None else value
+
+    regressed = []
+    print(f"{'scenario':10} {'seconds':>10} {'baseline':>10} {'ratio':>7} {'peak RSS KB':>12} {'bytes read':>12} {'bytes sent':>12}")
+    for name, res in results.items():
+        base = baseline.get(name)
+        ratio = res["seconds"] / base["seconds"] if base and base["seconds"] > 0 else None
+        print(f"{name:10} {res['seconds']:10.2f} {base['seconds'] if base else float('nan'):10.2f} "
+              f"{ratio if ratio else float('nan'):7.2f} {res['peak_rss_kb']:12} {_bytes(res['read']):>12} "
+              f"{_bytes(res['write']):>12}")
+        if ratio is not None and ratio > threshold:
+            regressed.append(name)
+    return regressed
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark notmuch-sync on a mail directory.")
+    parser.add_argument("source", help="mail directory to sync, e.g. the extracted notmuch-list archive")
+    parser.add_argument("-s", "--scenario", action="append", choices=SCENARIOS, help="scenario to run, can be given several times (default all)")
+    parser.add_argument("-f", "--fraction", type=float, default=0.1, help="fraction of messages to retag and rename, a tenth of that is deleted (default 0.1)")
+    parser.add_argument("--seed", type=int, default=1, help="seed for choosing messages (default 1)")
+    parser.add_argument("-b", "--baseline", help="JSON file with results to compare against")
+    parser.add_argument("--sync", default=SYNC, help="notmuch_sync.py to benchmark, e.g. from another git ref (default the one in this tree)")
+    parser.add_argument("-o", "--output", help="JSON file to write results to, e.g. to use as baseline later")
+    parser.add_argument("-t", "--threshold", type=float, default=1.25, help="ratio of wall time to baseline above which a scenario counts as regressed (default 1.25)")
+    args = parser.parse_args()
+
+    results = run(args.source, args.scenario or SCENARIOS, args.fraction, args.seed, args.sync)
+    if args.output:
+        with open(args.output, "w", encoding="utf-8") as f:
+            json.dump(results, f, indent=2)
+    baseline = {}
+    if args.baseline:
+        with open(args.baseline, "r", encoding="utf-8") as f:
+            baseline = json.load(f)
+    regressed = compare(results, baseline, args.threshold)
+    if regressed:
+        print(f"Regressed: {', '.join(regressed)}", file=sys.stderr)
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -4,18 +4,27 @@
 local and remote systems."""
 
 import argparse
-import asyncio
+import fcntl
+import filecmp
 import hashlib
 import json
 import logging
+import math
 import os
+import random
 import shlex
 import shutil
+import sqlite3
 import struct
 import subprocess
 import sys
+import threading
+import time
+import zlib
 
-from typing import Any, Dict, List, Tuple, Callable, IO
+from concurrent.futures import Future, ThreadPoolExecutor
+from contextlib import contextmanager
+from typing import Any, Dict, List, Tuple, Callable, IO, Iterable, Iterator
 
 from pathlib import Path
 from select import select
@@ -23,17 +32,162 @@ from select import select
 import notmuch2
 import xapian
 
+try:
+    from compression import zstd  # type: ignore
+except ImportError:
+    try:
+        import zstandard as zstd  # type: ignore
+    except ImportError:
+        zstd = None
+
+try:
+    import blake3  # type: ignore
+except ImportError:
+    blake3 = None
+
 logging.basicConfig(format="[{asctime}] {message}", style="{")
 logger = logging.getLogger(__name__)
 
 transfer = {"read": 0, "write": 0}
+# files may be transferred over several streams at the same time
+transfer_lock = threading.Lock()
+# threads for receiving while sending with run_async() on the main connection
+# and for loading state in prepare_phases(); functions submitted here never
+# submit to io_pool themselves or wait for each other, so the number of threads
+# only limits how many run at the same time. Helper streams in sync_files()
+# bring their own executor.
+io_pool = ThreadPoolExecutor(thread_name_prefix="notmuch-sync-io")
+
+# available compression methods, in order of preference; each maps to
+# functions to compress and decompress a frame
+COMPRESSORS: Dict[str, Tuple[Callable[[bytes], bytes], Callable[[bytes], bytes]]] = {}
+if zstd is not None:
+    COMPRESSORS["zstd"] = (zstd.compress, zstd.decompress)
+COMPRESSORS["zlib"] = (zlib.compress, zlib.decompress)
+# available hash functions for file digests, in order of preference; SHA256 is
+# what peers without the handshake use, and with the SHA extensions of current
+# CPUs faster than BLAKE2b
+HASHES: Dict[str, Callable[[], Any]] = {}
+if blake3 is not None:
+    HASHES["blake3"] = blake3.blake3
+HASHES["sha256"] = hashlib.sha256
+
+# frames smaller than this are never compressed
+COMPRESS_MIN = 256
+# set in the length prefix of compressed frames
+COMPRESSED_FLAG = 1 << 31
+
+# start of the handshake; not valid UTF-8, so peers that don't know about it
+# fail when trying to decode it as UUID
+HELLO = b"\xffNMS"
+PROTOCOL_VERSION = 1
+# supported protocol features, in order of preference
+CAPABILITIES = {
+    "files": ["chunked", "whole"],
+    "changes": ["binary", "json"],
+    "hashes": ["batched", "list"],
+    "compression": list(COMPRESSORS) + ["none"],
+    "streams": ["multi", "single"],
+    "deletes": ["bisect", "list"],
+    "delta": ["blocks", "none"],
+    "dedup": ["refs", "none"],
+    "digest": list(HASHES),
+    "rounds": ["multi", "single"],
+    "report": ["json", "none"],
+    "noop": ["skip", "full"],
+}
+# protocol features of peers that don't do the handshake
+LEGACY = {
+    "files": "whole",
+    "changes": "json",
+    "hashes": "list",
+    "compression": "none",
+    "streams": "single",
+    "deletes": "list",
+    "delta": "none",
+    "dedup": "none",
+    "digest": "sha256",
+    "rounds": "single",
+    "report": "none",
+    "noop": "full",
+}
+# protocol features in use for the current connection; frames are only
+# compressed and files transferred over several streams once both sides agreed
+# on it
+features = {key: values[0] for key, values in CAPABILITIES.items()}
+features["compression"] = "none"
+features["streams"] = "single"
+features["delta"] = "none"
+features["dedup"] = "none"
+features["digest"] = "sha256"
+features["rounds"] = "single"
+features["report"] = "none"
+features["noop"] = "full"
+
+# size of the chunks files are read, sent, and written in
+CHUNK_SIZE = 1 << 18
+# files of messages that exist on both sides are sent as differences to a
+# local file of the message if that is at least this large
+DELTA_MIN = 1 << 14
+# minimum size of the blocks files are compared in for sending differences
+DELTA_BLOCK = 1 << 10
+# stop looking for blocks the other side has after this many blocks worth of
+# data without any, the rest of the file is likely different as well
+DELTA_SEARCH = 64
+# number of digests sent in one go while files are still being hashed
+HASH_BATCH = 256
+# number of messages in one batch of changes
+CHANGES_BATCH = 1024
+# number of changes to the notmuch database in one atomic section
+DB_BATCH = 1000
+# number of cached digests not used in a sync that are checked for whether
+# their file still exists each time the cache is saved
+DIGEST_PRUNE = 1000
+# changed entries of the digest cache are appended to a log until the log has
+# more than one entry for this many in the cache, then the cache is rewritten
+DIGEST_LOG_RATIO = 8
+# with --watch, how often to check whether the local database has changed and
+# how long it has to stay unchanged before syncing, in seconds
+WATCH_POLL = 1
+WATCH_DEBOUNCE = 2
+# tags notmuch maps to maildir flags; file names only need to change if one of
+# these is added or removed
+FLAG_TAGS = frozenset(["draft", "flagged", "passed", "replied", "unread"])
+# number of bits of message ID hashes used to assign IDs to buckets
+ID_BUCKET_BITS = 16
+# average number of message IDs per bucket in summaries sent to the other side
+ID_BUCKET_SIZE = 256
+# number of bits by which buckets of message IDs that differ are split in each
+# round of reconciliation
+SPLIT_BITS = 4
+# buckets with at most this many message IDs on the remote aren't split further;
+# the hashes of their IDs are exchanged instead
+LEAF_SIZE = 16
+
+def header_end(data: bytes, end: int | None = None) -> int:
+    """
+    Find the empty line that separates the headers of an email from the body.
+
+    Args:
+        data (bytes): Start of the email.
+        end (int): Search only up to this index.
+
+    Returns:
+        int: Index of the newline before the empty line, or -1 if the data
+        doesn't contain the complete headers.
+    """
+    found = [i for i in (data.find(b"\n\n", 0, end), data.find(b"\n\r\n", 0, end)) if i != -1]
+    return min(found, default=-1)
+
 
 def digest(data: bytes) -> str:
     """
-    Compute SHA256 digest of data, removing any X-TUID: lines. This is
-    nececessary because mbsync adds these lines to keep track of internal
-    progress, but they make identical emails that were retrieved separately
-    different.
+    Compute digest of data with the negotiated hash function, removing the
+    first X-TUID: line. This is nececessary because mbsync adds these lines to
+    keep track of internal progress, but they make identical emails that were
+    retrieved separately different. mbsync only adds them to the headers; with
+    SHA256, the line is removed anywhere in the data for compatibility with
+    earlier versions.
 
     Args:
         data (bytes): The data to compute the checsum for.
@@ -42,40 +196,448 @@ def digest(data: bytes) -> str:
         The computed checksum.
     """
     pat = b"X-TUID: "
-    to_digest = data
-    start_idx = data.find(pat)
+    algorithm = features["digest"]
+    dig = HASHES[algorithm]()
+    # feed the parts around the X-TUID: line without copying them
+    view = memoryview(data)
+    end = None
+    if algorithm != "sha256":
+        body = header_end(data)
+        end = body if body != -1 else None
+    start_idx = data.find(pat, 0, end)
     if start_idx != -1:
-        search_start = start_idx + len(pat)
-        end_idx = data.find(b"\n", search_start)
+        end_idx = data.find(b"\n", start_idx + len(pat))
+        if end_idx != -1:
+            dig.update(view[:start_idx])
+            dig.update(view[end_idx + 1:])
+            return dig.hexdigest()
+
+    dig.update(view)
+    return dig.hexdigest()
 
+
+class Digest:
+    """
+    Incremental version of digest() for data that arrives in chunks. Produces
+    the same checksum as digest() on the concatenation of all chunks, i.e. the
+    first X-TUID: line is removed if it is terminated by a newline.
+    """
+    pat = b"X-TUID: "
+
+    def __init__(self) -> None:
+        self.algorithm = features["digest"]
+        self.hash = HASHES[self.algorithm]()
+        # see digest()
+        self.headers_only = self.algorithm != "sha256"
+        # data held back because it may be (part of) an X-TUID: line
+        self.held = b""
+        # "search" for pattern, "skip" X-TUID: line, or "pass" everything else
+        self.state = "search"
+
+    def update(self, data: bytes) -> None:
+        """
+        Add a chunk of data to the checksum.
+
+        Args:
+            data (bytes): The next chunk of data.
+        """
+        if self.state == "pass":
+            self.hash.update(data)
+            return
+
+        # newline search can continue where it left off
+        search_from = len(self.held)
+        self.held += data
+        view = memoryview(self.held)
+        if self.state == "search":
+            start_idx = self.held.find(self.pat)
+            if self.headers_only:
+                body = header_end(self.held, None if start_idx == -1 else start_idx)
+                if body != -1:
+                    # no X-TUID: in the headers
+                    self.hash.update(view)
+                    self.held = b""
+                    self.state = "pass"
+                    return
+            if start_idx == -1:
+                # keep anything that could be the start of the pattern or the
+                # end of the headers
+                keep = len(self.pat) - 1
+                self.hash.update(view[:-keep])
+                self.held = self.held[-keep:]
+                return
+            self.hash.update(view[:start_idx])
+            self.held = self.held[start_idx:]
+            self.state = "skip"
+            search_from = len(self.pat)
+            view = memoryview(self.held)
+
+        end_idx = self.held.find(b"\n", max(search_from, len(self.pat)))
         if end_idx != -1:
-            to_digest = data[:start_idx] + data[end_idx + 1:]
+            self.hash.update(view[end_idx + 1:])
+            self.held = b""
+            self.state = "pass"
+
+    def hexdigest(self) -> str:
+        """
+        Finish computing the checksum.
+
+        Returns:
+            The computed checksum.
+        """
+        # no newline after X-TUID: (or no X-TUID: at all) -- digest() does not
+        # remove anything in this case
+        self.hash.update(self.held)
+        self.held = b""
+        self.state = "pass"
+        return self.hash.hexdigest()
+
+
+def digest_file(fname: str) -> str:
+    """
+    Compute digest() of a file without reading it into memory all at once.
+
+    Args:
+        fname (str): Path to the file.
+
+    Returns:
+        The computed checksum.
+    """
+    start = time.monotonic()
+    size = 0
+    dig = Digest()
+    with open(fname, "rb") as f:
+        while chunk := f.read(CHUNK_SIZE):
+            dig.update(chunk)
+            size += len(chunk)
+    ret = dig.hexdigest()
+    stats.add("digest", seconds=time.monotonic() - start, files=1, bytes=size)
+    return ret
+
+
+def file_stamp(fname: str) -> Tuple[int, int] | None:
+    """
+    Get inode and modification time of a file, to tell whether a cache file
+    has been replaced since it was loaded or saved.
+
+    Args:
+        fname (str): Path to the file.
+
+    Returns:
+        tuple: Inode and modification time in nanoseconds, or None if the file
+        doesn't exist.
+    """
+    try:
+        st = os.stat(fname)
+    except FileNotFoundError:
+        return None
+    return (st.st_ino, st.st_mtime_ns)
+
+
+class DigestCache:
+    """
+    Cache of file digests, optionally persisted to disk. Entries are keyed by
+    file name (relative to the notmuch database path) and validated against
+    the inode, size, and modification time of the file; lookups for files that
+    aren't in the cache under their name also consider files with the same
+    inode, size, and modification time, which covers renamed files (e.g. mbsync
+    changing flags). Each entry holds the digests for all hash functions that
+    were used with the file, as different peers may use different ones. The
+    cache is only read again if the file has changed since it was last loaded
+    or saved, so that syncing with several remotes in one run reads it once.
+    Changed entries are appended to a log next to the file, which is only
+    merged into the file once it has grown large compared to it. Files are
+    hashed from several threads, so the cache is guarded by a lock, which is
+    not held while hashing.
+    """
+    version = 2
+
+    def __init__(self) -> None:
+        self.lock = threading.Lock()
+        self.fname: str | None = None
+        self.prefix = ""
+        self.entries: Dict[str, List[Any]] = {}
+        self.by_stat: Dict[Tuple[int, int, int], Dict[str, str]] = {}
+        self.used: set[str] = set()
+        # entries changed since the last save, None for removed ones
+        self.changed: Dict[str, List[Any] | None] = {}
+        # number of entries in the log, and whether it needs to be merged
+        self.logged = 0
+        self.compact = False
+        self.stamp: Tuple[Tuple[int, int] | None, Tuple[int, int] | None] = (None, None)
+
+    def load(self, fname: str, prefix: str) -> None:
+        """
+        Load cached digests from a file. A missing or corrupted file results
+        in an empty cache.
+
+        Args:
+            fname (str): File to load from and save to.
+            prefix (str): Prefix path for filenames (notmuch config database.path).
+        """
+        stamp = (file_stamp(fname), file_stamp(fname + ".log"))
+        self.used = set()
+        if (fname, prefix) == (self.fname, self.prefix) and stamp[0] is not None and stamp == self.stamp:
+            return
+        self.fname = fname
+        self.prefix = prefix
+        self.stamp = stamp
+        self.entries = {}
+        self.changed = {}
+        self.logged = 0
+        self.compact = False
+        try:
+            tmp = json.loads(Path(fname).read_text(encoding="utf-8"))
+            if tmp["version"] == self.version:
+                self.entries = tmp["entries"]
+            elif tmp["version"] == 1:
+                # only SHA256 digests
+                self.entries = {k: [*e[:3], {"sha256": e[3]}] for k, e in tmp["entries"].items()}
+        except FileNotFoundError:
+            pass
+        except (ValueError, KeyError, TypeError):
+            logger.info("Digest cache '%s' corrupted, ignoring.", fname)
+        try:
+            with open(fname + ".log", "r", encoding="utf-8") as f:
+                for line in f:
+                    key, entry = json.loads(line)
+                    if entry is None:
+                        self.entries.pop(key, None)
+                    else:
+                        self.entries[key] = entry
+                    self.logged += 1
+        except FileNotFoundError:
+            pass
+        except (ValueError, TypeError):
+            # e.g. interrupted while appending; the rest is lost
+            logger.info("Digest cache log '%s.log' corrupted, ignoring the rest.", fname)
+            self.compact = True
+        self.by_stat = { (e[0], e[1], e[2]): e[3] for e in self.entries.values() }
+        logger.info("Loaded %s cached digests.", len(self.entries))
+
+    def digest(self, fname: str) -> str:
+        """
+        Get digest_file() of a file, from the cache if possible.
+
+        Args:
+            fname (str): Path to the file.
+
+        Returns:
+            The checksum of the file.
+        """
+        st = os.stat(fname)
+        sig = (st.st_ino, st.st_size, st.st_mtime_ns)
+        key = fname.removeprefix(self.prefix)
+        algorithm = features["digest"]
+        with self.lock:
+            self.used.add(key)
+            entry = self.entries.get(key)
+            if entry is not None and (entry[0], entry[1], entry[2]) == sig:
+                if algorithm in entry[3]:
+                    return entry[3][algorithm]
+            dig = self.by_stat.get(sig, {}).get(algorithm)
+        if dig is None:
+            dig = digest_file(fname)
+        with self.lock:
+            # another thread may have added digests for the file meanwhile
+            entry = self.entries.get(key)
+            if entry is not None and (entry[0], entry[1], entry[2]) == sig:
+                digs = entry[3]
+            else:
+                digs = self.by_stat.get(sig, {})
+            digs[algorithm] = dig
+            self.by_stat[sig] = digs
+            self.entries[key] = [*sig, digs]
+            self.changed[key] = self.entries[key]
+        return dig
+
+    def cached(self, fname: str) -> str | None:
+        """
+        Get the digest_file() of a file if it is in the cache, e.g. because it
+        was hashed in an earlier sync, without hashing it.
+
+        Args:
+            fname (str): Path to the file.
+
+        Returns:
+            The checksum of the file, or None if it isn't known.
+        """
+        st = os.stat(fname)
+        sig = (st.st_ino, st.st_size, st.st_mtime_ns)
+        key = fname.removeprefix(self.prefix)
+        with self.lock:
+            entry = self.entries.get(key)
+            if entry is not None and (entry[0], entry[1], entry[2]) == sig:
+                self.used.add(key)
+                return entry[3].get(features["digest"])
+            return self.by_stat.get(sig, {}).get(features["digest"])
+
+    def save(self) -> None:
+        """
+        Save cached digests to the file they were loaded from, if anything
+        changed. Entries for files that weren't used and don't exist anymore
+        are dropped; as this takes a stat() for each, only a random sample of
+        DIGEST_PRUNE of them is checked each time.
+        """
+        with self.lock:
+            if self.fname is None:
+                return
+            unused = list(self.entries.keys() - self.used)
+            for key in random.sample(unused, min(len(unused), DIGEST_PRUNE)):
+                if not os.path.exists(os.path.join(self.prefix, key)):
+                    del self.entries[key]
+                    self.changed[key] = None
+            if len(self.changed) == 0 and not self.compact:
+                return
+            log = self.fname + ".log"
+            Path(self.fname).parent.mkdir(parents=True, exist_ok=True)
+            if self.compact or self.stamp[0] is None or \
+                    (self.logged + len(self.changed)) * DIGEST_LOG_RATIO > len(self.entries):
+                logger.info("Saving %s cached digests.", len(self.entries))
+                # the log would override newer entries in the file
+                Path(log).unlink(missing_ok=True)
+                tmp = self.fname + ".tmp"
+                Path(tmp).write_text(json.dumps({"version": self.version, "entries": self.entries}),
+                                     encoding="utf-8")
+                os.replace(tmp, self.fname)
+                self.logged = 0
+            else:
+                logger.info("Saving %s changed cached digests.", len(self.changed))
+                with open(log, "a", encoding="utf-8") as f:
+                    f.write("".join(json.dumps([key, entry]) + "\n" for key, entry in self.changed.items()))
+                self.logged += len(self.changed)
+            self.changed = {}
+            self.compact = False
+            self.stamp = (file_stamp(self.fname), file_stamp(log))
+
 
-    return hashlib.new("sha256", to_digest).hexdigest()
+digests = DigestCache()
+
+
+def count_transfer(direction: str, size: int) -> None:
+    """
+    Add to the number of bytes transferred.
+
+    Args:
+        direction (str): "read" or "write".
+        size (int): Number of bytes.
+    """
+    with transfer_lock:
+        transfer[direction] += size
+
+
+class Stats:
+    """
+    Timings and counters of the phases of a sync, for --stats. Each phase
+    records the time spent in it and the bytes received and sent over all
+    connections in the meantime; other counters (e.g. files or bytes hashed)
+    can be added to phases, also from several threads.
+    """
+    def __init__(self) -> None:
+        self.lock = threading.Lock()
+        self.phases: Dict[str, Dict[str, float]] = {}
+
+    def clear(self) -> None:
+        """
+        Remove all timings and counters.
+        """
+        with self.lock:
+            self.phases = {}
+
+    def add(self, name: str, **counts: float) -> None:
+        """
+        Add to the counters of a phase.
+
+        Args:
+            name (str): Name of the phase.
+            counts: Values to add to the counters of the same name.
+        """
+        with self.lock:
+            entry = self.phases.setdefault(name, {})
+            for key, value in counts.items():
+                entry[key] = entry.get(key, 0) + value
+
+    @contextmanager
+    def phase(self, name: str) -> Iterator[None]:
+        """
+        Context manager that records the time spent in a phase and the bytes
+        transferred during it.
+
+        Args:
+            name (str): Name of the phase.
+        """
+        start = time.monotonic()
+        read_start, write_start = transfer["read"], transfer["write"]
+        try:
+            yield
+        finally:
+            self.add(name, seconds=time.monotonic() - start,
+                     read=transfer["read"] - read_start, write=transfer["write"] - write_start)
+
+    def report(self) -> Dict[str, Dict[str, float]]:
+        """
+        Get all counters with throughput, in MB of data processed (or
+        transferred, if nothing else was counted) and files per second.
+
+        Returns:
+            dict: Counters by phase.
+        """
+        ret = {}
+        with self.lock:
+            for name, entry in self.phases.items():
+                tmp = dict(entry)
+                seconds = entry.get("seconds", 0)
+                if seconds > 0:
+                    size = entry.get("bytes", entry.get("read", 0) + entry.get("write", 0))
+                    tmp["mb_per_s"] = size / seconds / 1e6
+                    if "files" in entry:
+                        tmp["files_per_s"] = entry["files"] / seconds
+                ret[name] = tmp
+        return ret
+
+
+stats = Stats()
 
 
 def write(data: bytes, stream: IO[bytes] | None) -> None:
     """
-    Write data to a stream with a 4-byte length prefix.
+    Write data to a stream with a 4-byte length prefix. If compression is in
+    use and the data is at least COMPRESS_MIN bytes, it is compressed and the
+    highest bit of the length prefix set, unless compression doesn't make it
+    smaller (e.g. for already compressed attachments).
 
     Args:
         data (bytes): The data to write.
         stream: A writable stream supporting .write() and .flush().
+
+    Raises:
+        ValueError: If the data is too large for the length prefix.
     """
     if stream is None:
         return
-    stream.write(struct.pack("!I", len(data)))
-    transfer["write"] += 4
+    size = len(data)
+    # the highest bit is reserved for compression, whether or not it's used
+    if size >= COMPRESSED_FLAG:
+        raise ValueError(f"Tried to write {size} bytes, but at most {COMPRESSED_FLAG - 1} "
+                         "can be sent at once, aborting...")
+    if features["compression"] != "none" and size >= COMPRESS_MIN:
+        compressed = COMPRESSORS[features["compression"]][0](data)
+        if len(compressed) < size:
+            data = compressed
+            size = len(data) | COMPRESSED_FLAG
+    stream.write(struct.pack("!I", size))
+    count_transfer("write", 4)
     written = stream.write(data)
     if written < len(data):
         raise ValueError(f"Tried to write {len(data)} bytes, but wrote only {written}, aborting...")
-    transfer["write"] += len(data)
+    count_transfer("write", len(data))
     stream.flush()
 
 
 def read(stream: IO[bytes] | None) -> bytes:
     """
-    Read 4-byte length-prefixed data from a stream.
+    Read 4-byte length-prefixed data from a stream, decompressing it if it was
+    compressed by write().
 
     Args:
         stream: A readable stream supporting .read().
@@ -86,27 +648,357 @@ def read(stream: IO[bytes] | None) -> bytes:
     if stream is None:
         return b''
     size_data = stream.read(4)
-    transfer["read"] += 4
+    count_transfer("read", 4)
     size = struct.unpack("!I", size_data)[0]
+    compressed = features["compression"] != "none" and size & COMPRESSED_FLAG
+    if compressed:
+        size &= ~COMPRESSED_FLAG
     data = stream.read(size)
     if len(data) < size:
         raise ValueError(f"Tried to read {size} bytes, but read only {len(data)}, aborting...")
-    transfer["read"] += size
+    count_transfer("read", size)
+    if compressed:
+        data = COMPRESSORS[features["compression"]][1](data)
     return data
 
 
-def run_async(m1: Callable[[], Any], m2: Callable[[], Any]) -> None:
+def run_async(
+    m1: Callable[[], Any],
+    m2: Callable[[], Any],
+    pool: ThreadPoolExecutor | None = None
+) -> None:
     """
     Run two functions async. Used to read/write to streams at the same time.
+    The first function runs in the calling thread and the second one in a
+    thread of io_pool, which is kept for the entire run rather than starting
+    new threads for each phase of the sync. Returns once both functions have
+    finished, raising the exception of the first one that failed.
 
     Args:
         m1: One function.
         m2: Other function.
+        pool: Executor to run m2 in instead of io_pool, for callers that run
+            next to other users of io_pool and must not queue behind them.
+    """
+    future = (pool or io_pool).submit(m2)
+    try:
+        m1()
+    finally:
+        # wait for the other function even if this one failed, like the
+        # other side of the connection does
+        exc = future.exception()
+    if exc is not None:
+        raise exc
+
+
+def encode_varint(value: int, out: bytearray) -> None:
+    """
+    Append an unsigned integer to a buffer as variable-length (LEB128) integer.
+
+    Args:
+        value (int): The integer to encode.
+        out (bytearray): Buffer to append to.
+    """
+    while value >= 0x80:
+        out.append((value & 0x7F) | 0x80)
+        value >>= 7
+    out.append(value)
+
+
+def decode_varint(data: bytes, pos: int) -> Tuple[int, int]:
+    """
+    Decode a variable-length (LEB128) unsigned integer.
+
+    Args:
+        data (bytes): Buffer to decode from.
+        pos (int): Position in the buffer to start at.
+
+    Returns:
+        tuple: (decoded integer, position after the integer)
+    """
+    value = data[pos]
+    pos += 1
+    if value < 0x80:
+        return (value, pos)
+    value &= 0x7F
+    shift = 7
+    while True:
+        b = data[pos]
+        pos += 1
+        value |= (b & 0x7F) << shift
+        if b < 0x80:
+            return (value, pos)
+        shift += 7
+
+
+class Change:
+    """
+    Tags and files (relative to the notmuch database path) of a changed
+    message. Changesets can cover the entire database, so this is kept small:
+    tags and the folders of files are interned, so that each is stored only
+    once, and files are kept as a flat tuple of folder and name within the
+    folder. Tags and files can also be accessed as change["tags"] and
+    change["files"], so that code working on changes handles dicts of the same
+    form as well.
+    """
+    __slots__ = ("tags", "_files")
+
+    def __init__(self, tags: Iterable[str], files: Iterable[str]):
+        self.tags = tuple(sys.intern(tag) for tag in tags)
+        parts: List[str] = []
+        for f in files:
+            split = f.rfind("/") + 1
+            parts += (sys.intern(f[:split]), f[split:])
+        self._files = tuple(parts)
+
+    @property
+    def files(self) -> Tuple[str, ...]:
+        """Files of the message, relative to the notmuch database path."""
+        return tuple(map(str.__add__, self._files[::2], self._files[1::2]))
+
+    @classmethod
+    def from_message(cls, msg: notmuch2.Message, prefix: str) -> "Change":
+        """
+        Get the current tags and files of a message.
+
+        Args:
+            msg: A notmuch2.Message object.
+            prefix (str): Prefix path for filenames (notmuch config database.path).
+
+        Returns:
+            Change: The tags and files of the message.
+        """
+        return cls(msg.tags, (str(f).removeprefix(prefix) for f in msg.filenames()))
+
+    def __getitem__(self, key: str) -> Tuple[str, ...]:
+        return getattr(self, key)
+
+    def get(self, key: str, default: Any = None) -> Any:
+        """Get tags or files like dict.get()."""
+        return getattr(self, key, default)
+
+    def __eq__(self, other: object) -> bool:
+        if not isinstance(other, Change):
+            return NotImplemented
+        return self.tags == other.tags and self._files == other._files
+
+    def __repr__(self) -> str:
+        return f"Change(tags={list(self.tags)}, files={list(self.files)})"
+
+
+class ChangesEncoder:
+    """
+    Binary encoding of changesets. Changes are encoded in batches of messages;
+    each batch starts with the tags and folders that haven't been seen in a
+    previous batch, which are subsequently referenced by their index. Messages
+    are encoded as message ID, tag indices, and files as folder index and file
+    name within the folder. Strings and counts are prefixed with their length
+    as variable-length integers.
+    """
+
+    def __init__(self) -> None:
+        self.tags: Dict[str, int] = {}
+        self.folders: Dict[str, int] = {}
+
+    def _index(self, value: str, known: Dict[str, int], new: List[str]) -> int:
+        idx = known.get(value)
+        if idx is None:
+            idx = len(known)
+            known[value] = idx
+            new.append(value)
+        return idx
+
+    def encode(self, batch: List[Tuple[str, Dict[str, Any]]]) -> bytes:
+        """
+        Encode a batch of changes.
+
+        Args:
+            batch (list): (message ID, changes) tuples.
+
+        Returns:
+            bytes: The encoded batch.
+        """
+        new_tags: List[str] = []
+        new_folders: List[str] = []
+        body = bytearray()
+        encode_varint(len(batch), body)
+        for mid, change in batch:
+            tmp = mid.encode("utf-8")
+            encode_varint(len(tmp), body)
+            body += tmp
+            encode_varint(len(change["tags"]), body)
+            for tag in change["tags"]:
+                encode_varint(self._index(tag, self.tags, new_tags), body)
+            encode_varint(len(change["files"]), body)
+            for f in change["files"]:
+                split = f.rfind("/") + 1
+                encode_varint(self._index(f[:split], self.folders, new_folders), body)
+                tmp = f[split:].encode("utf-8")
+                encode_varint(len(tmp), body)
+                body += tmp
+
+        out = bytearray()
+        for new in [new_tags, new_folders]:
+            encode_varint(len(new), out)
+            for value in new:
+                tmp = value.encode("utf-8")
+                encode_varint(len(tmp), out)
+                out += tmp
+        return bytes(out + body)
+
+
+class ChangesDecoder:
+    """
+    Decoding of changesets encoded with ChangesEncoder, batch by batch.
+    """
+
+    def __init__(self) -> None:
+        self.tags: List[str] = []
+        self.folders: List[str] = []
+        self.changes: Dict[str, Change] = {}
+
+    def decode(self, data: bytes) -> None:
+        """
+        Decode a batch of changes and add them to self.changes.
+
+        Args:
+            data (bytes): The encoded batch.
+        """
+        pos = 0
+        for known in [self.tags, self.folders]:
+            num, pos = decode_varint(data, pos)
+            for _ in range(num):
+                size, pos = decode_varint(data, pos)
+                known.append(sys.intern(data[pos:pos + size].decode("utf-8")))
+                pos += size
+
+        num, pos = decode_varint(data, pos)
+        for _ in range(num):
+            size, pos = decode_varint(data, pos)
+            mid = data[pos:pos + size].decode("utf-8")
+            pos += size
+            ntags, pos = decode_varint(data, pos)
+            tags = []
+            for _ in range(ntags):
+                idx, pos = decode_varint(data, pos)
+                tags.append(self.tags[idx])
+            nfiles, pos = decode_varint(data, pos)
+            files = []
+            for _ in range(nfiles):
+                idx, pos = decode_varint(data, pos)
+                size, pos = decode_varint(data, pos)
+                files.append(self.folders[idx] + data[pos:pos + size].decode("utf-8"))
+                pos += size
+            self.changes[mid] = Change(tags, files)
+
+
+def send_changes(changes: Iterable[Tuple[str, Change]], stream: IO[bytes] | None) -> None:
+    """
+    Send changes to a stream in binary encoding, in batches of CHANGES_BATCH
+    messages with 4-byte length prefix, followed by an empty batch. Each batch
+    is sent as soon as it is complete, so changes can be sent while they are
+    still being computed. With the legacy protocol, changes are sent
+    JSON-encoded in one go.
+
+    Args:
+        changes: (message ID, tags and files) tuples.
+        stream: Writable stream.
+    """
+    if features["changes"] == "json":
+        write(json.dumps({mid: {"tags": list(change["tags"]), "files": list(change["files"])}
+                          for mid, change in changes}).encode("utf-8"), stream)
+        return
+    enc = ChangesEncoder()
+    batch = []
+    for item in changes:
+        batch.append(item)
+        if len(batch) == CHANGES_BATCH:
+            write(enc.encode(batch), stream)
+            batch = []
+    if len(batch) > 0:
+        write(enc.encode(batch), stream)
+    write(b'', stream)
+
+
+def recv_changes(stream: IO[bytes] | None) -> Dict[str, Change]:
+    """
+    Receive changes sent by send_changes() from a stream, decoding each batch
+    as it arrives.
+
+    Args:
+        stream: Readable stream.
+
+    Returns:
+        dict: Mapping of message IDs to their tags and files.
     """
-    async def _tmp():
-        await asyncio.gather(asyncio.to_thread(m1), asyncio.to_thread(m2))
+    if features["changes"] == "json":
+        return {mid: Change(change["tags"], change["files"])
+                for mid, change in json.loads(read(stream).decode("utf-8")).items()}
+    dec = ChangesDecoder()
+    while data := read(stream):
+        dec.decode(data)
+    return dec.changes
+
 
-    asyncio.run(_tmp())
+class ChangeCache:
+    """
+    Tags and files of local messages computed by get_changes(), shared between
+    the syncs with several remotes in one run, which each ask for the messages
+    changed since their own last sync. Entries are valid for the revision of
+    the database they are validated at; entries for messages that have changed
+    since are dropped. Only used while active, as entries are kept until
+    cleared.
+    """
+    def __init__(self) -> None:
+        self.active = False
+        self.clear()
+
+    def clear(self) -> None:
+        """
+        Remove all entries.
+        """
+        self.uuid = b""
+        self.rev = -1
+        self.changes: Dict[str, Change] = {}
+
+    def validate(self, db: notmuch2.Database, revision: notmuch2.DbRevision) -> None:
+        """
+        Drop entries for messages that have changed since the last validation.
+
+        Args:
+            db: An open notmuch2.Database object.
+            revision: Current database revision object, must have .uuid and .rev.
+        """
+        if revision.uuid != self.uuid:
+            self.clear()
+        elif revision.rev != self.rev:
+            for msg in db.messages(f"lastmod:{self.rev + 1}.."):
+                self.changes.pop(msg.messageid, None)
+        self.uuid = revision.uuid
+        self.rev = revision.rev
+
+    def get(self, msg: notmuch2.Message, prefix: str) -> Change:
+        """
+        Get Change.from_message() of a message, from the cache if possible.
+
+        Args:
+            msg: The notmuch2.Message.
+            prefix (str): Prefix path for filenames (notmuch config database.path).
+
+        Returns:
+            Change: Tags and files of the message.
+        """
+        if not self.active:
+            return Change.from_message(msg, prefix)
+        mid = msg.messageid
+        change = self.changes.get(mid)
+        if change is None:
+            change = Change.from_message(msg, prefix)
+            self.changes[mid] = change
+        return change
+
+
+change_cache = ChangeCache()
 
 
 def get_changes(
@@ -114,9 +1006,12 @@ def get_changes(
     revision: notmuch2.DbRevision,
     prefix: str,
     sync_file: str
-) -> Dict[str, Dict[str, Any]]:
+) -> Iterator[Tuple[str, Change]]:
     """
-    Get changes that happened since the last sync, or everything in the DB if no previous sync.
+    Get changes that happened since the last sync, or everything in the DB if
+    no previous sync. The sync state is checked right away, but changes are
+    only computed as they are iterated over, so that they can be sent while the
+    query is still running.
 
     Args:
         db: An open notmuch2.Database object.
@@ -125,7 +1020,7 @@ def get_changes(
         sync_file (str): Path to the file storing the sync state.
 
     Returns:
-        dict: Mapping of message IDs to their tags and files.
+        Iterator of (message ID, tags and files) tuples.
     """
     rev_prev = -1
     try:
@@ -145,22 +1040,336 @@ def get_changes(
         pass
 
     logger.info("Previous sync revision %s, current revision %s.", rev_prev, revision.rev)
-    return {msg.messageid: {"tags": list(msg.tags),
-                            "files": [str(f).removeprefix(prefix) for f in msg.filenames()]}
-                            for msg in db.messages(f"lastmod:{rev_prev + 1}..")}
+    if change_cache.active:
+        change_cache.validate(db, revision)
+    return ((msg.messageid, change_cache.get(msg, prefix))
+            for msg in db.messages(f"lastmod:{rev_prev + 1}.."))
+
+
+class AtomicBatches:
+    """
+    Group changes to the notmuch database into atomic sections of up to a given
+    number of changes, so that Xapian commits once per batch rather than once
+    per change. To be used as a context manager, calling step() after each
+    change.
+    """
+    def __init__(self, db: notmuch2.Database, size: int = DB_BATCH):
+        self.db = db
+        self.size = max(size, 1)
+        self.count = 0
+        self.ctx: Any = None
+
+    def __enter__(self) -> "AtomicBatches":
+        self.ctx = self.db.atomic()
+        self.ctx.__enter__()
+        return self
+
+    def __exit__(self, *exc: Any) -> Any:
+        return self.ctx.__exit__(*exc)
+
+    def step(self) -> None:
+        """
+        Record that a change has been made, and start a new atomic section if
+        the current one is full.
+        """
+        self.count += 1
+        if self.count >= self.size:
+            self.ctx.__exit__(None, None, None)
+            self.count = 0
+            self.__enter__()
+
+
+def sync_file(prefix: str, uuid: str) -> str:
+    """
+    Get the path of the file storing the state of the last sync with the other
+    side.
+
+    Args:
+        prefix (str): Prefix path for filenames (notmuch config database.path).
+        uuid (str): UUID of the notmuch database on the other side.
+
+    Returns:
+        str: Path of the sync state file.
+    """
+    return os.path.join(prefix, ".notmuch", "notmuch-sync-" + uuid)
+
+
+def state_path(prefix: str, name: str) -> str:
+    """
+    Get the path of a cache or other state of notmuch-sync that isn't specific
+    to the other side of a sync. These are kept in a directory of their own,
+    so that they can't be mistaken for the sync state files next to it.
+
+    Args:
+        prefix (str): Prefix path for filenames (notmuch config database.path).
+        name (str): Name of the file or directory.
+
+    Returns:
+        str: Path of the file or directory.
+    """
+    return os.path.join(prefix, ".notmuch", "notmuch-sync.d", name)
+
+
+def staging_dir(prefix: str, uuid: str) -> str:
+    """
+    Get the directory files received from the other side are written to until
+    they are added to the database. Files in there are complete and are kept
+    if the sync is interrupted, so that they don't have to be transferred
+    again.
+
+    Args:
+        prefix (str): Prefix path for filenames (notmuch config database.path).
+        uuid (str): UUID of the notmuch database on the other side.
+
+    Returns:
+        str: Path of the staging directory.
+    """
+    return state_path(prefix, "staging-" + uuid)
+
+
+# ioctl to share the data of one file with another on filesystems with
+# copy-on-write (e.g. btrfs, XFS) on Linux
+FICLONE = 0x40049409
+# ways of creating a copy of a file
+COPY_METHODS = ["copy", "reflink", "hardlink"]
+
+
+def copy_file(src: str, dst: str, method: str = "copy") -> None:
+    """
+    Copy a file, sharing its data with the original if possible. Reflinks fall
+    back to copying if the filesystem doesn't support them, hardlinks if source
+    and destination are on different filesystems. Hardlinks are safe for mail
+    files, which are only ever renamed and never changed, but mean that both
+    files have the same permissions and modification time.
+
+    Args:
+        src (str): Path of the file to copy.
+        dst (str): Path of the copy.
+        method (str): One of COPY_METHODS.
+    """
+    if method == "reflink":
+        try:
+            with open(src, "rb") as fsrc, open(dst, "wb") as fdst:
+                fcntl.ioctl(fdst.fileno(), FICLONE, fsrc.fileno())
+            shutil.copymode(src, dst)
+            return
+        except OSError as e:
+            logger.debug("Reflinking %s to %s failed (%s), copying.", src, dst, e)
+    elif method == "hardlink":
+        try:
+            os.link(src, dst)
+            return
+        except OSError as e:
+            logger.debug("Hardlinking %s to %s failed (%s), copying.", src, dst, e)
+    shutil.copy(src, dst)
+
+
+def fsync_paths(paths: Iterable[str]) -> None:
+    """
+    Flush files or directories to disk. Several are flushed at the same time,
+    so that the disk can order the writes rather than waiting for each one.
+
+    Args:
+        paths (iterable): Paths of files or directories.
+    """
+    def _fsync(path):
+        fd = os.open(path, os.O_RDONLY)
+        try:
+            os.fsync(fd)
+        finally:
+            os.close(fd)
+
+    with ThreadPoolExecutor() as pool:
+        list(pool.map(_fsync, paths))
+
+
+class PendingChanges:
+    """
+    Changes to files and the notmuch database that are determined while the
+    database is only open for reading, network transfers are ongoing, or both.
+    They are applied in one go once the database is open for writing, so that
+    other programs are locked out of the database only for a short time.
+    """
+    def __init__(self, prefix: str, staging: str, copy_method: str = "copy"):
+        self.prefix = prefix
+        self.staging = staging
+        # how to copy files, see copy_file()
+        self.copy_method = copy_method
+        # moves, copies, and deletions in the order they were determined
+        self.ops: List[Tuple[str, str, str]] = []
+        # received files with the tags to set for new messages
+        self.added: List[Tuple[str, List[str]]] = []
+
+    def copy(self, src: str, dst: str) -> None:
+        """Copy existing file of a message to a new file."""
+        self.ops.append(("copy", src, dst))
+
+    def move(self, src: str, dst: str) -> None:
+        """Move existing file of a message to a new file."""
+        self.ops.append(("move", src, dst))
+
+    def delete(self, fname: str) -> None:
+        """Remove file of a message from the database and delete it."""
+        self.ops.append(("delete", fname, ""))
+
+    def add(self, fname: str, tags: List[str]) -> None:
+        """Add file received to the staging directory."""
+        self.added.append((fname, tags))
+
+    def staged(self, fname: str) -> str:
+        """Get path in the staging directory of file relative to prefix."""
+        return os.path.join(self.staging, fname)
+
+    def apply(self, dbw: notmuch2.Database, batch_size: int = DB_BATCH) -> int:
+        """
+        Apply all changes. Moves and copies of files that have disappeared in
+        the meantime are skipped; they will be picked up by the next sync.
+
+        Args:
+            dbw: An open writable notmuch2.Database object.
+            batch_size (int): Number of changes in one atomic section of
+                database changes.
+
+        Returns:
+            int: Number of added messages.
+        """
+        messages = 0
+        with AtomicBatches(dbw, batch_size) as batch:
+            for op, src, dst in self.ops:
+                if op != "delete" and not os.path.exists(src):
+                    logger.warning("%s has disappeared, not %s to %s.", src,
+                                   "copying" if op == "copy" else "moving", dst)
+                    continue
+                if op == "copy":
+                    logger.info("Copying %s to %s.", src, dst)
+                    Path(dst).parent.mkdir(parents=True, exist_ok=True)
+                    copy_file(src, dst, self.copy_method)
+                    dbw.add(dst)
+                elif op == "move":
+                    logger.info("Moving %s to %s.", src, dst)
+                    Path(dst).parent.mkdir(parents=True, exist_ok=True)
+                    shutil.move(src, dst)
+                    dbw.add(dst)
+                    logger.info("Removing %s from DB.", src)
+                    dbw.remove(src)
+                else:
+                    logger.info("Removing %s from DB and deleting file.", src)
+                    dbw.remove(src)
+                    Path(src).unlink(missing_ok=True)
+                batch.step()
+
+            # received files have been flushed to disk by sync_files()
+            # already, only the directories they are moved to are left
+            for fname, _ in self.added:
+                Path(fname).parent.mkdir(parents=True, exist_ok=True)
+                os.replace(self.staged(fname.removeprefix(self.prefix)), fname)
+            fsync_paths(dict.fromkeys(os.path.dirname(fname) for fname, _ in self.added))
+
+            for fname, tags in self.added:
+                logger.info("Adding %s to DB.", fname)
+                msg, dup = dbw.add(fname)
+                if not dup:
+                    messages += 1
+                    with msg.frozen():
+                        logger.info("Setting tags %s for received %s.",
+                                    sorted(tags), msg.messageid)
+                        msg.tags.clear()
+                        for tag in tags:
+                            msg.tags.add(tag)
+                batch.step()
+
+        self.ops = []
+        self.added = []
+        shutil.rmtree(self.staging, ignore_errors=True)
+        return messages
+
+
+class DatabaseWriter:
+    """
+    Open the notmuch database for writing for short sections of the sync
+    only, checking each time that nothing else has changed it in the meantime.
+    To be used as a context manager, possibly several times.
+    """
+    def __init__(self, revision: notmuch2.DbRevision):
+        # revision all changes sent to the other side were computed at
+        self.base = revision
+        # revision at the end of the last section
+        self.last = revision.rev
+        # whether something else has changed the database since base
+        self.clean = True
+        self.changed_since: int | None = None
+        self.ctx: Any = None
+        self.dbw: Any = None
+        self.start = 0.0
+
+    def __enter__(self) -> notmuch2.Database:
+        self.start = time.monotonic()
+        self.ctx = notmuch2.Database(mode=notmuch2.Database.MODE.READ_WRITE)
+        self.dbw = self.ctx.__enter__()
+        revision = self.dbw.revision()
+        if revision.uuid != self.base.uuid:
+            self.ctx.__exit__(None, None, None)
+            raise ValueError(f"notmuch DB UUID changed to {revision.uuid.decode()} during sync, aborting...")
+        self.changed_since = None
+        if revision.rev != self.last:
+            logger.info("DB changed during sync (revision %s, expected %s).",
+                        revision.rev, self.last)
+            self.clean = False
+            self.changed_since = self.last
+        return self.dbw
+
+    def __exit__(self, *exc: Any) -> Any:
+        self.last = self.dbw.revision().rev
+        try:
+            return self.ctx.__exit__(*exc)
+        finally:
+            # time the database was open for writing, including the commit
+            stats.add("db_write", seconds=time.monotonic() - self.start, sections=1)
+
+    def changed(self, prefix: str) -> Dict[str, Change]:
+        """
+        Get the messages that something else has changed since the end of the
+        last section, in the same format as get_changes().
+
+        Args:
+            prefix (str): Prefix path for filenames (notmuch config database.path).
+
+        Returns:
+            dict: Mapping of message IDs to their tags and files.
+        """
+        if self.changed_since is None:
+            return {}
+        return {msg.messageid: Change.from_message(msg, prefix)
+                for msg in self.dbw.messages(f"lastmod:{self.changed_since + 1}..")}
+
+    def record(self, fname: str) -> None:
+        """
+        Record last sync revision. If something else has changed the database
+        during the sync, the revision the changes sent were computed at is
+        recorded so that those changes are sent next time.
+
+        Args:
+            fname: File to write to.
+        """
+        if self.clean:
+            record_sync(fname, self.dbw.revision())
+        else:
+            record_sync(fname, self.base)
 
 
 def sync_tags(
     db: notmuch2.Database,
-    changes_mine: Dict[str, Dict[str, Any]],
-    changes_theirs: Dict[str, Dict[str, Any]]
+    changes_mine: Dict[str, Change],
+    changes_theirs: Dict[str, Change]
 ) -> int:
     """
     Synchronize tags between local and remote changes. Applies tags from all
     remotely changed IDs to local messages with the same ID, overwriting any
     local tags. If an ID appears both in remote and local changes, take the
     union of all tags. If a message is not found locally, do nothing (will be
-    synced later).
+    synced later). Only tags that differ are added and removed, and maildir
+    flags are synced afterwards for the messages where tags that correspond to
+    flags changed, so that files are only renamed if necessary.
 
     Args:
         db: An open notmuch2.Database object.
@@ -171,130 +1380,294 @@ def sync_tags(
         int: Number of tag changes made.
     """
     changes = 0
+    flags = []
     for mid in changes_theirs:
-        tags = changes_theirs[mid]["tags"]
+        tags = set(changes_theirs[mid]["tags"])
         if mid in changes_mine:
-            tags = set(tags) | set(changes_mine[mid]["tags"])
-        tags = set(tags)
+            tags |= set(changes_mine[mid]["tags"])
         try:
             msg = db.find(mid)
             if msg.ghost:
                 continue
-            if tags != set(msg.tags):
+            current = set(msg.tags)
+            if tags != current:
                 logger.info("Setting tags %s for %s.", sorted(list(tags)), mid)
                 with msg.frozen():
                     changes += 1
-                    msg.tags.clear()
-                    for tag in sorted(list(tags)):
+                    for tag in sorted(list(current - tags)):
+                        msg.tags.discard(tag)
+                    for tag in sorted(list(tags - current)):
                         msg.tags.add(tag)
-                    msg.tags.to_maildir_flags()
+                if not FLAG_TAGS.isdisjoint(tags ^ current):
+                    flags.append(msg)
         except LookupError:
             # we don't have this message on our side, it will be added later
             # when syncing files
             pass
 
+    logger.info("Syncing maildir flags for %s messages.", len(flags))
+    for msg in flags:
+        msg.tags.to_maildir_flags()
+
     return changes
 
 
 def record_sync(fname: str, revision: notmuch2.DbRevision) -> None:
     """
-    Record last sync revision.
+    Record last sync revision. The file is left alone if it already has this
+    revision.
 
     Args:
         fname: File to write to.
         revision: Revision/UUID to record.
     """
+    state = f"{revision.rev} {revision.uuid.decode()}"
+    try:
+        with open(fname, 'r', encoding="utf-8") as f:
+            if f.read() == state:
+                logger.info("Last sync revision %s unchanged.", revision.rev)
+                return
+    except FileNotFoundError:
+        pass
     with open(fname, 'w', encoding="utf-8") as f:
         logger.info("Writing last sync revision %s.", revision.rev)
-        f.write(f"{revision.rev} {revision.uuid.decode()}")
+        f.write(state)
+
+
+def nothing_to_sync(changes_mine: Dict[str, Change], changes_theirs: Dict[str, Change]) -> bool:
+    """
+    Whether the rest of the sync of changes can be skipped after
+    initial_sync(), because neither side has sent any changes. Both sides come
+    to the same conclusion without further communication, and skip the tag
+    and file phases to go straight to deletes and mbsync files if enabled.
+
+    Args:
+        changes_mine (dict): Local changes.
+        changes_theirs (dict): Remote changes.
+
+    Returns:
+        bool: Whether both sides agreed to skip and there are no changes.
+    """
+    if features["noop"] != "skip" or len(changes_mine) > 0 or len(changes_theirs) > 0:
+        return False
+    logger.info("No changes on either side, skipping tags and files.")
+    return True
+
+
+def negotiate(
+    caps_local: Dict[str, List[str]],
+    caps_remote: Dict[str, List[str]]
+) -> Dict[str, str]:
+    """
+    Select protocol features supported by both sides. For each feature, the
+    first value in the local side's order of preference that is supported by
+    the remote side is chosen, falling back to the legacy protocol if there is
+    none.
+
+    Args:
+        caps_local (dict): Supported features of the local side.
+        caps_remote (dict): Supported features of the remote side.
+
+    Returns:
+        dict: The selected value for each feature.
+    """
+    ret = dict(LEGACY)
+    for key in LEGACY:
+        common = [v for v in caps_local.get(key, []) if v in caps_remote.get(key, [])]
+        if len(common) > 0:
+            ret[key] = common[0]
+    return ret
+
+
+def handshake(
+    from_stream: IO[bytes] | None,
+    to_stream: IO[bytes] | None,
+    local: bool,
+    caps: Dict[str, List[str]] | None = None,
+    role: str = "sync",
+    uuid: str | None = None
+) -> Dict[str, Any] | None:
+    """
+    Exchange supported protocol features with the other side and set the
+    features to use for this connection. The local side sends first; the
+    remote side only answers if the local side started with the handshake and
+    falls back to the legacy protocol otherwise. The remote side doesn't send
+    anything in that case, so the legacy protocol can continue as usual. For
+    additional connections on the local side, which share the features of the
+    main connection, the features are only checked to be the same.
+
+    Args:
+        from_stream: Stream to read from the other side, must support .peek().
+        to_stream: Stream to write to the other side.
+        local (bool): Whether this is the local side.
+        caps (dict): Supported features to announce, CAPABILITIES if not
+            given.
+        role (str): What the connection is used for, "sync" for the main
+            connection or "files" for additional connections to transfer
+            files.
+        uuid (str): UUID of the local notmuch database, sent for additional
+            connections so that the other side knows where to stage files.
+
+    Returns:
+        dict: Hello of the other side with protocol version, features, and
+        role, or None if the other side didn't do the handshake. In this
+        case, the connection cannot be used anymore on the local side.
+
+    Raises:
+        ValueError: If an additional connection would use different features
+        than the main connection.
+    """
+    if from_stream is None or to_stream is None:
+        return None
+    if caps is None:
+        caps = CAPABILITIES
+
+    # hellos are never compressed, whatever features other connections use
+    def _send_hello():
+        hello: Dict[str, Any] = {"version": PROTOCOL_VERSION, "role": role,
+                                 "features": caps}
+        if uuid is not None:
+            hello["uuid"] = uuid
+        data = json.dumps(hello).encode("utf-8")
+        to_stream.write(HELLO + struct.pack("!I", len(data)) + data)
+        to_stream.flush()
+        count_transfer("write", len(HELLO) + 4 + len(data))
+
+    def _recv_hello():
+        first = from_stream.peek(1)[:1] # type: ignore[attr-defined]
+        if len(first) == 0:
+            if local:
+                # remote exited without answering, e.g. one with the legacy
+                # protocol that didn't know the options it was started with
+                return None
+            raise ValueError("Connection closed during handshake, aborting...")
+        if first != HELLO[:1]:
+            return None
+        if from_stream.read(len(HELLO)) != HELLO:
+            raise ValueError("Invalid handshake, aborting...")
+        size = struct.unpack("!I", from_stream.read(4))[0]
+        data = from_stream.read(size)
+        if len(data) < size:
+            raise ValueError("Connection closed during handshake, aborting...")
+        count_transfer("read", len(HELLO) + 4 + size)
+        return json.loads(data.decode("utf-8"))
+
+    if local:
+        logger.info("Sending protocol features...")
+        _send_hello()
+    hello = _recv_hello()
+    shared = local and role != "sync"
+    if hello is None:
+        logger.info("Other side does not support protocol negotiation, using legacy protocol.")
+        if not shared:
+            features.update(LEGACY)
+        return None
+    logger.debug("Other side protocol version %s, features %s.", hello["version"], hello["features"])
+    if local:
+        negotiated = negotiate(caps, hello["features"])
+    else:
+        _send_hello()
+        negotiated = negotiate(hello["features"], caps)
+    if shared:
+        if negotiated != features:
+            raise ValueError(f"Additional connection would use protocol features {negotiated} instead of {features}, aborting...")
+        return hello
+    features.update(negotiated)
+    logger.info("Using protocol features %s.", features)
+    return hello
 
 
 def initial_sync(
-    dbw: notmuch2.Database,
+    db: notmuch2.Database,
     prefix: str,
     from_stream: IO[bytes] | None,
     to_stream: IO[bytes] | None
-) -> Tuple[Dict[str, Dict[str, Any]], Dict[str, Dict[str, Any]], int, str]:
+) -> Tuple[Dict[str, Change], Dict[str, Change], notmuch2.DbRevision, str]:
     """
-    Perform the initial synchronization of UUIDs and tag changes, which includes
-    applying any remote tag changes to messages that exist locally. UUIDs and
+    Perform the initial synchronization of UUIDs and tag changes. UUIDs and
     changes are communicated to/from the remote over the respective streams.
+    Remote tag changes are not applied here, so the database only needs to be
+    open for reading.
 
     Args:
-        dbw: An open writable notmuch2.Database object.
+        db: An open notmuch2.Database object.
         prefix (str): Prefix path for filenames (notmuch config database.path).
         from_stream: Stream to read from the remote.
         to_stream: Stream to write to the remote.
 
     Returns:
-        tuple: (local changes dict, remote changes dict, number of tag changes,
-                name of sync file)
+        tuple: (local changes dict, remote changes dict, revision the local
+                changes were computed at, remote UUID)
     """
-    revision = dbw.revision()
+    revision = db.revision()
     uuids = {}
     uuids["mine"] = revision.uuid.decode()
 
     def _send_uuid():
         logger.info("Sending UUID %s...", uuids["mine"])
         to_stream.write(uuids["mine"].encode("utf-8"))
-        transfer["write"] += 36
+        count_transfer("write", 36)
         to_stream.flush()
 
     def _recv_uuid():
         logger.info("Receiving UUID...")
         uuids["theirs"] = from_stream.read(36).decode("utf-8")
-        transfer["read"] += 36
+        count_transfer("read", 36)
 
     run_async(_send_uuid, _recv_uuid)
 
     logger.info("UUIDs synced.")
     logger.debug("Local UUID %s, remote UUID %s.", uuids["mine"], uuids["theirs"])
-    fname = os.path.join(prefix, ".notmuch", "notmuch-sync-" + uuids["theirs"])
-
-    changes = {}
+    changes: Dict[str, Dict[str, Change]] = {"mine": {}}
     logger.info("Computing local changes...")
-    changes["mine"] = get_changes(dbw, revision, prefix, fname)
+    computing = get_changes(db, revision, prefix, sync_file(prefix, uuids["theirs"]))
+
+    def _collect():
+        for mid, change in computing:
+            changes["mine"][mid] = change
+            yield (mid, change)
 
     def _send_changes():
         logger.info("Sending local changes...")
-        write(json.dumps(changes["mine"]).encode("utf-8"), to_stream)
+        send_changes(_collect(), to_stream)
 
     def _recv_changes():
         logger.info("Receiving remote changes...")
-        changes["theirs"] = json.loads(read(from_stream).decode("utf-8"))
+        changes["theirs"] = recv_changes(from_stream)
 
     run_async(_send_changes, _recv_changes)
 
     logger.info("Changes synced.")
     logger.debug("Local changes %s, remote changes %s.", changes["mine"], changes["theirs"])
-    tchanges = sync_tags(dbw, changes["mine"], changes["theirs"])
-    logger.info("Tags synced.")
 
-    return (changes["mine"], changes["theirs"], tchanges, fname)
+    return (changes["mine"], changes["theirs"], revision, uuids["theirs"])
 
 
 def get_missing_files(
-    dbw: notmuch2.Database,
+    db: notmuch2.Database,
     prefix: str,
-    changes_mine: Dict[str, Dict[str, Any]],
-    changes_theirs: Dict[str, Dict[str, Any]],
+    changes_mine: Dict[str, Change],
+    changes_theirs: Dict[str, Change],
     from_stream: IO[bytes] | None,
     to_stream: IO[bytes] | None,
+    pending: PendingChanges,
     move_on_change: bool = False
 ) -> Tuple[Dict[str, Dict[str, Any]], int, int]:
     """
     Determine which files are missing locally compared to the remote, and handle
-    file moves/copies based on SHA256 checksums. Delete any files that aren't
+    file moves/copies based on digests. Delete any files that aren't
     there on the remote anymore. This never deletes a message, only duplicate
-    files for a message.
+    files for a message. Moves, copies, and deletions are only recorded in
+    pending, so the database only needs to be open for reading.
 
     Args:
-        dbw: An open writable notmuch2.Database object.
+        db: An open notmuch2.Database object.
         prefix (str): Prefix path for filenames (notmuch config database.path).
         changes_mine (dict): Local changes.
         changes_theirs (dict): Remote changes.
         from_stream: Stream to read from the remote.
         to_stream: Stream to write to the remote.
+        pending: Changes to apply once the database is open for writing.
         move_on_change: Whether to move file that has local and remote changes.
         This flag is used to prevent infinite loops where local has one file
         name and remote another file name (e.g. when running mbsync independently).
@@ -304,22 +1677,26 @@ def get_missing_files(
                 local deletions)
     """
     ret = {}
-    mcchanges = 0
-    dchanges = 0
-    hashes: dict[str, List[str]] = {}
+    changes = {"mc": 0, "d": 0}
+    hashes: dict[str, Any] = {}
     # check which files we need to get digests for to determine if they've
-    # been moved/copied
+    # been moved/copied; remember for each message how many digests have to
+    # have arrived before it can be processed
     hashes["req_mine"] = []
+    hashes["req_until"] = {}
+    # local files of messages we have, looked up only once
+    local: Dict[str, Tuple[str, ...]] = {}
     for mid in changes_theirs:
         try:
-            msg = dbw.find(mid)
+            msg = db.find(mid)
             if msg.ghost:
                 continue
+            local[mid] = Change.from_message(msg, prefix).files
             fnames_theirs = changes_theirs[mid]["files"]
-            fnames_mine = [ str(f).removeprefix(prefix) for f in msg.filenames() ]
-            missing_mine = set(fnames_theirs) - set(fnames_mine)
+            missing_mine = set(fnames_theirs) - set(local[mid])
             if len(missing_mine) > 0:
                 hashes["req_mine"].extend(fnames_theirs)
+                hashes["req_until"][mid] = len(hashes["req_mine"])
         except LookupError:
             continue
 
@@ -328,229 +1705,1083 @@ def get_missing_files(
         logger.debug("Requesting hashes %s", hashes["req_mine"])
         write(json.dumps(hashes["req_mine"]).encode("utf-8"), to_stream)
 
-    def _recv_hashes_req():
-        logger.info("Receiving hash requests from remote...")
-        hashes["req_theirs"] = json.loads(read(from_stream).decode("utf-8"))
-        logger.debug("Hashes requested by remote %s", hashes["req_theirs"])
+    def _recv_hashes_req():
+        logger.info("Receiving hash requests from remote...")
+        hashes["req_theirs"] = json.loads(read(from_stream).decode("utf-8"))
+        logger.debug("Hashes requested by remote %s", hashes["req_theirs"])
+
+    run_async(_send_hashes_req, _recv_hashes_req)
+
+    def _send_hashes():
+        logger.info("Hashing %s requested files and sending to remote...",
+                    len(hashes["req_theirs"]))
+        fnames = [os.path.join(prefix, f) for f in hashes["req_theirs"]]
+        batch = []
+        with ThreadPoolExecutor() as pool:
+            if features["hashes"] == "list":
+                write(json.dumps(list(pool.map(digests.digest, fnames))).encode("utf-8"), to_stream)
+                return
+            # results come back in order as they are computed, send them off
+            # in batches without waiting for the rest
+            for dig in pool.map(digests.digest, fnames):
+                batch.append(dig)
+                if len(batch) == HASH_BATCH:
+                    write(json.dumps(batch).encode("utf-8"), to_stream)
+                    batch = []
+        if len(batch) > 0:
+            write(json.dumps(batch).encode("utf-8"), to_stream)
+
+    hashes["theirs"] = {}
+
+    def _recv_hashes(until: int):
+        while len(hashes["theirs"]) < until:
+            tmp = json.loads(read(from_stream).decode("utf-8"))
+            start = len(hashes["theirs"])
+            hashes["theirs"].update(zip(hashes["req_mine"][start:start + len(tmp)], tmp))
+
+    def _process():
+        logger.info("Receiving hashes from remote...")
+        if features["hashes"] == "list":
+            tmp = json.loads(read(from_stream).decode("utf-8"))
+            hashes["theirs"] = dict(zip(hashes["req_mine"], tmp))
+        # now actually determine changes and move/copy as soon as the hashes
+        # for a message have arrived
+        for mid in changes_theirs:
+            if mid in hashes["req_until"]:
+                _recv_hashes(hashes["req_until"][mid])
+            _process_msg(mid)
+
+    def _process_msg(mid: str):
+        if mid not in local:
+            # don't have this message; all files missing
+            ret[mid] = changes_theirs[mid]
+            return
+        fnames_theirs = changes_theirs[mid]["files"]
+        fnames_mine = list(local[mid])
+        missing_mine = set(fnames_theirs) - set(fnames_mine)
+        if len(missing_mine) > 0:
+            hashes_mine = {f: hashes["mine"][f].result() for f in local[mid]}
+            for f in changes_theirs[mid]["files"]:
+                if f in missing_mine:
+                    # check if it has been moved/copied
+                    matches = [x[0] for x in hashes_mine.items() if hashes["theirs"][f] == x[1]]
+                    if len(matches) > 0:
+                        src = os.path.join(prefix, matches[0])
+                        dst = os.path.join(prefix, f)
+                        if matches[0] in changes_theirs[mid]["files"]:
+                            changes["mc"] += 1
+                            pending.copy(src, dst)
+                            fnames_mine.append(f)
+                        elif mid not in changes_mine or move_on_change:
+                            changes["mc"] += 1
+                            pending.move(src, dst)
+                            fnames_mine.append(f)
+                            fnames_mine.remove(matches[0])
+                            hashes_mine[f] = hashes_mine[matches[0]]
+                            del hashes_mine[matches[0]]
+                        missing_mine.remove(f)
+        # check which ones are still missing
+        if len(missing_mine) > 0:
+            ret[mid] = {"files": [f for f in changes_theirs[mid]["files"] if f in missing_mine]}
+            if features["delta"] != "none":
+                # only differences to an existing file need to be sent
+                ret[mid]["basis"] = os.path.join(prefix, local[mid][0])
+
+        # delete any files that are not there remotely after copy/move
+        if mid not in changes_mine:
+            if len(set(fnames_mine).intersection(fnames_theirs)) == 0:
+                raise ValueError(f"Message '{mid}' has {fnames_theirs} on remote and different {fnames_mine} locally!")
+            to_delete = set(fnames_mine) - set(fnames_theirs)
+            for f in to_delete:
+                changes["d"] += 1
+                pending.delete(os.path.join(prefix, f))
+
+    # digests of the local files of messages that may have had files moved or
+    # copied, computed in parallel while the remote's hashes are requested and
+    # arrive, in the order the messages are processed in
+    candidates = dict.fromkeys(f for mid in hashes["req_until"] for f in local[mid])
+    with ThreadPoolExecutor() as pool:
+        hashes["mine"] = {f: pool.submit(digests.digest, os.path.join(prefix, f)) for f in candidates}
+        run_async(_send_hashes, _process)
+
+    return (ret, changes["mc"], changes["d"])
+
+
+def file_signature(fname: str) -> bytes:
+    """
+    Compute the signature of a file for receiving it as differences to another
+    file: the block size followed by the Adler-32 checksum and first 8 bytes
+    of the BLAKE2b digest of each complete block. The block size grows with
+    the square root of the file size, so that the signature stays small
+    compared to the file.
+
+    Args:
+        fname (str): Path to the file the differences will be relative to.
+
+    Returns:
+        bytes: Signature, empty if the file is too small to be worth it.
+    """
+    size = os.path.getsize(fname)
+    if size < DELTA_MIN:
+        return b''
+    block = max(DELTA_BLOCK, math.isqrt(size))
+    sig = bytearray(struct.pack("!I", block))
+    with open(fname, "rb") as f:
+        while len(data := f.read(block)) == block:
+            sig += struct.pack("!I", zlib.adler32(data))
+            sig += hashlib.blake2b(data, digest_size=8).digest()
+    return bytes(sig)
+
+
+def send_delta(fname: str, signature: bytes, stream: IO[bytes] | None) -> None:
+    """
+    Send a file as differences to the file the signature was computed for on
+    the other side, as sent by file_signature(). The file is scanned for
+    blocks the other side has at every offset, so that blocks that only moved
+    are found too, until there were none for DELTA_SEARCH blocks. The
+    differences are sent as one frame for each instruction:
+    "C" with 4 bytes unsigned int index of the first block and 4 bytes
+    unsigned int number of blocks to copy from the other side's file, "L" with
+    literal data of at most CHUNK_SIZE bytes, and finally "D" with the first
+    16 bytes of the BLAKE2b digest of the entire file, followed by an empty
+    frame.
+
+    Args:
+        fname (str): Path to the file to send.
+        signature (bytes): Signature of the other side's file.
+        stream: Writable stream.
+    """
+    block = struct.unpack_from("!I", signature)[0]
+    blocks: Dict[int, List[Tuple[int, bytes]]] = {}
+    for idx in range((len(signature) - 4) // 12):
+        weak, strong = struct.unpack_from("!I8s", signature, 4 + 12 * idx)
+        blocks.setdefault(weak, []).append((idx, strong))
+
+    dig = hashlib.blake2b(digest_size=16)
+    buf = bytearray()
+    run: List[int] = []
+    # offsets in the file of the start of buf, the next position to look for
+    # a block at, the start of the data that hasn't been sent yet, and the end
+    # of the last block found; only the unsent data and what has been read
+    # ahead is kept in buf, i.e. at most a block and two chunks
+    pos = literal = found = base = 0
+
+    def _flush(view: memoryview, end: int):
+        nonlocal literal
+        if len(run) > 0:
+            write(b"C" + struct.pack("!II", *run), stream)
+            run.clear()
+        for start in range(literal, end, CHUNK_SIZE):
+            write(b"L" + view[start - base:min(start + CHUNK_SIZE, end) - base], stream)
+        literal = end
+
+    with open(fname, "rb") as f:
+        while chunk := f.read(CHUNK_SIZE):
+            dig.update(chunk)
+            del buf[:literal - base]
+            base = literal
+            buf += chunk
+            with memoryview(buf) as view:
+                while pos + block <= base + len(buf) and pos - found < DELTA_SEARCH * block:
+                    start = pos - base
+                    candidates = blocks.get(zlib.adler32(view[start:start + block]))
+                    if candidates is not None:
+                        strong = hashlib.blake2b(view[start:start + block], digest_size=8).digest()
+                        matches = [idx for idx, s in candidates if s == strong]
+                        if len(matches) > 0:
+                            if literal < pos or len(run) == 0 or run[0] + run[1] not in matches:
+                                _flush(view, pos)
+                                run.extend([matches[0], 0])
+                            run[1] += 1
+                            pos += block
+                            literal = found = pos
+                            continue
+                    pos += 1
+                    if pos - literal >= CHUNK_SIZE:
+                        _flush(view, literal + CHUNK_SIZE)
+                if pos - found >= DELTA_SEARCH * block:
+                    # not looking for blocks anymore, send everything
+                    _flush(view, base + len(buf))
+        with memoryview(buf) as view:
+            _flush(view, base + len(buf))
+    write(b"D" + dig.digest(), stream)
+    write(b'', stream)
+
+
+def recv_delta(stream: IO[bytes], basis: str, signature: bytes) -> Iterator[bytes]:
+    """
+    Receive the differences of a file sent by send_delta() and reconstruct the
+    file.
+
+    Args:
+        stream: Readable stream.
+        basis (str): Path to the file the signature was computed for.
+        signature (bytes): Signature sent to the other side.
+
+    Returns:
+        iterator: The chunks of the file.
+
+    Raises:
+        ValueError: If the reconstructed file doesn't match the one sent.
+    """
+    block = struct.unpack_from("!I", signature)[0]
+    dig = hashlib.blake2b(digest_size=16)
+    checked = False
+    with open(basis, "rb") as f:
+        while frame := read(stream):
+            if frame[:1] == b"C":
+                start, count = struct.unpack_from("!II", frame, 1)
+                f.seek(start * block)
+                left = count * block
+                while left > 0:
+                    data = f.read(min(left, CHUNK_SIZE))
+                    if len(data) == 0:
+                        raise ValueError(f"Differences to '{basis}' refer to data beyond its end!")
+                    left -= len(data)
+                    dig.update(data)
+                    yield data
+            elif frame[:1] == b"L":
+                dig.update(frame[1:])
+                yield frame[1:]
+            elif frame[:1] == b"D":
+                if frame[1:] != dig.digest():
+                    raise ValueError(f"File received as differences to '{basis}' is corrupted!")
+                checked = True
+    if not checked:
+        raise ValueError(f"File received as differences to '{basis}' is incomplete!")
+
+
+def send_file(fname: str, stream: IO[bytes], signature: bytes = b'') -> None:
+    """
+    Send a file's contents to a stream in chunks of at most CHUNK_SIZE bytes,
+    each with 4-byte length prefix, followed by an empty chunk. The file is
+    never read into memory all at once, except with the legacy protocol, where
+    it is sent in one go.
+
+    Args:
+        fname (str): Path to the file to send.
+        stream: Writable stream.
+        signature (bytes): Signature of a file on the other side to send
+        differences to, see send_delta().
+    """
+    if len(signature) > 0:
+        send_delta(fname, signature, stream)
+        return
+    with open(fname, "rb") as f:
+        if features["files"] == "whole":
+            write(f.read(), stream)
+            return
+        while chunk := f.read(CHUNK_SIZE):
+            write(chunk, stream)
+    write(b'', stream)
+
+
+def recv_chunks(stream: IO[bytes]) -> Iterator[bytes]:
+    """
+    Receive the chunks of a file sent by send_file().
+
+    Args:
+        stream: Readable stream.
+
+    Returns:
+        iterator: The chunks of the file.
+    """
+    if features["files"] == "whole":
+        yield read(stream)
+        return
+    while chunk := read(stream):
+        yield chunk
+
+
+def recv_file(
+    fname: str,
+    stream: IO[bytes],
+    overwrite_raise: bool=True,
+    staged: str | None = None,
+    basis: str | None = None,
+    signature: bytes = b''
+) -> None:
+    """
+    Receive a file in chunks from a stream (as sent by send_file()) and write
+    it to disk. Chunks are written to a temporary file next to the destination
+    as they arrive, which is then renamed to the destination, so that
+    destination files are always complete.
+
+    Args:
+        fname (str): Destination file path.
+        stream: Readable stream.
+        overwrite_raise: Raise error if existing file would be overwritten
+        with different content.
+        staged (str): Path to write the file to instead of the destination,
+        to be moved there later.
+        basis (str): Path to the file the file is sent as differences to.
+        signature (bytes): Signature of basis sent to the other side, empty
+        if the file is sent in full.
+
+    Raises:
+        ValueError: If file to receive already exists with different checksum.
+    """
+    dig = Digest() if overwrite_raise and Path(fname).exists() else None
+    dst = fname if staged is None else staged
+    Path(dst).parent.mkdir(parents=True, exist_ok=True)
+    tmp = os.path.join(os.path.dirname(dst), f".{os.path.basename(dst)}.notmuch-sync")
+    try:
+        with open(tmp, "wb") as f:
+            chunks = recv_chunks(stream) if basis is None or len(signature) == 0 \
+                else recv_delta(stream, basis, signature)
+            for chunk in chunks:
+                if dig is not None:
+                    dig.update(chunk)
+                f.write(chunk)
+        if dig is not None and dig.hexdigest() != digests.digest(fname):
+            raise ValueError(f"Receiving '{fname}', but already exists with different content!")
+        os.replace(tmp, dst)
+    except BaseException:
+        Path(tmp).unlink(missing_ok=True)
+        raise
+
+
+def find_duplicates(prefix: str, fnames: List[str], mids: Dict[str, str] | None = None) -> Dict[int, int]:
+    """
+    Find files with the same content in a list of files. Files are hashed
+    only if their digest isn't cached already and another file of the same
+    message is in the list, which is where duplicates usually come from (e.g.
+    a mail stored in several folders); files with the same digest are compared
+    byte by byte, as the digest ignores X-TUID lines.
+
+    Args:
+        prefix (str): Prefix path for filenames (notmuch config database.path).
+        fnames (list): File names relative to prefix.
+        mids (dict): Message IDs by file name relative to prefix.
+
+    Returns:
+        dict: Mapping of the index of each duplicate to the index of the first
+        file with the same content.
+    """
+    if mids is None:
+        mids = {}
+    files: Dict[str, int] = {}
+    for fname in fnames:
+        if fname in mids:
+            files[mids[fname]] = files.get(mids[fname], 0) + 1
+    digs = {}
+    todo = []
+    for idx, fname in enumerate(fnames):
+        dig = digests.cached(os.path.join(prefix, fname))
+        if dig is not None:
+            digs[idx] = dig
+        elif files.get(mids.get(fname, ""), 0) > 1:
+            todo.append(idx)
+    with ThreadPoolExecutor() as pool:
+        digs.update(zip(todo, pool.map(digests.digest, [os.path.join(prefix, fnames[idx]) for idx in todo])))
+    counts: Dict[str, int] = {}
+    for dig in digs.values():
+        counts[dig] = counts.get(dig, 0) + 1
+    same = [idx for idx, dig in digs.items() if counts[dig] > 1]
+
+    ret = {}
+    firsts: Dict[str, List[int]] = {}
+    for idx in sorted(same):
+        for first in firsts.setdefault(digs[idx], []):
+            if filecmp.cmp(os.path.join(prefix, fnames[first]), os.path.join(prefix, fnames[idx]), shallow=False):
+                ret[idx] = first
+                break
+        else:
+            firsts[digs[idx]].append(idx)
+    return ret
+
+
+def sync_files(
+    prefix: str,
+    missing: Dict[str, Dict[str, Any]],
+    from_stream: IO[bytes] | None,
+    to_stream: IO[bytes] | None,
+    pending: PendingChanges,
+    helpers: List[Tuple[IO[bytes], IO[bytes]]] | None = None,
+    changes: Dict[str, Change] | None = None
+) -> int:
+    """
+    Synchronize files that are missing locally or remotely. If the other side
+    supports it, files are distributed round-robin over the given stream and
+    the streams of additional connections to the other side, which are served
+    by serve_files(). Received files are kept in the staging directory and
+    recorded in pending, to be added to the database once the database is
+    open for writing. Files that are in the staging directory already because
+    an earlier sync was interrupted are not requested again. Files with the
+    same content as another requested file are only sent once and copied on
+    the receiving side.
+
+    Args:
+        prefix (str): Prefix path for filenames (notmuch config database.path).
+        missing (dict): Mapping of missing files by message ID.
+        from_stream: Stream to read file names and files from.
+        to_stream: Stream to send file names and files to.
+        pending: Changes to apply once the database is open for writing.
+        helpers (list): Streams to read from and write to for each additional
+            connection on the local side, None on the remote side.
+        changes (dict): Local changes the other side requests files of, to
+            find files of the same message with the same content.
+
+    Returns:
+        int: Number of received files.
+    """
+    files = {}
+    files["mine"] = []
+    for mid in missing:
+        for f in missing[mid]["files"]:
+            if os.path.exists(pending.staged(f)):
+                logger.info("Using %s received earlier.", f)
+            else:
+                files["mine"].append({"name": f, "id": mid, "basis": missing[mid].get("basis")})
+
+    def _send_fnames():
+        logger.info("Sending file names missing on local...")
+        write(json.dumps([f["name"] for f in files["mine"]]).encode("utf-8"), to_stream)
+
+    def _recv_fnames():
+        logger.info("Receiving file names missing on remote...")
+        files["theirs"] = json.loads(read(from_stream).decode("utf-8"))
+
+    run_async(_send_fnames, _recv_fnames)
+
+    logger.info("Missing file names synced.")
+
+    # the local side decides how many streams to use
+    streams = 1
+    if features["streams"] == "multi":
+        if helpers is not None:
+            streams = len(helpers) + 1
+            write(json.dumps(streams).encode("utf-8"), to_stream)
+        else:
+            streams = json.loads(read(from_stream).decode("utf-8"))
+
+    # duplicates are sent as references to the first file with the same content
+    dups: Dict[str, Dict[int, int]] = {"mine": {}, "theirs": {}}
+    if features["dedup"] == "refs":
+        def _send_dups():
+            requested = set(files["theirs"])
+            mids = {f: mid for mid, change in (changes or {}).items() if requested
+                    for f in change["files"] if f in requested}
+            dups["theirs"] = find_duplicates(prefix, files["theirs"], mids)
+            logger.info("Sending %s files with the same content as others as references...",
+                        len(dups["theirs"]))
+            write(json.dumps(list(dups["theirs"].items())).encode("utf-8"), to_stream)
+
+        def _recv_dups():
+            dups["mine"] = dict(json.loads(read(from_stream).decode("utf-8")))
+
+        run_async(_send_dups, _recv_dups)
+
+    def _signature(f):
+        if f["basis"] is None:
+            return b''
+        try:
+            return file_signature(f["basis"])
+        except OSError:
+            # basis has disappeared, get the entire file
+            return b''
+
+    # signatures of local files of the same messages for files transferred
+    # over the main stream, so that only differences need to be sent
+    sigs = {"mine": [b''] * len(files["mine"]), "theirs": [b''] * len(files["theirs"])}
+    if features["delta"] == "blocks":
+        def _send_sigs():
+            for idx, f in enumerate(files["mine"]):
+                if idx % streams == 0 and idx not in dups["mine"]:
+                    sigs["mine"][idx] = _signature(f)
+                write(sigs["mine"][idx], to_stream)
+
+        def _recv_sigs():
+            sigs["theirs"] = [read(from_stream) for _ in files["theirs"]]
+
+        run_async(_send_sigs, _recv_sigs)
+
+    def _send_files():
+        for idx, fname in enumerate(files["theirs"]):
+            if idx % streams == 0 and idx not in dups["theirs"]:
+                logger.info("%s/%s Sending %s...", idx + 1, len(files["theirs"]),
+                            fname)
+                send_file(os.path.join(prefix, fname), to_stream, sigs["theirs"][idx])
+
+    def _recv_files():
+        for idx, f in enumerate(files["mine"]):
+            if idx % streams == 0 and idx not in dups["mine"]:
+                logger.info("%s/%s Receiving %s...", idx + 1, len(files["mine"]), f["name"])
+                dst = os.path.join(prefix, f["name"])
+                recv_file(dst, from_stream, staged=pending.staged(f["name"]),
+                          basis=f["basis"], signature=sigs["mine"][idx])
+
+    def _helper(num, hfrom, hto, recv_pool):
+        push = [f for idx, f in enumerate(files["mine"])
+                if idx % streams == num and idx not in dups["mine"]]
+        pull = [f for idx, f in enumerate(files["theirs"])
+                if idx % streams == num and idx not in dups["theirs"]]
+        write(json.dumps([f["name"] for f in push]).encode("utf-8"), hto)
+        write(json.dumps(pull).encode("utf-8"), hto)
+        # the other side only sends differences for files it sends over this
+        # stream, it doesn't know about local files for files it receives
+        push_sigs = [b''] * len(push)
+        if features["delta"] == "blocks":
+            push_sigs = [_signature(f) for f in push]
+            for sig in push_sigs:
+                write(sig, hto)
+
+        def _send_helper():
+            for fname in pull:
+                logger.info("Sending %s on stream %s...", fname, num)
+                send_file(os.path.join(prefix, fname), hto)
+
+        def _recv_helper():
+            for f, sig in zip(push, push_sigs):
+                logger.info("Receiving %s on stream %s...", f["name"], num)
+                recv_file(os.path.join(prefix, f["name"]), hfrom,
+                          staged=pending.staged(f["name"]), basis=f["basis"],
+                          signature=sig)
+            # the other side is done writing files it received
+            read(hfrom)
+
+        run_async(_send_helper, _recv_helper, recv_pool)
+
+    if streams > 1 and helpers is not None:
+        # each helper receives in a thread of its own pool, so that receiving
+        # never waits for a free thread while the other side is sending
+        with ThreadPoolExecutor(max_workers=len(helpers)) as pool, \
+                ThreadPoolExecutor(max_workers=len(helpers),
+                                   thread_name_prefix="notmuch-sync-helper") as recv_pool:
+            futures = [pool.submit(_helper, num + 1, hfrom, hto, recv_pool)
+                       for num, (hfrom, hto) in enumerate(helpers)]
+            run_async(_send_files, _recv_files)
+            for future in futures:
+                future.result()
+        # all files transferred
+        write(b'', to_stream)
+    else:
+        run_async(_send_files, _recv_files)
+        if streams > 1:
+            read(from_stream)
+
+    for idx, first in dups["mine"].items():
+        src = pending.staged(files["mine"][first]["name"])
+        dst = pending.staged(files["mine"][idx]["name"])
+        fname = os.path.join(prefix, files["mine"][idx]["name"])
+        if Path(fname).exists() and digests.digest(fname) != digest_file(src):
+            raise ValueError(f"Receiving '{fname}', but already exists with different content!")
+        logger.info("Copying received %s to %s.", src, dst)
+        Path(dst).parent.mkdir(parents=True, exist_ok=True)
+        copy_file(src, dst, pending.copy_method)
+
+    received = 0
+    for mid in missing:
+        for f in missing[mid]["files"]:
+            pending.add(os.path.join(prefix, f), missing[mid].get("tags", []))
+            received += 1
+    # received files have to be on disk before they are moved into place and
+    # indexed, so that the database never has files that are incomplete after
+    # a crash; this is done here so that the database isn't locked meanwhile
+    fsync_paths([pending.staged(f) for mid in missing for f in missing[mid]["files"]])
+
+    logger.info("Missing files synced.")
+
+    return received
+
+
+def serve_files(
+    prefix: str,
+    staging: str,
+    from_stream: IO[bytes],
+    to_stream: IO[bytes]
+) -> None:
+    """
+    Serve an additional connection used by sync_files() on the local side to
+    transfer files: receive the names of the files to send and receive, send
+    and receive them, and signal that all received files have been written.
+    Received files are written to the staging directory, where the main
+    connection picks them up.
+
+    Args:
+        prefix (str): Prefix path for filenames (notmuch config database.path).
+        staging (str): Staging directory for files from the other side.
+        from_stream: Stream to read file names and files from.
+        to_stream: Stream to send files to.
+    """
+    push = json.loads(read(from_stream).decode("utf-8"))
+    pull = json.loads(read(from_stream).decode("utf-8"))
+    sigs = [b''] * len(push)
+    if features["delta"] == "blocks":
+        sigs = [read(from_stream) for _ in push]
+
+    def _send_files():
+        for fname, sig in zip(push, sigs):
+            send_file(os.path.join(prefix, fname), to_stream, sig)
+
+    def _recv_files():
+        for fname in pull:
+            recv_file(os.path.join(prefix, fname), from_stream,
+                      staged=os.path.join(staging, fname))
+
+    run_async(_send_files, _recv_files)
+    write(b'', to_stream)
+
 
-    run_async(_send_hashes_req, _recv_hashes_req)
+def get_ids(prefix: str) -> Iterator[str]:
+    """
+    Get all message IDs from the notmuch database, using Xapian directly (much
+    faster).
 
-    def _send_hashes():
-        logger.info("Hashing %s requested files and sending to remote...",
-                    len(hashes["req_theirs"]))
-        tmp = [digest(Path(os.path.join(prefix, f)).read_bytes()) for f in hashes["req_theirs"]]
-        write(json.dumps(tmp).encode("utf-8"), to_stream)
+    The message IDs are read from the value stream of slot 1, which is stored
+    in docid order, and ghost messages are skipped by merging with the (also
+    sorted) posting list of the ghost term. Neither list is materialized, so
+    memory use does not depend on the size of the database.
 
-    def _recv_hashes():
-        logger.info("Receiving hashes from remote...")
-        tmp = json.loads(read(from_stream).decode("utf-8"))
-        hashes["theirs"] = dict(zip(hashes["req_mine"], tmp))
+    Args:
+        prefix (str): Prefix path for filenames (notmuch config database.path).
 
-    run_async(_send_hashes, _recv_hashes)
+    Yields:
+        str: Message IDs.
 
-    # now actually determine changes and move/copy
-    for mid in changes_theirs:
-        try:
-            msg = dbw.find(mid)
-            if msg.ghost:
-                ret[mid] = changes_theirs[mid]
+    Raises:
+        RuntimeError: If the database can't be read this way, e.g. because its
+            layout has changed in a different version of notmuch.
+    """
+    path = os.path.join(prefix, ".notmuch", "xapian")
+    db = xapian.Database(path)
+
+    logger.info("Getting all message IDs from DB...")
+    try:
+        ghosts = (p.docid for p in db.postlist("Tghost")) # type: ignore[attr-defined]
+        ghost = next(ghosts, None)
+        for item in db.valuestream(1): # type: ignore[attr-defined]
+            while ghost is not None and ghost < item.docid:
+                ghost = next(ghosts, None)
+            if item.docid == ghost or not item.value:
                 continue
-            fnames_theirs = changes_theirs[mid]["files"]
-            fnames_mine = [ str(f).removeprefix(prefix) for f in msg.filenames() ]
-            missing_mine = set(fnames_theirs) - set(fnames_mine)
-            if len(missing_mine) > 0:
-                hashes_mine = {str(f).removeprefix(prefix): digest(Path(f).read_bytes()) for f in msg.filenames()}
-                for f in changes_theirs[mid]["files"]:
-                    if f in missing_mine:
-                        # check if it has been moved/copied
-                        matches = [x[0] for x in hashes_mine.items() if hashes["theirs"][f] == x[1]]
-                        if len(matches) > 0:
-                            src = os.path.join(prefix, matches[0])
-                            dst = os.path.join(prefix, f)
-                            if matches[0] in changes_theirs[mid]["files"]:
-                                mcchanges += 1
-                                logger.info("Copying %s to %s.", src, dst)
-                                Path(dst).parent.mkdir(parents=True, exist_ok=True)
-                                shutil.copy(src, dst)
-                                fnames_mine.append(f)
-                                dbw.add(dst)
-                            elif mid not in changes_mine or move_on_change:
-                                mcchanges += 1
-                                logger.info("Moving %s to %s.", src, dst)
-                                Path(dst).parent.mkdir(parents=True, exist_ok=True)
-                                shutil.move(src, dst)
-                                fnames_mine.append(f)
-                                fnames_mine.remove(matches[0])
-                                hashes_mine[f] = hashes_mine[matches[0]]
-                                del hashes_mine[matches[0]]
-                                dbw.add(dst)
-                                logger.info("Removing %s from DB.", src)
-                                dbw.remove(src)
-                            missing_mine.remove(f)
-            # check which ones are still missing
-            if len(missing_mine) > 0:
-                ret[mid] = {"files": [f for f in changes_theirs[mid]["files"] if f in missing_mine]}
-
-            # delete any files that are not there remotely after copy/move
-            if mid not in changes_mine:
-                if len(set(fnames_mine).intersection(fnames_theirs)) == 0:
-                    raise ValueError(f"Message '{mid}' has {fnames_theirs} on remote and different {fnames_mine} locally!")
-                to_delete = set(fnames_mine) - set(fnames_theirs)
-                for f in to_delete:
-                    fname = os.path.join(prefix, f)
-                    dchanges += 1
-                    logger.info("Removing %s from DB and deleting file.", fname)
-                    dbw.remove(fname)
-                    Path(fname).unlink()
-        except LookupError:
-            # don't have this message; all files missing
-            ret[mid] = changes_theirs[mid]
+            yield item.value.decode("utf-8")
+    except (xapian.Error, AttributeError, TypeError, UnicodeDecodeError) as e:
+        raise RuntimeError(f"Reading message IDs from '{path}' failed, database layout not as "
+                           f"expected: {e}") from e
+    finally:
+        db.close()
+
+
+def id_hash(mid: str) -> int:
+    """
+    Compute 64-bit hash of a message ID.
 
-    return (ret, mcchanges, dchanges)
+    Args:
+        mid (str): Message ID.
+
+    Returns:
+        int: The hash.
+    """
+    return int.from_bytes(hashlib.blake2b(mid.encode("utf-8"), digest_size=8).digest(), "big")
 
 
-def send_file(fname: str, stream: IO[bytes]) -> None:
+class IdSummary:
+    """
+    All message IDs in the notmuch database and a summary of them, persisted to
+    disk. For the summary, IDs are assigned to buckets by the highest bits of
+    their id_hash(); each bucket holds the XOR of the hashes and the number of
+    IDs in it. Buckets that are the same on both sides contain the same IDs
+    (with very high probability), so only differing buckets have to be looked
+    at to find deleted messages.
+
+    The IDs are updated incrementally with the messages changed since the
+    revision of the last update. Only if messages have been removed from the
+    database in the meantime (i.e. there are fewer messages than IDs) are all
+    IDs read again. The IDs are kept in an SQLite database indexed by ID and by
+    bucket, so that only the summary is read when loading and only changed IDs
+    and buckets are written when saving; IDs are only read for buckets that
+    differ from the other side.
+    """
+    version = 3
+
+    def __init__(self) -> None:
+        self.fname: str | None = None
+        self.db = self._open(":memory:")
+        self.clear()
+
+    @staticmethod
+    def _open(fname: str) -> sqlite3.Connection:
+        # loaded on io_pool while files are synced, used afterwards
+        db = sqlite3.connect(fname, check_same_thread=False)
+        db.execute("CREATE TABLE IF NOT EXISTS meta (key TEXT PRIMARY KEY, value)")
+        db.execute("CREATE TABLE IF NOT EXISTS ids (mid TEXT PRIMARY KEY, bucket INTEGER NOT NULL, "
+                   "hash INTEGER NOT NULL) WITHOUT ROWID")
+        db.execute("CREATE INDEX IF NOT EXISTS ids_bucket ON ids (bucket)")
+        db.execute("CREATE TABLE IF NOT EXISTS buckets (idx INTEGER PRIMARY KEY, hash INTEGER NOT NULL, "
+                   "count INTEGER NOT NULL)")
+        return db
+
+    def _reset(self) -> None:
+        self.uuid = ""
+        self.rev = -1
+        self.hashes = [0] * (1 << ID_BUCKET_BITS)
+        self.counts = [0] * (1 << ID_BUCKET_BITS)
+        self.total = 0
+        # buckets changed since the last save
+        self.changed: set[int] = set()
+        self.dirty = False
+
+    def clear(self) -> None:
+        """
+        Remove all IDs.
+        """
+        self._reset()
+        self.db.execute("DELETE FROM ids")
+        self.db.execute("DELETE FROM buckets")
+
+    def load(self, fname: str) -> None:
+        """
+        Load the summary from a file. A missing or corrupted file results in an
+        empty summary, which is filled from the database on update().
+
+        Args:
+            fname (str): File to load from and save to.
+        """
+        self.db.close()
+        self.fname = fname
+        Path(fname).parent.mkdir(parents=True, exist_ok=True)
+        try:
+            self.db = self._open(fname)
+            meta = dict(self.db.execute("SELECT key, value FROM meta"))
+            buckets = self.db.execute("SELECT idx, hash, count FROM buckets").fetchall()
+        except sqlite3.DatabaseError:
+            logger.info("Message ID summary '%s' corrupted, ignoring.", fname)
+            self.db.close()
+            Path(fname).unlink()
+            self.db = self._open(fname)
+            meta = {}
+        self._reset()
+        if meta.get("version") == self.version:
+            self.uuid = meta["uuid"]
+            self.rev = meta["rev"]
+            for idx, h, c in buckets:
+                self.hashes[idx] = h & ((1 << 64) - 1)
+                self.counts[idx] = c
+            self.total = sum(self.counts)
+        else:
+            self.clear()
+        logger.info("Loaded summary of %s message IDs at revision %s.", self.total, self.rev)
+
+    def __len__(self) -> int:
+        return self.total
+
+    def __contains__(self, mid: object) -> bool:
+        return self.db.execute("SELECT 1 FROM ids WHERE mid = ?", (mid,)).fetchone() is not None
+
+    def __iter__(self) -> Iterator[str]:
+        return (mid for mid, in self.db.execute("SELECT mid FROM ids"))
+
+    def _apply(self, idx: int, h: int, count: int) -> None:
+        self.hashes[idx] ^= h
+        self.counts[idx] += count
+        self.total += count
+        self.changed.add(idx)
+        self.dirty = True
+
+    def add(self, mid: str) -> None:
+        """
+        Add a message ID, if it isn't there already.
+
+        Args:
+            mid (str): Message ID.
+        """
+        h = id_hash(mid)
+        idx = h >> (64 - ID_BUCKET_BITS)
+        # SQLite integers are signed
+        if self.db.execute("INSERT OR IGNORE INTO ids VALUES (?, ?, ?)",
+                           (mid, idx, h - (1 << 64) if h >> 63 else h)).rowcount > 0:
+            self._apply(idx, h, 1)
+
+    def remove(self, mid: str) -> None:
+        """
+        Remove a message ID, if it is there.
+
+        Args:
+            mid (str): Message ID.
+        """
+        row = self.db.execute("SELECT bucket, hash FROM ids WHERE mid = ?", (mid,)).fetchone()
+        if row is None:
+            return
+        self.db.execute("DELETE FROM ids WHERE mid = ?", (mid,))
+        self._apply(row[0], row[1] & ((1 << 64) - 1), -1)
+
+    def update(self, prefix: str) -> None:
+        """
+        Bring IDs up to date with the notmuch database.
+
+        Args:
+            prefix (str): Prefix path for filenames (notmuch config database.path).
+        """
+        with notmuch2.Database() as db:
+            rev = db.revision()
+            uuid = rev.uuid.decode()
+            if uuid == self.uuid:
+                logger.info("Getting message IDs changed since revision %s...", self.rev)
+                for msg in db.messages(f"lastmod:{self.rev + 1}.."):
+                    self.add(msg.messageid)
+                full = db.count_messages("*") != self.total
+            else:
+                full = True
+        if full:
+            self.clear()
+            with stats.phase("ids"):
+                for mid in get_ids(prefix):
+                    self.add(mid)
+        if (uuid, rev.rev) != (self.uuid, self.rev):
+            self.uuid = uuid
+            self.rev = rev.rev
+            self.dirty = True
+
+    def summary(self, bits: int) -> List[Tuple[int, int]]:
+        """
+        Get summary with 2^bits buckets.
+
+        Args:
+            bits (int): Number of bits of hashes that determine the bucket, at
+            most ID_BUCKET_BITS.
+
+        Returns:
+            list: XOR of hashes and number of IDs for each bucket.
+        """
+        ret = [(0, 0)] * (1 << bits)
+        shift = ID_BUCKET_BITS - bits
+        for idx, (h, c) in enumerate(zip(self.hashes, self.counts)):
+            if c > 0:
+                tmp = ret[idx >> shift]
+                ret[idx >> shift] = (tmp[0] ^ h, tmp[1] + c)
+        return ret
+
+    def bucket_hashes(self, bits: int, buckets: List[int]) -> Dict[int, str]:
+        """
+        Get all message IDs in the given buckets of the summary with 2^bits
+        buckets.
+
+        Args:
+            bits (int): Number of bits of hashes that determine the bucket, at
+            most ID_BUCKET_BITS.
+            buckets (list): Indices of buckets.
+
+        Returns:
+            dict: Message IDs by their id_hash().
+        """
+        shift = ID_BUCKET_BITS - bits
+        ret = {}
+        for idx in set(buckets):
+            for mid, h in self.db.execute("SELECT mid, hash FROM ids WHERE bucket BETWEEN ? AND ?",
+                                          (idx << shift, ((idx + 1) << shift) - 1)):
+                ret[h & ((1 << 64) - 1)] = mid
+        return ret
+
+    def save(self) -> None:
+        """
+        Save changed IDs, buckets, and revision to the file they were loaded
+        from, if anything changed.
+        """
+        if self.fname is None or not self.dirty:
+            return
+        logger.info("Saving summary of %s message IDs, %s buckets changed.", self.total, len(self.changed))
+        self.db.executemany("INSERT OR REPLACE INTO meta VALUES (?, ?)",
+                            [("version", self.version), ("uuid", self.uuid), ("rev", self.rev)])
+        self.db.executemany("INSERT OR REPLACE INTO buckets VALUES (?, ?, ?)",
+                            [(idx, self.hashes[idx] - (1 << 64) if self.hashes[idx] >> 63 else self.hashes[idx],
+                              self.counts[idx]) for idx in self.changed])
+        self.db.commit()
+        self.changed = set()
+        self.dirty = False
+
+
+id_summary = IdSummary()
+
+
+def encode_buckets(buckets: List[Tuple[int, int]]) -> bytes:
     """
-    Send a file's contents to a stream with 4-byte length prefix.
+    Encode buckets of message IDs for sending.
 
     Args:
-        fname (str): Path to the file to send.
-        stream: Writable stream.
+        buckets (list): XOR of hashes and number of IDs for each bucket.
+
+    Returns:
+        bytes: All hashes followed by all numbers of IDs.
     """
-    with open(fname, "rb") as f:
-        write(f.read(), stream)
+    return struct.pack(f"!{len(buckets)}Q", *[h for h, _ in buckets]) + \
+        struct.pack(f"!{len(buckets)}I", *[c for _, c in buckets])
 
 
-def recv_file(
-    fname: str,
-    stream: IO[bytes],
-    overwrite_raise: bool=True
-) -> None:
+def decode_buckets(data: bytes, offset: int = 0) -> List[Tuple[int, int]]:
     """
-    Receive a file with a 4-byte length prefix from a stream and write it to
-    disk, validating its checksum.
+    Decode buckets of message IDs encoded by encode_buckets().
 
     Args:
-        fname (str): Destination file path.
-        stream: Readable stream.
-        overwrite_raise: Raise error if existing file would be overwritten.
+        data (bytes): Encoded buckets.
+        offset (int): Where the encoded buckets start in data.
 
-    Raises:
-        ValueError: If file to receive already exists or received file's
-        checksum does not match expected.
-    """
-    content = read(stream)
-    if Path(fname).exists() and overwrite_raise:
-        sha_mine = digest(content)
-        sha_exists = digest(Path(fname).read_bytes())
-        if sha_exists != sha_mine:
-            raise ValueError(f"Receiving '{fname}', but already exists with different content!")
-    Path(fname).parent.mkdir(parents=True, exist_ok=True)
-    with open(fname, "wb") as f:
-        f.write(content)
+    Returns:
+        list: XOR of hashes and number of IDs for each bucket.
+    """
+    num = (len(data) - offset) // 12
+    hashes = struct.unpack_from(f"!{num}Q", data, offset)
+    counts = struct.unpack_from(f"!{num}I", data, offset + 8 * num)
+    return list(zip(hashes, counts))
 
 
-def sync_files(
-    dbw: notmuch2.Database,
-    prefix: str,
-    missing: Dict[str, Dict[str, Any]],
-    from_stream: IO[bytes] | None,
-    to_stream: IO[bytes] | None
-) -> Tuple[int, int]:
+def encode_summary(summary: List[Tuple[int, int]]) -> bytes:
     """
-    Synchronize files that are missing locally or remotely.
+    Encode summary of message IDs for sending.
 
     Args:
-        dbw: An open writable notmuch2.Database object.
-        prefix (str): Prefix path for filenames (notmuch config database.path).
-        missing (dict): Mapping of missing files by message ID.
-        from_stream: Stream to read file names and files from.
-        to_stream: Stream to send file names and files to.
+        summary (list): XOR of hashes and number of IDs for each bucket.
 
     Returns:
-        tuple: (number of added messages, number of added files)
+        bytes: Number of bits for buckets, followed by the encoded buckets.
     """
-    files = {}
-    files["mine"] = [ {"name": f, "id": mid} for mid in missing for f in missing[mid]["files"] ]
-    changes = {"files": len(files["mine"]), "messages": 0}
+    return bytes([len(summary).bit_length() - 1]) + encode_buckets(summary)
 
-    def _send_fnames():
-        logger.info("Sending file names missing on local...")
-        write(json.dumps([f["name"] for f in files["mine"]]).encode("utf-8"), to_stream)
 
-    def _recv_fnames():
-        logger.info("Receiving file names missing on remote...")
-        files["theirs"] = json.loads(read(from_stream).decode("utf-8"))
+def decode_summary(data: bytes) -> List[Tuple[int, int]]:
+    """
+    Decode summary of message IDs encoded by encode_summary().
 
-    run_async(_send_fnames, _recv_fnames)
+    Args:
+        data (bytes): Encoded summary.
 
-    logger.info("Missing file names synced.")
+    Returns:
+        list: XOR of hashes and number of IDs for each bucket.
+    """
+    return decode_buckets(data, 1)
 
-    def _send_files():
-        for idx, fname in enumerate(files["theirs"]):
-            logger.info("%s/%s Sending %s...", idx + 1, len(files["theirs"]),
-                        fname)
-            send_file(os.path.join(prefix, fname), to_stream)
 
-    def _recv_files():
-        for idx, f in enumerate(files["mine"]):
-            logger.info("%s/%s Receiving %s...", idx + 1, len(files["mine"]), f["name"])
-            dst = os.path.join(prefix, f["name"])
-            recv_file(dst, from_stream)
+def split_buckets(hashes: Iterable[int], bits: int, buckets: List[int]) -> List[Tuple[int, int]]:
+    """
+    Split buckets of message ID hashes into 2^SPLIT_BITS buckets each.
 
-        for idx, f in enumerate(files["mine"]):
-            dst = os.path.join(prefix, f["name"])
-            logger.info("Adding %s to DB.", dst)
-            msg, dup = dbw.add(dst)
-            if not dup:
-                changes["messages"] += 1
-                with msg.frozen():
-                    logger.info("Setting tags %s for received %s.",
-                                sorted(missing[f["id"]]["tags"]),
-                                msg.messageid)
-                    msg.tags.clear()
-                    for tag in missing[f["id"]]["tags"]:
-                        msg.tags.add(tag)
+    Args:
+        hashes: Hashes of message IDs.
+        bits (int): Number of bits of hashes that determine the bucket.
+        buckets (list): Indices of buckets to split.
 
-    run_async(_send_files, _recv_files)
+    Returns:
+        list: XOR of hashes and number of IDs for each new bucket, the new
+        buckets for each of the given buckets in turn.
+    """
+    pos = {idx: i for i, idx in enumerate(buckets)}
+    shift = 64 - bits - SPLIT_BITS
+    mask = (1 << SPLIT_BITS) - 1
+    ret = [(0, 0)] * (len(buckets) << SPLIT_BITS)
+    for h in hashes:
+        i = pos.get(h >> (64 - bits))
+        if i is not None:
+            child = (i << SPLIT_BITS) | ((h >> shift) & mask)
+            ret[child] = (ret[child][0] ^ h, ret[child][1] + 1)
+    return ret
+
+
+def select_buckets(hashes: Iterable[int], bits: int, buckets: List[int]) -> List[int]:
+    """
+    Select message ID hashes in the given buckets.
 
-    logger.info("Missing files synced.")
+    Args:
+        hashes: Hashes of message IDs.
+        bits (int): Number of bits of hashes that determine the bucket.
+        buckets (list): Indices of buckets.
 
-    return (changes["messages"], changes["files"])
+    Returns:
+        list: Sorted hashes in the buckets.
+    """
+    tmp = set(buckets)
+    return sorted(h for h in hashes if h >> (64 - bits) in tmp)
 
 
-def get_ids(prefix: str) -> List[str]:
+def reconcile_local(
+    summary: IdSummary,
+    theirs: List[Tuple[int, int]],
+    from_stream: IO[bytes] | None,
+    to_stream: IO[bytes] | None
+) -> Tuple[List[str], List[int]]:
     """
-    Get all message IDs from the notmuch database, using Xapian directly (much
-    faster).
+    Determine which message IDs are only on this side and which only on the
+    remote, starting with the summary of the remote's IDs. Buckets that differ
+    are split and compared again on the remote's side until they contain at
+    most LEAF_SIZE remote IDs, whose hashes are then exchanged. Only
+    differences are communicated; the amount of data depends on the number of
+    IDs that differ rather than the total number of IDs.
 
     Args:
-        prefix (str): Prefix path for filenames (notmuch config database.path).
+        summary (IdSummary): IDs on this side.
+        theirs (list): Summary of the remote's IDs.
+        from_stream: Stream to read from the remote.
+        to_stream: Stream to write to the remote.
 
     Returns:
-        list: All message IDs.
+        tuple: (IDs only on this side, hashes of IDs only on the remote)
+    """
+    bits = len(theirs).bit_length() - 1
+    diff = [(idx, t[1]) for idx, (m, t) in enumerate(zip(summary.summary(bits), theirs)) if m != t]
+    logger.info("%s/%s buckets of message IDs differ.", len(diff), len(theirs))
+    hashes = summary.bucket_hashes(bits, [idx for idx, _ in diff])
+    mine = set()
+    their_hashes = set()
+    while True:
+        split = [idx for idx, count in diff if count > LEAF_SIZE and bits + SPLIT_BITS <= 64]
+        leaves = [idx for idx, count in diff if count <= LEAF_SIZE or bits + SPLIT_BITS > 64]
+        logger.debug("Splitting %s buckets and comparing hashes for %s buckets at %s bits.",
+                     len(split), len(leaves), bits)
+        write(json.dumps({"bits": bits, "split": split, "hashes": leaves}).encode("utf-8"), to_stream)
+        data = read(from_stream)
+        their_hashes.update(struct.unpack(f"!{len(data) // 8}Q", data))
+        mine.update(select_buckets(hashes, bits, leaves))
+        if len(split) == 0:
+            break
+        children = decode_buckets(read(from_stream))
+        my_children = split_buckets(hashes, bits, split)
+        diff = [((idx << SPLIT_BITS) | (child & ((1 << SPLIT_BITS) - 1)), children[child][1])
+                for child, idx in enumerate(idx for idx in split for _ in range(1 << SPLIT_BITS))
+                if children[child] != my_children[child]]
+        bits += SPLIT_BITS
+    return ([hashes[h] for h in mine - their_hashes], sorted(their_hashes - mine))
+
+
+def reconcile_remote(
+    summary: IdSummary,
+    from_stream: IO[bytes] | None,
+    to_stream: IO[bytes] | None
+) -> Dict[int, str]:
     """
-    db = xapian.Database(os.path.join(prefix, ".notmuch", "xapian"))
-    message_ids = []
+    Answer requests of reconcile_local() on the remote side.
 
-    logger.info("Getting all message IDs from DB...")
-    ghosts = {p.docid for p in db.postlist("Tghost")} # type: ignore[attr-defined]
-    all_docs = set(range(1, db.get_lastdocid() + 1))
-    for doc_id in all_docs - ghosts:
-        try:
-            doc = db.get_document(doc_id)
-            value = doc.get_value(1)
-            if value:
-                message_ids.append(value.decode("utf-8"))
-        except xapian.DocNotFoundError:
-            pass
-        except RuntimeError:
-            # not entirely sure why, but this seems to happen sometimes
-            continue
+    Args:
+        summary (IdSummary): IDs on this side.
+        from_stream: Stream to read from the local.
+        to_stream: Stream to write to the local.
 
-    db.close()
+    Returns:
+        dict: Message IDs in the buckets that differ by their id_hash().
+    """
+    hashes = None
+    while True:
+        req = json.loads(read(from_stream).decode("utf-8"))
+        if hashes is None:
+            # first request is for all buckets that differ
+            hashes = summary.bucket_hashes(req["bits"], req["split"] + req["hashes"])
+        tmp = select_buckets(hashes, req["bits"], req["hashes"])
+        write(struct.pack(f"!{len(tmp)}Q", *tmp), to_stream)
+        if len(req["split"]) == 0:
+            return hashes
+        write(encode_buckets(split_buckets(hashes, req["bits"], req["split"])), to_stream)
+
+
+def summary_bits(count: int) -> int:
+    """
+    Determine number of bits for buckets of summary of message IDs such that
+    there are about ID_BUCKET_SIZE IDs in each bucket.
+
+    Args:
+        count (int): Number of message IDs.
 
-    return message_ids
+    Returns:
+        int: Number of bits.
+    """
+    return min(max((count // ID_BUCKET_SIZE).bit_length() - 1, 0), ID_BUCKET_BITS)
 
 
 # Separate methods for local and remote to avoid sending all IDs both ways --
@@ -575,28 +2806,42 @@ def sync_deletes_local(
     Returns:
         int: Number of deletions performed.
     """
-    ids = {}
+    ids: Dict[str, Any] = {}
     dels = {'a': 0}
+    buckets = features["deletes"] == "bisect"
 
     def _get_ids():
-        ids["mine"] = get_ids(prefix)
+        if buckets:
+            id_summary.load(state_path(prefix, "ids"))
+            id_summary.update(prefix)
+        else:
+            ids["mine"] = set(get_ids(prefix))
 
     def _recv_ids():
-        logger.info("Receiving all message IDs from remote...")
-        ids["theirs"] = json.loads(read(from_stream).decode("utf-8"))
+        if buckets:
+            logger.info("Receiving message ID summary from remote...")
+            ids["summary"] = decode_summary(read(from_stream))
+        else:
+            logger.info("Receiving all message IDs from remote...")
+            ids["theirs"] = json.loads(read(from_stream).decode("utf-8"))
 
     run_async(_get_ids, _recv_ids)
 
+    if buckets:
+        # remote IDs are identified by hash only
+        to_del, to_del_remote = reconcile_local(id_summary, ids["summary"], from_stream, to_stream)
+    else:
+        to_del = list(set(ids["mine"]) - set(ids["theirs"]))
+        to_del_remote = list(set(ids["theirs"]) - set(ids["mine"]))
+
     logger.info("Message IDs synced.")
 
     def _send_del_ids():
-        to_del_remote = list(set(ids["theirs"]) - set(ids["mine"]))
         logger.debug("Remote IDs to be deleted %s.", to_del_remote)
         logger.info("Sending message IDs to be deleted to remote...")
         write(json.dumps(to_del_remote).encode("utf-8"), to_stream)
 
     def _recv_del_ids():
-        to_del = set(ids["mine"]) - set(ids["theirs"])
         logger.debug("Local IDs to be deleted %s.", to_del)
         with notmuch2.Database(mode=notmuch2.Database.MODE.READ_WRITE) as dbw:
             for mid in to_del:
@@ -611,6 +2856,7 @@ def sync_deletes_local(
                             logger.debug("Removing %s.", f)
                             dbw.remove(f)
                             Path(f).unlink()
+                        id_summary.remove(mid)
                     else:
                         # not there on remote, but no "deleted" tag -- assume
                         # that something went wrong and set tags again to make
@@ -626,6 +2872,7 @@ def sync_deletes_local(
                     pass
 
     run_async(_send_del_ids, _recv_del_ids)
+    id_summary.save()
 
     return dels["a"]
 
@@ -650,10 +2897,18 @@ def sync_deletes_remote(
         int: Number of deletions performed.
     """
     dels = 0
-    ids = get_ids(prefix)
-    write(json.dumps(ids).encode("utf-8"), to_stream)
+    if features["deletes"] == "bisect":
+        id_summary.load(state_path(prefix, "ids"))
+        id_summary.update(prefix)
+        bits = summary_bits(len(id_summary))
+        write(encode_summary(id_summary.summary(bits)), to_stream)
+        hashes = reconcile_remote(id_summary, from_stream, to_stream)
+        to_del = [hashes[h] for h in json.loads(read(from_stream).decode("utf-8")) if h in hashes]
+    else:
+        ids = list(get_ids(prefix))
+        write(json.dumps(ids).encode("utf-8"), to_stream)
+        to_del = json.loads(read(from_stream).decode("utf-8"))
 
-    to_del = json.loads(read(from_stream).decode("utf-8"))
     with notmuch2.Database(mode=notmuch2.Database.MODE.READ_WRITE) as dbw:
         for mid in to_del:
             try:
@@ -665,6 +2920,7 @@ def sync_deletes_remote(
                     for f in msg.filenames():
                         dbw.remove(f)
                         Path(f).unlink()
+                    id_summary.remove(mid)
                 else:
                     # not on local, but no "deleted" tag -- assume that
                     # something went wrong and set tags again to make it
@@ -676,13 +2932,213 @@ def sync_deletes_remote(
             except LookupError:
                 # already deleted? doesn't matter
                 pass
+    id_summary.save()
     return dels
 
 
-def sync_mbsync_local(
+class MbsyncIndex:
+    """
+    Locations of mbsync state files in the mail directory, persisted to disk.
+    The mail directory is walked without descending into the cur/, new/, and
+    tmp/ directories of maildirs, which hold the mails and no state files. The
+    subdirectories and state files of each directory are cached with the
+    modification time of the directory, and directories are only listed again
+    if that has changed, i.e. files or directories have been added, removed,
+    or renamed in them. As for DigestCache, the file is only read again if it
+    has changed since it was last loaded or saved.
+    """
+    version = 1
+    # names of mbsync state files
+    names = frozenset([".uidvalidity", ".mbsyncstate"])
+    # directories of maildirs
+    maildir = frozenset(["cur", "new", "tmp"])
+
+    def __init__(self) -> None:
+        self.fname: str | None = None
+        self.prefix = ""
+        # directory relative to prefix -> [mtime, subdirectories, state files]
+        self.dirs: Dict[str, List[Any]] = {}
+        self.dirty = False
+        self.stamp: Tuple[int, int] | None = None
+
+    def load(self, fname: str, prefix: str) -> None:
+        """
+        Load cached directory listings from a file. A missing or corrupted file
+        results in an empty cache.
+
+        Args:
+            fname (str): File to load from and save to.
+            prefix (str): Prefix path for filenames (notmuch config database.path).
+        """
+        stamp = file_stamp(fname)
+        if (fname, prefix) == (self.fname, self.prefix) and stamp is not None and stamp == self.stamp:
+            return
+        self.fname = fname
+        self.prefix = prefix
+        self.stamp = stamp
+        self.dirs = {}
+        self.dirty = False
+        try:
+            tmp = json.loads(Path(fname).read_text(encoding="utf-8"))
+            if tmp["version"] == self.version:
+                self.dirs = tmp["dirs"]
+        except FileNotFoundError:
+            pass
+        except (ValueError, KeyError, TypeError):
+            logger.info("mbsync state file index '%s' corrupted, ignoring.", fname)
+
+    def _list(self, rel: str, path: str) -> Tuple[List[str], List[str]]:
+        subdirs = []
+        state = []
+        with os.scandir(path) as it:
+            for entry in it:
+                if entry.is_dir(follow_symlinks=False):
+                    subdirs.append(entry.name)
+                elif entry.name in self.names and entry.is_file(follow_symlinks=False):
+                    state.append(entry.name)
+        if "cur" in subdirs:
+            subdirs = [d for d in subdirs if d not in self.maildir]
+        if rel == "":
+            subdirs = [d for d in subdirs if d != ".notmuch"]
+        return (sorted(subdirs), sorted(state))
+
+    def files(self) -> Dict[str, float]:
+        """
+        Find all mbsync state files.
+
+        Returns:
+            dict: Mapping of state files relative to prefix to their
+            modification times.
+        """
+        # directories changed this recently may change again within the
+        # resolution of the modification time, so they aren't cached
+        recent = time.time_ns() - 2 * 10**9
+        dirs = {}
+        ret = {}
+        todo = [""]
+        while todo:
+            rel = todo.pop()
+            path = os.path.join(self.prefix, rel)
+            try:
+                mtime = os.stat(path).st_mtime_ns
+                entry = self.dirs.get(rel)
+                if entry is None or entry[0] != mtime:
+                    subdirs, state = self._list(rel, path)
+                    entry = [mtime if mtime < recent else -1, subdirs, state]
+                    self.dirty = True
+                for name in entry[2]:
+                    f = os.path.join(rel, name)
+                    ret[f] = os.stat(os.path.join(self.prefix, f)).st_mtime
+            except FileNotFoundError:
+                continue
+            dirs[rel] = entry
+            todo.extend(os.path.join(rel, d) for d in entry[1])
+        if len(dirs) != len(self.dirs):
+            self.dirty = True
+        self.dirs = dirs
+        return ret
+
+    def save(self) -> None:
+        """
+        Save cached directory listings to the file they were loaded from, if
+        anything changed.
+        """
+        if self.fname is None or not self.dirty:
+            return
+        Path(self.fname).parent.mkdir(parents=True, exist_ok=True)
+        tmp = self.fname + ".tmp"
+        Path(tmp).write_text(json.dumps({"version": self.version, "dirs": self.dirs}),
+                             encoding="utf-8")
+        os.replace(tmp, self.fname)
+        self.stamp = file_stamp(self.fname)
+        self.dirty = False
+
+
+mbsync_index = MbsyncIndex()
+
+
+def find_mbsync_files(prefix: str) -> Dict[str, float]:
+    """
+    Find mbsync state files with mbsync_index, updating the index on disk.
+
+    Args:
+        prefix (str): Prefix path for filenames (notmuch config database.path).
+
+    Returns:
+        dict: Mapping of state files relative to prefix to their modification
+        times.
+    """
+    mbsync_index.load(state_path(prefix, "mbsync"), prefix)
+    ret = mbsync_index.files()
+    mbsync_index.save()
+    return ret
+
+
+def exchange_mbsync_signatures(
     prefix: str,
+    pull: List[str],
+    push: List[str],
     from_stream: IO[bytes] | None,
     to_stream: IO[bytes] | None
+) -> Dict[str, List[bytes]]:
+    """
+    Exchange signatures of the mbsync files to receive, so that they can be
+    sent as differences to the existing files (which mbsync usually changes
+    only in a few lines) if both sides support that. Signatures are empty for
+    files that don't exist on the receiving side yet.
+
+    Args:
+        prefix (str): Prefix path for filenames (notmuch config database.path).
+        pull (list): mbsync files to receive, relative to prefix.
+        push (list): mbsync files to send, relative to prefix.
+        from_stream: Stream to read from the other side.
+        to_stream: Stream to write to the other side.
+
+    Returns:
+        dict: Signatures sent for the files to receive ("pull") and received
+        for the files to send ("push"), in the same order as the files.
+    """
+    sigs = {"pull": [b''] * len(pull), "push": [b''] * len(push)}
+    if features["delta"] != "blocks":
+        return sigs
+
+    def _send_signatures():
+        for idx, f in enumerate(pull):
+            fname = os.path.join(prefix, f)
+            if os.path.exists(fname):
+                sigs["pull"][idx] = file_signature(fname)
+            write(sigs["pull"][idx], to_stream)
+
+    def _recv_signatures():
+        sigs["push"] = [read(from_stream) for _ in push]
+
+    run_async(_send_signatures, _recv_signatures)
+    return sigs
+
+
+def recv_mbsync_file(fname: str, stream: IO[bytes], signature: bytes) -> None:
+    """
+    Receive an mbsync file with its modification time, as differences to the
+    existing file if a signature was sent for it.
+
+    Args:
+        fname (str): Path to the file.
+        stream: Readable stream.
+        signature (bytes): Signature of the existing file sent to the other
+        side, empty if the file is sent in full.
+    """
+    mtime_data = stream.read(8)
+    count_transfer("read", 8)
+    mtime = struct.unpack("!d", mtime_data)[0]
+    recv_file(fname, stream, overwrite_raise=False, basis=fname, signature=signature)
+    os.utime(fname, (mtime, mtime))
+
+
+def sync_mbsync_local(
+    prefix: str,
+    from_stream: IO[bytes] | None,
+    to_stream: IO[bytes] | None,
+    files: Dict[str, float] | None = None
 ) -> None:
     """
     Synchronize local mbsync files with remote.
@@ -691,14 +3147,14 @@ def sync_mbsync_local(
         prefix (str): Prefix path for filenames (notmuch config database.path).
         from_stream: Stream to read from the remote.
         to_stream: Stream to write to the remote.
+        files (dict): Local mbsync files as returned by find_mbsync_files(),
+            if found already.
     """
     mbsync = {}
 
     def _get_mbsync():
         logger.info("Getting local mbsync file stats...")
-        mbsync["mine"] = { str(f).removeprefix(prefix): f.stat().st_mtime
-                           for pat in [".uidvalidity", ".mbsyncstate"]
-                           for f in Path(prefix).rglob(pat) }
+        mbsync["mine"] = find_mbsync_files(prefix) if files is None else files
 
     def _recv_mbsync():
         logger.info("Receiving mbsync file stats from remote...")
@@ -714,33 +3170,29 @@ def sync_mbsync_local(
     logger.debug("Local mbsync files to be updated from remote %s.", pull)
     write(json.dumps(pull).encode("utf-8"), to_stream)
 
-    def _send_mbsync_files():
-        push = [ f for f in mbsync["theirs"].keys()
-                if (f in mbsync["mine"] and mbsync["mine"][f] > mbsync["theirs"][f]) ]
-        push += list(set(mbsync["mine"].keys()) - set(mbsync["theirs"].keys()))
+    push = [ f for f in mbsync["theirs"].keys()
+            if (f in mbsync["mine"] and mbsync["mine"][f] > mbsync["theirs"][f]) ]
+    push += list(set(mbsync["mine"].keys()) - set(mbsync["theirs"].keys()))
+    logger.debug("mbsync files to update on remote %s.", push)
+    write(json.dumps(push).encode("utf-8"), to_stream)
+    sigs = exchange_mbsync_signatures(prefix, pull, push, from_stream, to_stream)
 
-        logger.debug("mbsync files to update on remote %s.", push)
+    def _send_mbsync_files():
         logger.info("Sending %s mbsync files to remote...", len(push))
-        write(json.dumps(push).encode("utf-8"), to_stream)
         for idx, f in enumerate(push):
             logger.debug("%s/%s Sending mbsync file %s to remote...", idx + 1,
                          len(push), f)
             to_stream.write(struct.pack("!d", mbsync["mine"][f]))
             to_stream.flush()
-            transfer["write"] += 8
-            send_file(os.path.join(prefix, f), to_stream)
+            count_transfer("write", 8)
+            send_file(os.path.join(prefix, f), to_stream, sigs["push"][idx])
 
     def _recv_mbsync_files():
         logger.info("Receiving %s mbsync files from remote...", len(pull))
         for idx, f in enumerate(pull):
             logger.debug("%s/%s Receiving mbsync file %s from remote...",
                          idx + 1, len(pull), f)
-            mtime_data = from_stream.read(8)
-            transfer["read"] += 8
-            mtime = struct.unpack("!d", mtime_data)[0]
-            fname = os.path.join(prefix, f)
-            recv_file(fname, from_stream, overwrite_raise=False)
-            os.utime(fname, (mtime, mtime))
+            recv_mbsync_file(os.path.join(prefix, f), from_stream, sigs["pull"][idx])
 
     run_async(_send_mbsync_files, _recv_mbsync_files)
 
@@ -750,7 +3202,8 @@ def sync_mbsync_local(
 def sync_mbsync_remote(
     prefix: str,
     from_stream: IO[bytes] | None,
-    to_stream: IO[bytes] | None
+    to_stream: IO[bytes] | None,
+    files: Dict[str, float] | None = None
 ) -> None:
     """
     Synchronize remote mbsync files with local.
@@ -759,34 +3212,52 @@ def sync_mbsync_remote(
         prefix (str): Prefix path for filenames (notmuch config database.path).
         from_stream: Stream to read from the remote.
         to_stream: Stream to write to the remote.
+        files (dict): Remote mbsync files as returned by find_mbsync_files(),
+            if found already.
     """
-    mbsync = { str(f).removeprefix(prefix): f.stat().st_mtime
-               for pat in [".uidvalidity", ".mbsyncstate"]
-               for f in Path(prefix).rglob(pat) }
+    mbsync = find_mbsync_files(prefix) if files is None else files
     write(json.dumps(mbsync).encode("utf-8"), to_stream)
     push = json.loads(read(from_stream).decode("utf-8"))
+    pull = json.loads(read(from_stream).decode("utf-8"))
+    sigs = exchange_mbsync_signatures(prefix, pull, push, from_stream, to_stream)
 
     def _send_mbsync_files():
-        for f in push:
+        for idx, f in enumerate(push):
             fname = os.path.join(prefix, f)
             to_stream.write(struct.pack("!d", Path(fname).stat().st_mtime))
             to_stream.flush()
-            transfer["write"] += 8
-            send_file(fname, to_stream)
+            count_transfer("write", 8)
+            send_file(fname, to_stream, sigs["push"][idx])
 
     def _recv_mbsync_files():
-        pull = json.loads(read(from_stream).decode("utf-8"))
-        for f in pull:
-            mtime_data = from_stream.read(8)
-            transfer["read"] += 8
-            mtime = struct.unpack("!d", mtime_data)[0]
-            fname = os.path.join(prefix, f)
-            recv_file(fname, from_stream, overwrite_raise=False)
-            os.utime(fname, (mtime, mtime))
+        for idx, f in enumerate(pull):
+            recv_mbsync_file(os.path.join(prefix, f), from_stream, sigs["pull"][idx])
 
     run_async(_send_mbsync_files, _recv_mbsync_files)
 
 
+def prepare_phases(args: argparse.Namespace, prefix: str) -> Dict[str, Future]:
+    """
+    Start the parts of the deletes and mbsync phases that don't depend on the
+    tags and files synced in the same round on io_pool, so that they run while
+    those are synced: loading the message ID summary (its update has to wait
+    for the received messages to be added) and finding mbsync state files.
+
+    Args:
+        args: Parsed command-line arguments.
+        prefix (str): Prefix path for filenames (notmuch config database.path).
+
+    Returns:
+        dict: Futures by phase, to wait for before the phase.
+    """
+    ret = {}
+    if args.delete and features["deletes"] == "bisect":
+        ret["deletes"] = io_pool.submit(id_summary.load, state_path(prefix, "ids"))
+    if args.mbsync:
+        ret["mbsync"] = io_pool.submit(find_mbsync_files, prefix)
+    return ret
+
+
 def sync_remote(args: argparse.Namespace) -> None:
     """
     Run synchronization in remote mode.
@@ -794,34 +3265,161 @@ def sync_remote(args: argparse.Namespace) -> None:
     Args:
         args: Parsed command-line arguments.
     """
-    with notmuch2.Database(mode=notmuch2.Database.MODE.READ_WRITE) as dbw:
-        prefix = os.path.join(str(dbw.default_path()), '')
-        changes_mine, changes_theirs, tchanges, sync_fname = initial_sync(dbw, prefix, sys.stdin.buffer, sys.stdout.buffer)
-        missing, fchanges, dfchanges = get_missing_files(dbw, prefix, changes_mine, changes_theirs, sys.stdin.buffer, sys.stdout.buffer, move_on_change=False)
-        rmessages, rfiles = sync_files(dbw, prefix, missing, sys.stdin.buffer, sys.stdout.buffer)
-        record_sync(sync_fname, dbw.revision())
+    hello = handshake(sys.stdin.buffer, sys.stdout.buffer, local=False)
+    if hello is not None and hello.get("role") == "files":
+        if "uuid" not in hello:
+            raise ValueError("Additional connection without UUID, aborting...")
+        with notmuch2.Database() as db:
+            prefix = os.path.join(str(db.default_path()), '')
+        serve_files(prefix, staging_dir(prefix, hello["uuid"]), sys.stdin.buffer, sys.stdout.buffer)
+        return
+
+    while True:
+        sync_round_remote(args)
+        # with --watch, the local side asks for further rounds over the same
+        # connection
+        if features["rounds"] != "multi" or read(sys.stdin.buffer) == b'':
+            break
+
+
+def sync_round_remote(args: argparse.Namespace) -> None:
+    """
+    Run one round of synchronization in remote mode, after the handshake.
+
+    Args:
+        args: Parsed command-line arguments.
+    """
+    stats.clear()
+    with stats.phase("changes"), notmuch2.Database() as db:
+        prefix = os.path.join(str(db.default_path()), '')
+        changes_mine, changes_theirs, revision, uuid = initial_sync(db, prefix, sys.stdin.buffer, sys.stdout.buffer)
+    prepared = prepare_phases(args, prefix)
+    tchanges = fchanges = dfchanges = rfiles = rmessages = 0
+    if nothing_to_sync(changes_mine, changes_theirs):
+        record_sync(sync_file(prefix, uuid), revision)
+    else:
+        # tags first, as that may rename files to match maildir flags
+        writer = DatabaseWriter(revision)
+        with stats.phase("tags"), writer as dbw:
+            changes_mine.update(writer.changed(prefix))
+            tchanges = sync_tags(dbw, changes_mine, changes_theirs)
+        logger.info("Tags synced.")
+        pending = PendingChanges(prefix, staging_dir(prefix, uuid), args.copy)
+        with stats.phase("hashes"), notmuch2.Database() as db:
+            # only needed if there is something to sync
+            digests.load(state_path(prefix, "digests"), prefix)
+            missing, fchanges, dfchanges = get_missing_files(db, prefix, changes_mine, changes_theirs, sys.stdin.buffer, sys.stdout.buffer,
+                                                             pending, move_on_change=False)
+        with stats.phase("files"):
+            rfiles = sync_files(prefix, missing, sys.stdin.buffer, sys.stdout.buffer, pending,
+                                changes=changes_mine)
+        stats.add("files", files=rfiles)
+        with stats.phase("db_add"), writer as dbw:
+            rmessages = pending.apply(dbw, args.db_batch)
+            writer.record(sync_file(prefix, uuid))
+        digests.save()
 
     dchanges = 0
     if args.delete:
-        dchanges = sync_deletes_remote(prefix, sys.stdin.buffer, sys.stdout.buffer, args.delete_no_check)
+        with stats.phase("deletes"):
+            if "deletes" in prepared:
+                prepared["deletes"].result()
+            dchanges = sync_deletes_remote(prefix, sys.stdin.buffer, sys.stdout.buffer, args.delete_no_check)
     if args.mbsync:
-        sync_mbsync_remote(prefix, sys.stdin.buffer, sys.stdout.buffer)
+        with stats.phase("mbsync"):
+            sync_mbsync_remote(prefix, sys.stdin.buffer, sys.stdout.buffer, prepared["mbsync"].result())
     sys.stdout.buffer.write(struct.pack("!IIIIII", tchanges, fchanges, dfchanges,
                                         rmessages, dchanges, rfiles))
+    if features["report"] == "json":
+        write(json.dumps(stats.report()).encode("utf-8"), sys.stdout.buffer)
     sys.stdout.buffer.flush()
 
 
-def sync_local(args: argparse.Namespace) -> None:
+def sync_peers(args: argparse.Namespace) -> None:
     """
-    Run synchronization in local mode, communicating with the remote over SSH or
-    a custom command.
+    Run synchronization in local mode with all remotes given on the command
+    line, one after the other. Remotes are not synced with at the same time,
+    as the protocol features, transfer counts, and statistics are kept per
+    process, and the changes received from one remote have to be in the
+    database before they can be sent to the next. With several remotes, the
+    tags and files of messages that haven't changed since the previous remote
+    are reused, and the caches of digests, message IDs, and mbsync state files
+    are kept in memory in between. If the sync with a remote fails, the error
+    is logged and the other remotes are still synced with; the exit code is
+    non-zero at the end. With --watch, all remotes are synced again when the
+    local database changes.
+
+    Args:
+        args: Parsed command-line arguments.
+    """
+    remotes = args.remote_cmd or args.remote
+    if len(remotes) == 1:
+        sync_local(peer_args(args, remotes[0]))
+        return
+
+    change_cache.active = True
+    failed = []
+    while True:
+        rev_synced = None
+        for remote in remotes:
+            logger.warning("Syncing with %s...", remote)
+            try:
+                # the other remotes have to be synced as well before waiting
+                rev_synced = sync_local(peer_args(args, remote, watch=None))
+            except (Exception, SystemExit) as e:
+                logger.error("Syncing with %s failed: %s", remote, e)
+                failed.append(remote)
+                transfer["read"] = 0
+                transfer["write"] = 0
+        change_cache.clear()
+        if not args.watch:
+            break
+        if rev_synced is None:
+            with notmuch2.Database() as db:
+                rev_synced = db.revision().rev
+        logger.warning("Waiting for changes...")
+        if not wait_for_changes(rev_synced, args.watch):
+            break
+    if len(failed) > 0:
+        logger.error("Syncing with %s failed.", ", ".join(dict.fromkeys(failed)))
+        sys.exit(1)
+
+
+def peer_args(args: argparse.Namespace, remote: str, **kwargs: Any) -> argparse.Namespace:
+    """
+    Get the command-line arguments for syncing with one remote.
 
     Args:
         args: Parsed command-line arguments.
+        remote (str): Remote host, or command if --remote-cmd was given.
+        kwargs: Further arguments to override.
+
+    Returns:
+        argparse.Namespace: Arguments with only this remote.
     """
+    ret = argparse.Namespace(**vars(args))
     if args.remote_cmd:
-        cmd = shlex.split(args.remote_cmd)
+        ret.remote_cmd = remote
     else:
+        ret.remote = remote
+    for key, value in kwargs.items():
+        setattr(ret, key, value)
+    return ret
+
+
+def sync_local(args: argparse.Namespace) -> int:
+    """
+    Run synchronization in local mode, communicating with the remote over SSH or
+    a custom command.
+
+    Args:
+        args: Parsed command-line arguments, with a single remote.
+
+    Returns:
+        int: Revision of the local database after the last sync.
+    """
+    rargs = []
+    if not args.remote_cmd:
         rargs = [(f"{args.user}@" if args.user else "") + args.remote, f"{args.path}"]
         if args.delete:
             rargs.append("--delete")
@@ -829,65 +3427,272 @@ def sync_local(args: argparse.Namespace) -> None:
             rargs.append("--delete-no-check")
         if args.mbsync:
             rargs.append("--mbsync")
-        cmd = shlex.split(args.ssh_cmd) + rargs
-
-    logger.info("Connecting to remote...")
-    logger.debug("Command to connect to remote: %s", cmd)
-
-    with subprocess.Popen(
-                cmd,
-                stdin=subprocess.PIPE,
-                stdout=subprocess.PIPE,
-                stderr=subprocess.PIPE
-            ) as proc:
-        to_remote = proc.stdin
-        from_remote = proc.stdout
-        err_remote = proc.stderr
-
-        data = b''
-        try:
-            with notmuch2.Database(mode=notmuch2.Database.MODE.READ_WRITE) as dbw:
-                prefix = os.path.join(str(dbw.default_path()), '')
-                changes_mine, changes_theirs, tchanges, sync_fname = initial_sync(dbw, prefix, from_remote, to_remote)
-                missing, fchanges, dfchanges = get_missing_files(dbw, prefix, changes_mine, changes_theirs, from_remote, to_remote, move_on_change=True)
-                logger.debug("Missing files %s.", missing)
-                rmessages, rfiles = sync_files(dbw, prefix, missing, from_remote, to_remote)
-                record_sync(sync_fname, dbw.revision())
-
-            dchanges = 0
-            if args.delete:
-                dchanges = sync_deletes_local(prefix, from_remote, to_remote, args.delete_no_check)
-            if args.mbsync:
-                sync_mbsync_local(prefix, from_remote, to_remote)
-
-            logger.info("Getting change numbers from remote...")
-            if from_remote is not None:
-                remote_changes = struct.unpack("!IIIIII", from_remote.read(6 * 4))
-                transfer["read"] += 6 * 4
-            else:
-                remote_changes = (0,0,0,0,0,0)
-        finally:
-            ready, _, exc = select([err_remote], [], [], 0)
-            if err_remote is not None and ready and not exc:
-                data = err_remote.read()
-                # getting zero data on EOF
-                if len(data) > 0:
-                    logger.error("Remote error: %s", data)
-
-            if to_remote is not None:
-                to_remote.close()
-            if from_remote is not None:
-                from_remote.close()
-            if err_remote is not None:
-                err_remote.close()
+    # options that remotes with the legacy protocol don't know about
+    rargs_new = []
+    if not args.remote_cmd:
+        if args.db_batch != DB_BATCH:
+            rargs_new += ["--db-batch", str(args.db_batch)]
+        if args.copy != COPY_METHODS[0]:
+            rargs_new += ["--copy", args.copy]
+
+    caps = dict(CAPABILITIES)
+    caps["compression"] = [c for c in caps["compression"] if c in (args.compression, "none")]
+    if args.streams < 2:
+        caps["streams"] = ["single"]
+    if not args.watch:
+        caps["rounds"] = ["single"]
+    if not args.stats:
+        caps["report"] = ["none"]
+
+    def _connect(legacy):
+        if args.remote_cmd:
+            cmd = shlex.split(args.remote_cmd)
+        else:
+            ssh_cmd = args.ssh_cmd
+            if ssh_cmd is None:
+                # let SSH compress only if we don't
+                ssh_cmd = "ssh -CTaxq" if legacy or args.compression == "none" else "ssh -Taxq"
+            cmd = shlex.split(ssh_cmd) + rargs + ([] if legacy else rargs_new)
+        logger.debug("Command to connect to remote: %s", cmd)
+        return subprocess.Popen(
+                    cmd,
+                    stdin=subprocess.PIPE,
+                    stdout=subprocess.PIPE,
+                    stderr=subprocess.PIPE
+                )
+
+    def _connect_helper(uuid):
+        hproc = _connect(False)
+        if handshake(hproc.stdout, hproc.stdin, local=True, caps=caps, role="files", uuid=uuid) is None:
+            hproc.kill()
+            hproc.communicate()
+            raise ValueError("Remote does not support additional connections, aborting...")
+        return hproc
+
+    # whether the remote does the handshake is only found out once; with
+    # --watch and a remote that needs to be connected to for each round, it
+    # doesn't have to be tried again
+    legacy = False
+    while True:
+        while True:
+            logger.info("Connecting to remote...")
+            proc = _connect(legacy)
+            if legacy or handshake(proc.stdout, proc.stdin, local=True, caps=caps):
+                break
+            # remote took the handshake for the UUID and will exit with an error;
+            # start over without handshake
+            proc.kill()
+            proc.communicate()
+            logger.info("Reconnecting to remote...")
+            legacy = True
+
+        with proc:
+            to_remote = proc.stdin
+            from_remote = proc.stdout
+            err_remote = proc.stderr
+
+            data = b''
+            pool = ThreadPoolExecutor()
+            connecting = []
+            if args.streams > 1 and features["streams"] == "multi":
+                # connect while the main connection is busy with everything else
+                logger.info("Opening %s additional connections to remote...", args.streams - 1)
+                with notmuch2.Database() as db:
+                    uuid_mine = db.revision().uuid.decode()
+                connecting = [pool.submit(_connect_helper, uuid_mine) for _ in range(args.streams - 1)]
+            try:
+                helpers = connecting
+                while True:
+                    rev_synced = sync_round_local(args, from_remote, to_remote, helpers)
+                    # additional connections are only used for the first round,
+                    # which likely has the most files to transfer
+                    helpers = []
+                    if not args.watch or features["rounds"] != "multi":
+                        break
+                    logger.warning("Waiting for changes...")
+                    if not wait_for_changes(rev_synced, args.watch):
+                        write(b'', to_remote)
+                        break
+                    write(b'\x01', to_remote)
+            finally:
+                ready, _, exc = select([err_remote], [], [], 0)
+                if err_remote is not None and ready and not exc:
+                    data = err_remote.read()
+                    # getting zero data on EOF
+                    if len(data) > 0:
+                        logger.error("Remote error: %s", data)
+
+                pool.shutdown()
+                for future in connecting:
+                    if future.exception() is None:
+                        _, herr = future.result().communicate()
+                        if len(herr) > 0:
+                            logger.error("Remote error: %s", herr)
+                            data += herr
+
+                if to_remote is not None:
+                    to_remote.close()
+                if from_remote is not None:
+                    from_remote.close()
+                if err_remote is not None:
+                    err_remote.close()
+
+        if len(data) > 0:
+            # error output from remote
+            sys.exit(1)
+        # with several rounds over one connection, the connection is closed
+        # only when interrupted
+        if not args.watch or features["rounds"] == "multi":
+            break
+        # remote can't do several rounds over one connection, reconnect
+        logger.warning("Waiting for changes...")
+        if not wait_for_changes(rev_synced, args.watch):
+            break
+    return rev_synced
+
+
+def sync_round_local(
+    args: argparse.Namespace,
+    from_remote: IO[bytes] | None,
+    to_remote: IO[bytes] | None,
+    connecting: List[Any]
+) -> int:
+    """
+    Run one round of synchronization in local mode, after the handshake.
+
+    Args:
+        args: Parsed command-line arguments.
+        from_remote: Stream to read from the remote.
+        to_remote: Stream to write to the remote.
+        connecting (list): Futures of additional connections to the remote
+            to be used for transferring files.
+
+    Returns:
+        int: Revision of the local database after the round.
+    """
+    stats.clear()
+    with stats.phase("changes"), notmuch2.Database() as db:
+        prefix = os.path.join(str(db.default_path()), '')
+        changes_mine, changes_theirs, revision, uuid = initial_sync(db, prefix, from_remote, to_remote)
+    prepared = prepare_phases(args, prefix)
+    tchanges = fchanges = dfchanges = rfiles = rmessages = 0
+    if nothing_to_sync(changes_mine, changes_theirs):
+        record_sync(sync_file(prefix, uuid), revision)
+        # additional connections expect lists of files to transfer
+        for future in connecting:
+            helper = future.result()
+            write(b'[]', helper.stdin)
+            write(b'[]', helper.stdin)
+    else:
+        # tags first, as that may rename files to match maildir flags
+        writer = DatabaseWriter(revision)
+        with stats.phase("tags"), writer as dbw:
+            changes_mine.update(writer.changed(prefix))
+            tchanges = sync_tags(dbw, changes_mine, changes_theirs)
+        logger.info("Tags synced.")
+        pending = PendingChanges(prefix, staging_dir(prefix, uuid), args.copy)
+        with stats.phase("hashes"), notmuch2.Database() as db:
+            # only needed if there is something to sync
+            digests.load(state_path(prefix, "digests"), prefix)
+            missing, fchanges, dfchanges = get_missing_files(db, prefix, changes_mine, changes_theirs, from_remote, to_remote,
+                                                             pending, move_on_change=True)
+        logger.debug("Missing files %s.", missing)
+        with stats.phase("files"):
+            helpers = [future.result() for future in connecting]
+            rfiles = sync_files(prefix, missing, from_remote, to_remote, pending,
+                                [(h.stdout, h.stdin) for h in helpers], changes_mine)
+        stats.add("files", files=rfiles)
+        with stats.phase("db_add"), writer as dbw:
+            rmessages = pending.apply(dbw, args.db_batch)
+            writer.record(sync_file(prefix, uuid))
+        digests.save()
+
+    dchanges = 0
+    if args.delete:
+        with stats.phase("deletes"):
+            if "deletes" in prepared:
+                prepared["deletes"].result()
+            dchanges = sync_deletes_local(prefix, from_remote, to_remote, args.delete_no_check)
+    if args.mbsync:
+        with stats.phase("mbsync"):
+            sync_mbsync_local(prefix, from_remote, to_remote, prepared["mbsync"].result())
+
+    logger.info("Getting change numbers from remote...")
+    remote_report: Dict[str, Dict[str, float]] = {}
+    if from_remote is not None:
+        remote_changes = struct.unpack("!IIIIII", from_remote.read(6 * 4))
+        count_transfer("read", 6 * 4)
+        if features["report"] == "json":
+            remote_report = json.loads(read(from_remote).decode("utf-8"))
+    else:
+        remote_changes = (0,0,0,0,0,0)
 
     logger.warning("local:  %s new messages,\t%s new files,\t%s files copied/moved,\t%s files deleted,\t%s messages with tag changes,\t%s messages deleted", rmessages, rfiles, fchanges, dfchanges, tchanges, dchanges)
     logger.warning("remote: %s new messages,\t%s new files,\t%s files copied/moved,\t%s files deleted,\t%s messages with tag changes,\t%s messages deleted", remote_changes[3], remote_changes[5], remote_changes[1], remote_changes[2], remote_changes[0], remote_changes[4])
     logger.warning("%s/%s bytes received from/sent to remote.", transfer["read"], transfer["write"])
+    if args.stats:
+        names = ["tag changes", "files copied/moved", "files deleted", "new messages", "messages deleted", "new files"]
+        write_stats(args.stats, {
+            "time": time.time(),
+            "peer": args.remote_cmd or args.remote,
+            "read": transfer["read"],
+            "write": transfer["write"],
+            "local": {"changes": dict(zip(names, [tchanges, fchanges, dfchanges, rmessages, dchanges, rfiles])),
+                      "phases": stats.report()},
+            "remote": {"changes": dict(zip(names, remote_changes)), "phases": remote_report},
+        })
+    transfer["read"] = 0
+    transfer["write"] = 0
+
+    with notmuch2.Database() as db:
+        return db.revision().rev
+
+
+def write_stats(fname: str, report: Dict[str, Any]) -> None:
+    """
+    Append the report of a sync to a file as a line of JSON, for --stats.
 
-    if len(data) > 0:
-        # error output from remote
-        sys.exit(1)
+    Args:
+        fname (str): File to append to, or "-" for standard output.
+        report (dict): Report to write.
+    """
+    line = json.dumps(report)
+    if fname == "-":
+        print(line, flush=True)
+        return
+    with open(fname, "a", encoding="utf-8") as f:
+        f.write(line + "\n")
+
+
+def wait_for_changes(rev: int, interval: float) -> bool:
+    """
+    Wait until the revision of the local database has changed and then stayed
+    the same for WATCH_DEBOUNCE seconds, e.g. after notmuch new has added new
+    mail, or until interval seconds have passed, so that changes on the remote
+    are picked up as well.
+
+    Args:
+        rev (int): Revision of the local database after the last sync.
+        interval (float): Maximum time to wait in seconds.
+
+    Returns:
+        bool: Whether to sync again, False if interrupted.
+    """
+    start = time.monotonic()
+    changed = None
+    try:
+        while time.monotonic() - start < interval:
+            time.sleep(WATCH_POLL)
+            with notmuch2.Database() as db:
+                current = db.revision().rev
+            if current != rev:
+                rev = current
+                changed = time.monotonic()
+            elif changed is not None and time.monotonic() - changed >= WATCH_DEBOUNCE:
+                break
+    except KeyboardInterrupt:
+        return False
+    return True
 
 
 def main() -> None:
@@ -896,15 +3701,21 @@ def main() -> None:
     to local or remote sync.
     """
     parser = argparse.ArgumentParser()
-    parser.add_argument("-r", "--remote", type=str, help="remote host to connect to")
+    parser.add_argument("-r", "--remote", type=str, action="append", help="remote host to connect to; can be given several times to sync with all of them")
     parser.add_argument("-u", "--user", type=str, help="SSH user to use")
     parser.add_argument("-v", "--verbose", action="count", default=0, help="increases verbosity, up to twice (ignored on remote)")
     parser.add_argument("-q", "--quiet", action="store_true", help="do not print any output, overrides --verbose")
-    parser.add_argument("-s", "--ssh-cmd", type=str, default="ssh -CTaxq", help="SSH command to use (default 'ssh -CTaxq')")
+    parser.add_argument("-s", "--ssh-cmd", type=str, help="SSH command to use (default 'ssh -Taxq', 'ssh -CTaxq' with '--compression none')")
+    parser.add_argument("-z", "--compression", type=str, choices=list(COMPRESSORS) + ["none"], default=list(COMPRESSORS)[0], help=f"compression to use for data sent between local and remote (default '{list(COMPRESSORS)[0]}')")
+    parser.add_argument("-j", "--streams", type=int, default=1, help="number of connections to remote to use for transferring files (default 1)")
+    parser.add_argument("-b", "--db-batch", type=int, default=DB_BATCH, help=f"number of changes to the notmuch database to group into one atomic section, also on remote (default {DB_BATCH})")
+    parser.add_argument("-l", "--copy", type=str, choices=COPY_METHODS, default=COPY_METHODS[0], help=f"how to create copies of files of existing messages, also on remote; 'reflink' and 'hardlink' fall back to copying if unsupported (default '{COPY_METHODS[0]}')")
+    parser.add_argument("-w", "--watch", type=int, metavar="SECONDS", help="keep running, syncing again over the same connection when the local notmuch database changes and at least every SECONDS seconds")
+    parser.add_argument("-S", "--stats", type=str, metavar="FILE", help="append time, data transferred, and throughput of each phase of each sync on both sides to FILE as a line of JSON ('-' for standard output)")
     parser.add_argument("-m", "--mbsync", action="store_true", help="sync mbsync files (.mbsyncstate, .uidvalidity)")
     parser.add_argument("-p", "--path", type=str, default=os.path.basename(sys.argv[0]), help="path to notmuch-sync on remote server")
-    parser.add_argument("-c", "--remote-cmd", type=str, help="command to run to sync; overrides --remote, --user, --ssh-cmd, --path; mostly used for testing")
-    parser.add_argument("-d", "--delete", action="store_true", help="sync deleted messages (requires listing all messages in notmuch database, potentially expensive)")
+    parser.add_argument("-c", "--remote-cmd", type=str, action="append", help="command to run to sync; overrides --remote, --user, --ssh-cmd, --path; can be given several times; mostly used for testing")
+    parser.add_argument("-d", "--delete", action="store_true", help="sync deleted messages (requires comparing all messages in notmuch database)")
     parser.add_argument("-x", "--delete-no-check", action="store_true", help="delete missing messages even if they don't have the 'deleted' tag (requires --delete) -- potentially unsafe")
     args = parser.parse_args()
 
@@ -918,7 +3729,7 @@ def main() -> None:
 
         if args.quiet:
             logger.disabled = True
-        sync_local(args)
+        sync_peers(args)
     else:
         logger.disabled = True
         sync_remote(args)
@@ -15,7 +15,7 @@ def write_conf(path):
     return conf_path
 
 
-def sync(shell, local_conf, remote_conf, verbose=False, delete=False, mbsync=False):
+def sync(shell, local_conf, remote_conf, verbose=False, delete=False, mbsync=False, streams=1):
     args = ["./src/notmuch_sync.py", "--remote-cmd", f"bash -c 'NOTMUCH_CONFIG={remote_conf} ./src/notmuch_sync.py {"--delete" if delete else ""} {"--mbsync" if mbsync else ""}'"]
     if verbose:
         args.append("--verbose")
@@ -23,6 +23,8 @@ def sync(shell, local_conf, remote_conf, verbose=False, delete=False, mbsync=Fal
         args.append("--delete")
     if mbsync:
         args.append("--mbsync")
+    if streams > 1:
+        args += ["--streams", str(streams)]
     res = shell.run(*args, env={"NOTMUCH_CONFIG": local_conf})
     #print(res)
     assert res.returncode == 0
@@ -662,6 +664,36 @@ def test_sync_tags_files_none_remote(shell):
                 assert f.read() == f"9 {rsum[1]}"
 
 
+def test_sync_tags_files_none_remote_streams(shell):
+    with TemporaryDirectory() as local:
+        with TemporaryDirectory() as remote:
+            assert shell.run("cp", "-r", "test/mails", local).returncode == 0
+            local_conf = write_conf(local)
+            remote_conf = write_conf(remote)
+            assert shell.run("notmuch", "new", env={"NOTMUCH_CONFIG": local_conf}).returncode == 0
+            assert shell.run("notmuch", "new", env={"NOTMUCH_CONFIG": remote_conf}).returncode == 0
+
+            assert shell.run("notmuch", "tag", "+local", "id:874llc2bkp.fsf@curie.anarc.at",
+                             env={"NOTMUCH_CONFIG": local_conf}).returncode == 0
+
+            out = sync(shell, local_conf, remote_conf, streams=3).split('\n')
+            assert "local:  0 new messages,\t0 new files,\t0 files copied/moved,\t0 files deleted,\t0 messages with tag changes,\t0 messages deleted" in out[0]
+            assert "remote: 4 new messages,\t5 new files,\t0 files copied/moved,\t0 files deleted,\t0 messages with tag changes,\t0 messages deleted" in out[1]
+
+            for fname in ["attachment.eml", "calendar.eml", "html-only.eml", "simple.eml"]:
+                with open(os.path.join(local, "mails", fname), "rb") as f:
+                    lcontent = f.read()
+                with open(os.path.join(remote, "mails", fname), "rb") as f:
+                    assert lcontent == f.read()
+
+            assert shell.run("notmuch", "search", "--output=tags", "--format=json", "id:874llc2bkp.fsf@curie.anarc.at",
+                             env={"NOTMUCH_CONFIG": remote_conf}).data == ["attachment", "local"]
+
+            out = sync(shell, local_conf, remote_conf, streams=3).split('\n')
+            assert "local:  0 new messages,\t0 new files,\t0 files copied/moved,\t0 files deleted,\t0 messages with tag changes,\t0 messages deleted" in out[0]
+            assert "remote: 0 new messages,\t0 new files,\t0 files copied/moved,\t0 files deleted,\t0 messages with tag changes,\t0 messages deleted" in out[1]
+
+
 def test_sync_files_deleted(shell):
     with TemporaryDirectory() as local:
         with TemporaryDirectory() as remote:
@@ -1,11 +1,17 @@
 import pytest
+import argparse
 import os
 import sys
 import io
+import hashlib
 import json
+import shutil
 import stat
 import struct
+import threading
+import time
 from unittest.mock import MagicMock, PropertyMock, call, mock_open, patch
+from concurrent.futures import ThreadPoolExecutor
 from tempfile import NamedTemporaryFile, TemporaryDirectory, gettempdir
 
 import notmuch2
@@ -14,6 +20,30 @@ import src.notmuch_sync as ns
 
 prefix = gettempdir() + os.sep
 
+def tmpname(fname):
+    # temporary file recv_file() writes to before renaming
+    return os.path.join(os.path.dirname(fname), f".{os.path.basename(fname)}.notmuch-sync")
+
+uuid = "00000000-0000-0000-0000-000000000001"
+staging = ns.staging_dir(prefix, uuid)
+
+def staged(fname):
+    # file in the staging directory sync_files() receives to
+    return os.path.join(staging, fname.removeprefix(prefix))
+
+def missing_files(db, pfx, *args, **kwargs):
+    # determine missing files and apply the resulting changes right away
+    pending = ns.PendingChanges(pfx, ns.staging_dir(pfx, uuid))
+    ret = ns.get_missing_files(db, pfx, *args, pending, **kwargs)
+    pending.apply(db)
+    return ret
+
+def sync_files(db, pfx, missing, istream, ostream, helpers=None, batch_size=ns.DB_BATCH):
+    # transfer files and add them right away
+    pending = ns.PendingChanges(pfx, ns.staging_dir(pfx, uuid))
+    files = ns.sync_files(pfx, missing, istream, ostream, pending, helpers)
+    return (pending.apply(db, batch_size), files)
+
 def test_changes():
     mm = lambda: None
     mm.messageid = "foo"
@@ -35,9 +65,9 @@ def test_changes():
                 f2.write("mail two")
                 f2.flush()
                 mm.filenames = MagicMock(return_value=[f1.name, f2.name])
-                changes = ns.get_changes(db, rev, prefix, f.name)
-                assert changes == {"foo": {"tags": ["foo", "bar"], "files":
-                                           [f1.name.removeprefix(prefix), f2.name.removeprefix(prefix)]}}
+                changes = dict(ns.get_changes(db, rev, prefix, f.name))
+                assert changes == {"foo": ns.Change(["foo", "bar"],
+                                                    [f1.name.removeprefix(prefix), f2.name.removeprefix(prefix)])}
 
     # expect call for new changes, since next rev number
     db.messages.assert_called_once_with("lastmod:124..")
@@ -65,13 +95,54 @@ def test_changes_first_sync():
             f2.write("mail two")
             f2.flush()
             mm.filenames = MagicMock(return_value=[f1.name, f2.name])
-            changes = ns.get_changes(db, rev, prefix, f.name)
-            assert changes == {"foo": {"tags": ["foo", "bar"], "files":
-                                       [f1.name.removeprefix(prefix), f2.name.removeprefix(prefix)]}}
+            changes = dict(ns.get_changes(db, rev, prefix, f.name))
+            assert changes == {"foo": ns.Change(["foo", "bar"],
+                                                [f1.name.removeprefix(prefix), f2.name.removeprefix(prefix)])}
 
     db.messages.assert_called_once_with("lastmod:0..")
 
 
+def test_changes_cached():
+    mm = lambda: None
+    mm.messageid = "foo"
+    mm.tags = ["foo", "bar"]
+    mm.filenames = MagicMock(return_value=[prefix + "a/cur/one"])
+    changed = lambda: None
+    changed.messageid = "foo"
+
+    db = lambda: None
+    rev = lambda: None
+    rev.rev = 123
+    rev.uuid = b'00000000-0000-0000-0000-000000000000'
+    db.messages = MagicMock(return_value=[mm])
+
+    f = NamedTemporaryFile(mode="r", prefix="notmuch-sync-test-tmp-")
+    f.close()
+    cache = ns.ChangeCache()
+    cache.active = True
+    with patch.object(ns, "change_cache", cache):
+        first = dict(ns.get_changes(db, rev, prefix, f.name))
+        second = dict(ns.get_changes(db, rev, prefix, f.name))
+        assert first == second == {"foo": ns.Change(["foo", "bar"], ["a/cur/one"])}
+        assert second["foo"] is first["foo"]
+        mm.filenames.assert_called_once()
+
+        # message changed in the meantime
+        rev.rev = 125
+        db.messages = MagicMock(side_effect=[[changed], [mm]])
+        mm.tags = ["foo"]
+        assert {"foo": ns.Change(["foo"], ["a/cur/one"])} == dict(ns.get_changes(db, rev, prefix, f.name))
+        assert db.messages.call_args_list == [call("lastmod:124.."), call("lastmod:0..")]
+        assert mm.filenames.call_count == 2
+
+    # not cached unless active
+    cache = ns.ChangeCache()
+    db.messages = MagicMock(return_value=[mm])
+    with patch.object(ns, "change_cache", cache):
+        dict(ns.get_changes(db, rev, prefix, f.name))
+    assert cache.changes == {}
+
+
 def test_changes_changed_uuid():
     db = lambda: None
     rev = lambda: None
@@ -125,21 +196,82 @@ def test_initial_sync():
     db.revision = MagicMock(return_value=rev)
 
     fname = os.path.join(gettempdir(), ".notmuch", "notmuch-sync-00000000-0000-0000-0000-000000000001")
-    with patch.object(ns, "get_changes", return_value=[]) as gc:
-        istream = io.BytesIO(b"00000000-0000-0000-0000-000000000001\x00\x00\x00\x02[]")
+    with patch.object(ns, "get_changes", return_value={}) as gc:
+        istream = io.BytesIO(b"00000000-0000-0000-0000-000000000001\x00\x00\x00\x00")
         ostream = io.BytesIO()
-        mine, theirs, nchanges, syncname = ns.initial_sync(db, prefix, istream, ostream)
-        assert mine == []
-        assert theirs == []
-        assert nchanges == 0
-        assert syncname == fname
-        assert b"00000000-0000-0000-0000-000000000000\x00\x00\x00\x02[]" == ostream.getvalue()
+        mine, theirs, revision, ruuid = ns.initial_sync(db, prefix, istream, ostream)
+        assert mine == {}
+        assert theirs == {}
+        assert revision == rev
+        assert ruuid == uuid
+        assert b"00000000-0000-0000-0000-000000000000\x00\x00\x00\x00" == ostream.getvalue()
 
         gc.assert_called_once_with(db, rev, prefix, fname)
 
     assert db.revision.call_count == 1
 
 
+def test_changes_streamed():
+    stream = io.BytesIO()
+
+    def _changes():
+        yield ("foo", ns.Change(["bar"], ["a/b"]))
+        # first batch sent already
+        assert len(stream.getvalue()) > 0
+        yield ("bar", ns.Change(["bar"], ["a/c"]))
+
+    with patch.object(ns, "CHANGES_BATCH", 1):
+        ns.send_changes(_changes(), stream)
+    stream.seek(0)
+    assert {"foo": ns.Change(["bar"], ["a/b"]), "bar": ns.Change(["bar"], ["a/c"])} == ns.recv_changes(stream)
+
+
+def test_change():
+    change = ns.Change(["foo", "bar"], ["a/b"])
+    assert ("foo", "bar") == change["tags"] == change.tags
+    assert ("a/b",) == change["files"] == change.get("files", [])
+    assert change.tags[0] is ns.Change(["foo"], []).tags[0]
+    # folders are stored once
+    other = ns.Change([], ["a/c", "d"])
+    assert ("a/c", "d") == other.files
+    assert change._files[0] is other._files[0]
+    assert ns.Change(["foo", "bar"], ["a/b"]) == change
+    assert ns.Change(["foo"], ["a/b"]) != change
+    with pytest.raises(AttributeError):
+        change.foo = "bar"
+
+
+def test_changes_encoding():
+    changes = {"foo": {"tags": ["foo", "bar"], "files": ["INBOX/cur/1:2,S", "INBOX/cur/2:2,S"]},
+               "bar": {"tags": [], "files": ["toplevel"]},
+               "foobar": {"tags": ["bar", "ünicode"], "files": ["/abs/path", "INBOX/new/3"]}}
+    stream = io.BytesIO()
+    with patch.object(ns, "CHANGES_BATCH", 2):
+        ns.send_changes(changes.items(), stream)
+    out = stream.getvalue()
+    # tags and folders are only sent once
+    assert out.count(b"INBOX/cur/") == 1
+    # tag and message ID "bar"
+    assert out.count(b"\x03bar") == 2
+    assert out.endswith(b"\x00\x00\x00\x00")
+    stream.seek(0)
+    received = ns.recv_changes(stream)
+    assert {mid: ns.Change(c["tags"], c["files"]) for mid, c in changes.items()} == received
+    # tags are stored only once
+    assert received["foo"].tags[1] is received["foobar"].tags[0]
+    assert stream.read() == b""
+
+
+def test_varint():
+    for value in [0, 1, 127, 128, 300, 16383, 16384, 2**32, 2**63]:
+        out = bytearray()
+        ns.encode_varint(value, out)
+        assert (value, len(out)) == ns.decode_varint(bytes(out), 0)
+    out = bytearray()
+    ns.encode_varint(300, out)
+    assert b"\xac\x02" == bytes(out)
+
+
 def test_record_sync():
     rev = lambda: None
     rev.rev = 123
@@ -148,12 +280,18 @@ def test_record_sync():
     fname = os.path.join(gettempdir(), ".notmuch", "notmuch-sync-00000000-0000-0000-0000-000000000001")
     with patch("builtins.open", mock_open()) as o:
         ns.record_sync(fname, rev)
-        o.assert_called_once_with(fname, "w", encoding="utf-8")
+        o.assert_called_with(fname, "w", encoding="utf-8")
         hdl = o()
         hdl.write.assert_called_once()
         args = hdl.write.call_args.args
         assert "123 00000000-0000-0000-0000-000000000000" == args[0]
 
+    # same revision as recorded already
+    with patch("builtins.open", mock_open(read_data="123 00000000-0000-0000-0000-000000000000")) as o:
+        ns.record_sync(fname, rev)
+        o.assert_called_once_with(fname, "r", encoding="utf-8")
+        o().write.assert_not_called()
+
 
 def test_sync_tags_empty():
     db = lambda: None
@@ -174,6 +312,7 @@ def test_sync_tags_only_theirs():
     mt.__len__.return_value = len(tags)
     mt.clear = MagicMock()
     mt.add = MagicMock()
+    mt.discard = MagicMock()
     mt.to_maildir_flags = MagicMock()
     type(m).tags = PropertyMock(return_value=mt)
 
@@ -185,12 +324,11 @@ def test_sync_tags_only_theirs():
 
     db.find.assert_called_once_with("foo")
     m.frozen.assert_called_once()
-    mt.clear.assert_called_once()
-    assert mt.add.mock_calls == [
-        call("bar"),
-        call("foobar")
-    ]
-    mt.to_maildir_flags.assert_called_once()
+    mt.clear.assert_not_called()
+    assert mt.discard.mock_calls == [call("foo")]
+    assert mt.add.mock_calls == [call("foobar")]
+    # no tags that correspond to maildir flags changed
+    mt.to_maildir_flags.assert_not_called()
 
 
 def test_sync_tags_only_theirs_ghost():
@@ -254,6 +392,7 @@ def test_sync_tags_mine_theirs_no_overlap():
     mt.__len__.return_value = len(tags)
     mt.clear = MagicMock()
     mt.add = MagicMock()
+    mt.discard = MagicMock()
     mt.to_maildir_flags = MagicMock()
     type(m).tags = PropertyMock(return_value=mt)
 
@@ -265,12 +404,11 @@ def test_sync_tags_mine_theirs_no_overlap():
 
     db.find.assert_called_once_with("foo")
     m.frozen.assert_called_once()
-    mt.clear.assert_called_once()
-    assert mt.add.mock_calls == [
-        call("bar"),
-        call("foobar")
-    ]
-    mt.to_maildir_flags.assert_called_once()
+    mt.clear.assert_not_called()
+    assert mt.discard.mock_calls == [call("foo")]
+    assert mt.add.mock_calls == [call("foobar")]
+    # no tags that correspond to maildir flags changed
+    mt.to_maildir_flags.assert_not_called()
 
 
 def test_sync_tags_mine_theirs_overlap():
@@ -286,6 +424,7 @@ def test_sync_tags_mine_theirs_overlap():
     mt.__len__.return_value = len(tags)
     mt.clear = MagicMock()
     mt.add = MagicMock()
+    mt.discard = MagicMock()
     mt.to_maildir_flags = MagicMock()
     type(m).tags = PropertyMock(return_value=mt)
 
@@ -297,22 +436,123 @@ def test_sync_tags_mine_theirs_overlap():
 
     db.find.assert_called_once_with("foo")
     m.frozen.assert_called_once()
-    mt.clear.assert_called_once()
+    mt.clear.assert_not_called()
+    assert mt.discard.mock_calls == [call("foo")]
     assert mt.add.mock_calls == [
-        call("bar"),
         call("foobar"),
         call("tag1"),
         call("tag2")
     ]
-    mt.to_maildir_flags.assert_called_once()
+    mt.to_maildir_flags.assert_not_called()
+
+
+def test_sync_tags_flags():
+    msgs = []
+    for tags in [["inbox", "unread"], ["inbox"], ["inbox", "replied"]]:
+        m = MagicMock()
+        m.ghost = False
+        mt = MagicMock(spec=list)
+        mt.__iter__.return_value = iter(tags)
+        mt.add = MagicMock()
+        mt.discard = MagicMock()
+        mt.to_maildir_flags = MagicMock()
+        type(m).tags = PropertyMock(return_value=mt)
+        msgs.append(m)
+
+    db = lambda: None
+    db.find = MagicMock(side_effect=msgs)
+
+    changes = ns.sync_tags(db, {}, {"foo": {"tags": ["inbox"]}, "bar": {"tags": ["inbox", "todo"]},
+                                    "foobar": {"tags": ["inbox", "flagged"]}})
+    assert changes == 3
+    msgs[0].tags.discard.assert_called_once_with("unread")
+    msgs[0].tags.to_maildir_flags.assert_called_once()
+    msgs[1].tags.add.assert_called_once_with("todo")
+    msgs[1].tags.to_maildir_flags.assert_not_called()
+    msgs[2].tags.discard.assert_called_once_with("replied")
+    msgs[2].tags.add.assert_called_once_with("flagged")
+    msgs[2].tags.to_maildir_flags.assert_called_once()
+
+
+def writer_db(revs):
+    # mock database that is opened for writing, with the given revisions
+    db = MagicMock()
+    db.revision = MagicMock()
+    db.revision.side_effect = [rev(r) for r in revs]
+    ctx = MagicMock()
+    ctx.__enter__.return_value = db
+    ctx.__exit__.return_value = False
+    return (db, ctx)
+
+def rev(num, uuid=b'00000000-0000-0000-0000-000000000000'):
+    r = lambda: None
+    r.rev = num
+    r.uuid = uuid
+    return r
+
+
+def test_database_writer():
+    db, ctx = writer_db([123, 125, 125, 126, 126])
+    writer = ns.DatabaseWriter(rev(123))
+    with patch("notmuch2.Database", return_value=ctx) as ndb:
+        with writer as dbw:
+            assert dbw == db
+            assert {} == writer.changed(prefix)
+        with writer as dbw:
+            assert {} == writer.changed(prefix)
+            with patch.object(ns, "record_sync") as rs:
+                writer.record("foo")
+                assert "foo" == rs.call_args.args[0]
+                assert 126 == rs.call_args.args[1].rev
+        assert ndb.mock_calls[0] == call(mode=notmuch2.Database.MODE.READ_WRITE)
+    assert writer.clean
+    assert ctx.__exit__.call_count == 2
+    db.messages.assert_not_called()
+
+
+def test_database_writer_changed():
+    db, ctx = writer_db([124, 125, 125, 126])
+    m = MagicMock()
+    m.messageid = "foo"
+    m.tags = ["bar"]
+    m.filenames = MagicMock(return_value=[prefix + "foofile"])
+    db.messages = MagicMock(return_value=[m])
+    base = rev(123)
+    writer = ns.DatabaseWriter(base)
+    with patch("notmuch2.Database", return_value=ctx):
+        with writer:
+            assert {"foo": ns.Change(["bar"], ["foofile"])} == writer.changed(prefix)
+            db.messages.assert_called_once_with("lastmod:124..")
+        with writer:
+            assert {} == writer.changed(prefix)
+            with patch.object(ns, "record_sync") as rs:
+                writer.record("foo")
+                # changes by someone else are sent next time
+                rs.assert_called_once_with("foo", base)
+    assert not writer.clean
+
+
+def test_database_writer_uuid():
+    db, ctx = writer_db([])
+    db.revision.side_effect = [rev(123, b'00000000-0000-0000-0000-000000000001')]
+    writer = ns.DatabaseWriter(rev(123))
+    with patch("notmuch2.Database", return_value=ctx):
+        with pytest.raises(ValueError) as pwe:
+            with writer:
+                pass
+        assert str(pwe.value) == "notmuch DB UUID changed to 00000000-0000-0000-0000-000000000001 during sync, aborting..."
+    ctx.__exit__.assert_called_once()
 
 
 def test_sync_server(monkeypatch):
     args = lambda: None
     args.delete = False
     args.mbsync = False
+    args.db_batch = ns.DB_BATCH
+    args.copy = "copy"
 
     db = lambda: None
+    db.atomic = MagicMock()
     rev = lambda: None
     rev.rev = 124
     rev.uuid = b'00000000-0000-0000-0000-000000000000'
@@ -325,29 +565,461 @@ def test_sync_server(monkeypatch):
 
     fname = os.path.join(gettempdir(), ".notmuch", "notmuch-sync-00000000-0000-0000-0000-000000000001")
     with patch("notmuch2.Database", return_value=mock_ctx):
-        with patch.object(ns, "get_changes", return_value=[]) as gc:
+        with patch.object(ns, "get_changes", return_value={}) as gc:
             with patch("builtins.open", mock_open()) as o:
-                mockio = io.BytesIO(b'00000000-0000-0000-0000-000000000001\x00\x00\x00\x02{}\x00\x00\x00\x02[]\x00\x00\x00\x02[]\x00\x00\x00\x02[]')
-                mockio.buffer = mockio
+                mockio = lambda: None
+                mockio.buffer = io.BufferedReader(io.BytesIO(b'00000000-0000-0000-0000-000000000001\x00\x00\x00\x02{}\x00\x00\x00\x02[]\x00\x00\x00\x02[]\x00\x00\x00\x02[]'))
                 monkeypatch.setattr(sys, "stdin", mockio)
-                ns.sync_remote(args)
-                o.assert_called_once_with(fname, "w", encoding="utf-8")
+                with patch.dict(ns.features):
+                    ns.sync_remote(args)
+                    assert ns.LEGACY == ns.features
+                o.assert_called_with(fname, "w", encoding="utf-8")
                 hdl = o()
                 hdl.write.assert_called_once()
                 args = hdl.write.call_args.args
                 assert "124 00000000-0000-0000-0000-000000000000" == args[0]
             gc.assert_called_once_with(db, rev, prefix, fname)
 
-    assert db.revision.call_count == 2
+    # initial sync, then start and end of both sections with the DB writable,
+    # and when recording the sync
+    assert db.revision.call_count == 6
     db.default_path.assert_called_once()
 
 
+def test_sync_server_nothing_to_sync(monkeypatch):
+    args = lambda: None
+    args.delete = False
+    args.mbsync = False
+    args.db_batch = ns.DB_BATCH
+    args.copy = "copy"
+
+    db = lambda: None
+    rev = lambda: None
+    rev.rev = 124
+    rev.uuid = b'00000000-0000-0000-0000-000000000000'
+    db.revision = MagicMock(return_value=rev)
+    db.default_path = MagicMock(return_value=gettempdir())
+
+    mock_ctx = MagicMock()
+    mock_ctx.__enter__.return_value = db
+    mock_ctx.__exit__.return_value = False
+
+    fname = os.path.join(gettempdir(), ".notmuch", "notmuch-sync-00000000-0000-0000-0000-000000000001")
+    mockin = lambda: None
+    mockin.buffer = io.BufferedReader(io.BytesIO(b'00000000-0000-0000-0000-000000000001\x00\x00\x00\x02{}'))
+    monkeypatch.setattr(sys, "stdin", mockin)
+    mockout = lambda: None
+    mockout.buffer = io.BytesIO()
+    monkeypatch.setattr(sys, "stdout", mockout)
+    with patch("notmuch2.Database", return_value=mock_ctx):
+        with patch.object(ns, "get_changes", return_value={}):
+            with patch.object(ns, "get_missing_files") as gmf:
+                with patch.object(ns, "sync_files") as sf:
+                    with patch.object(ns, "record_sync") as rs, patch.object(ns.digests, "load") as dl:
+                        with patch.dict(ns.features, ns.LEGACY | {"noop": "skip"}):
+                            ns.sync_round_remote(args)
+    gmf.assert_not_called()
+    sf.assert_not_called()
+    dl.assert_not_called()
+    rs.assert_called_once_with(fname, rev)
+    # UUID, no changes, and change numbers, without file lists in between
+    assert mockout.buffer.getvalue() == b'00000000-0000-0000-0000-000000000000\x00\x00\x00\x02{}' + b'\x00' * 24
+
+
+def test_sync_remote_rounds(monkeypatch):
+    args = lambda: None
+    mockio = lambda: None
+    mockio.buffer = io.BufferedReader(io.BytesIO(b'\x00\x00\x00\x01\x01\x00\x00\x00\x00'))
+    monkeypatch.setattr(sys, "stdin", mockio)
+    with patch.dict(ns.features, {"rounds": "multi"}):
+        with patch.object(ns, "handshake", return_value={"role": "sync"}):
+            with patch.object(ns, "sync_round_remote") as sr:
+                ns.sync_remote(args)
+    assert sr.call_count == 2
+    sr.assert_called_with(args)
+
+
+def test_sync_remote_single_round(monkeypatch):
+    args = lambda: None
+    mockio = lambda: None
+    mockio.buffer = io.BufferedReader(io.BytesIO(b'\x00\x00\x00\x01\x01'))
+    monkeypatch.setattr(sys, "stdin", mockio)
+    with patch.dict(ns.features, {"rounds": "single", "report": "none", "noop": "full"}):
+        with patch.object(ns, "handshake", return_value=None):
+            with patch.object(ns, "sync_round_remote") as sr:
+                ns.sync_remote(args)
+    sr.assert_called_once_with(args)
+    assert mockio.buffer.read() == b'\x00\x00\x00\x01\x01'
+
+
+def test_sync_peers():
+    args = argparse.Namespace(remote=["one", "two"], remote_cmd=None, watch=None)
+    seen = []
+
+    def _sync(pargs):
+        seen.append((pargs.remote, pargs.watch, ns.change_cache.active))
+        return 123
+
+    with patch.object(ns, "change_cache", ns.ChangeCache()) as cache:
+        with patch.object(ns, "sync_local", side_effect=_sync):
+            ns.sync_peers(args)
+        assert seen == [("one", None, True), ("two", None, True)]
+        assert cache.changes == {}
+    assert args.remote == ["one", "two"]
+
+
+def test_sync_peers_failed():
+    args = argparse.Namespace(remote=["one", "two", "three"], remote_cmd=None, watch=None)
+    def _sync(pargs):
+        if pargs.remote == "one":
+            raise ValueError("foo")
+        if pargs.remote == "two":
+            sys.exit(1)
+        return 123
+    with patch.object(ns, "sync_local", side_effect=_sync) as sl:
+        with pytest.raises(SystemExit):
+            ns.sync_peers(args)
+    # the others are synced with anyway
+    assert [c.args[0].remote for c in sl.call_args_list] == ["one", "two", "three"]
+
+
+def test_sync_peers_single():
+    args = argparse.Namespace(remote=None, remote_cmd=["cmd"], watch=10)
+    with patch.object(ns, "change_cache", ns.ChangeCache()) as cache:
+        with patch.object(ns, "sync_local") as sl:
+            ns.sync_peers(args)
+        assert not cache.active
+    sl.assert_called_once_with(argparse.Namespace(remote=None, remote_cmd="cmd", watch=10))
+
+
+def test_sync_peers_watch():
+    args = argparse.Namespace(remote=["one", "two"], remote_cmd=None, watch=10)
+    with patch.object(ns, "sync_local", return_value=123) as sl:
+        with patch.object(ns, "wait_for_changes", side_effect=[True, False]) as wc:
+            ns.sync_peers(args)
+    assert [c.args[0].remote for c in sl.call_args_list] == ["one", "two", "one", "two"]
+    assert all(c.args[0].watch is None for c in sl.call_args_list)
+    assert wc.call_args_list == [call(123, 10), call(123, 10)]
+
+
+def test_wait_for_changes():
+    db, ctx = writer_db([])
+    # changed after the first poll, then stable until debounced
+    db.revision.side_effect = [rev(124), rev(124)]
+    clock = iter(range(0, 100))
+    with patch("notmuch2.Database", return_value=ctx):
+        with patch("time.sleep") as sl:
+            with patch("time.monotonic", side_effect=lambda: next(clock)):
+                assert ns.wait_for_changes(123, 60)
+    assert sl.call_count == 2
+    assert db.revision.call_count == 2
+
+
+def test_wait_for_changes_timeout():
+    db, ctx = writer_db([])
+    db.revision.side_effect = lambda: rev(123)
+    clock = iter(range(0, 100, 10))
+    with patch("notmuch2.Database", return_value=ctx):
+        with patch("time.sleep") as sl:
+            with patch("time.monotonic", side_effect=lambda: next(clock)):
+                assert ns.wait_for_changes(123, 30)
+    assert sl.call_count == 2
+
+
+def test_wait_for_changes_interrupted():
+    with patch("time.sleep", side_effect=KeyboardInterrupt):
+        assert not ns.wait_for_changes(123, 30)
+
+
+def test_write_read_compressed():
+    data = b"foo" * 1000
+    for method in ns.COMPRESSORS:
+        stream = io.BytesIO()
+        with patch.dict(ns.features, {"compression": method}):
+            ns.write(data, stream)
+            size = struct.unpack("!I", stream.getvalue()[:4])[0]
+            assert size & ns.COMPRESSED_FLAG
+            assert len(stream.getvalue()) - 4 == size & ~ns.COMPRESSED_FLAG
+            assert len(stream.getvalue()) < len(data)
+            stream.seek(0)
+            assert data == ns.read(stream)
+
+
+def test_write_read_compressed_small():
+    stream = io.BytesIO()
+    with patch.dict(ns.features, {"compression": "zlib"}):
+        ns.write(b"foo", stream)
+        assert b"\x00\x00\x00\x03foo" == stream.getvalue()
+        stream.seek(0)
+        assert b"foo" == ns.read(stream)
+
+
+def test_write_read_compressed_incompressible():
+    data = os.urandom(ns.COMPRESS_MIN * 4)
+    stream = io.BytesIO()
+    with patch.dict(ns.features, {"compression": "zlib"}):
+        ns.write(data, stream)
+        assert struct.pack("!I", len(data)) + data == stream.getvalue()
+        stream.seek(0)
+        assert data == ns.read(stream)
+
+
+def test_write_read_uncompressed():
+    data = b"foo" * 1000
+    stream = io.BytesIO()
+    with patch.dict(ns.features, {"compression": "none"}):
+        ns.write(data, stream)
+        assert struct.pack("!I", len(data)) + data == stream.getvalue()
+
+
+
+def test_write_too_large():
+    stream = io.BytesIO()
+    data = MagicMock()
+    data.__len__.return_value = ns.COMPRESSED_FLAG
+    with patch.dict(ns.features, {"compression": "none"}):
+        with pytest.raises(ValueError, match="at most 2147483647"):
+            ns.write(data, stream)
+    assert stream.getvalue() == b""
+
+def test_run_async():
+    # both run at the same time
+    threads = {}
+    for first in range(2):
+        ready = threading.Event()
+        def _wait():
+            threads["wait"] = threading.get_ident()
+            assert ready.wait(5)
+        def _set():
+            threads["set"] = threading.get_ident()
+            ready.set()
+        if first == 0:
+            ns.run_async(_wait, _set)
+            assert threads["wait"] == threading.get_ident() != threads["set"]
+        else:
+            ns.run_async(_set, _wait)
+            assert threads["set"] == threading.get_ident() != threads["wait"]
+
+
+def test_run_async_exception():
+    done = []
+    def _fail():
+        raise ValueError("foo")
+    def _slow():
+        time.sleep(0.1)
+        done.append(True)
+    with pytest.raises(ValueError, match="foo"):
+        ns.run_async(_fail, _slow)
+    assert done == [True]
+    with pytest.raises(ValueError, match="foo"):
+        ns.run_async(lambda: None, _fail)
+
+
+
+def test_run_async_pool():
+    # the second function runs in the given pool even if io_pool is busy
+    # waiting for it
+    ready = threading.Event()
+    def _wait():
+        assert ready.wait(5)
+    with ThreadPoolExecutor(max_workers=1) as busy, \
+            ThreadPoolExecutor(max_workers=1) as pool, \
+            patch.object(ns, "io_pool", busy):
+        blocked = busy.submit(ready.wait, 5)
+        ns.run_async(_wait, ready.set, pool)
+        assert blocked.result()
+
+def test_prepare_phases():
+    args = argparse.Namespace(delete=True, mbsync=True)
+    threads = []
+    def _find(prefix):
+        threads.append(threading.current_thread().name)
+        return {"foo/.mbsyncstate": 1.0}
+    with patch.object(ns.id_summary, "load") as idl, patch.object(ns, "find_mbsync_files", side_effect=_find):
+        with patch.dict(ns.features, {"deletes": "bisect"}):
+            prepared = ns.prepare_phases(args, prefix)
+            prepared["deletes"].result()
+            assert prepared["mbsync"].result() == {"foo/.mbsyncstate": 1.0}
+        idl.assert_called_once_with(os.path.join(prefix, ".notmuch", "notmuch-sync.d", "ids"))
+        assert threads[0].startswith("notmuch-sync-io")
+        # the summary isn't used without bisecting
+        with patch.dict(ns.features, {"deletes": "list"}):
+            assert ns.prepare_phases(argparse.Namespace(delete=True, mbsync=False), prefix) == {}
+
+
+def test_stats():
+    st = ns.Stats()
+    with patch.dict(ns.transfer, {"read": 10, "write": 20}):
+        with patch("time.monotonic", side_effect=[1.0, 3.0]):
+            with st.phase("files"):
+                ns.transfer["read"] += 2 * 10**6
+                ns.transfer["write"] += 10
+        st.add("files", files=4)
+    st.add("digest", seconds=0.5, bytes=10**6, files=2)
+    st.add("digest", seconds=0.5, bytes=10**6, files=2)
+    st.add("ids")
+    assert {"files": {"seconds": 2.0, "read": 2 * 10**6, "write": 10, "files": 4,
+                      "mb_per_s": (2 * 10**6 + 10) / 2.0 / 1e6, "files_per_s": 2.0},
+            "digest": {"seconds": 1.0, "bytes": 2 * 10**6, "files": 4,
+                       "mb_per_s": 2.0, "files_per_s": 4.0},
+            "ids": {}} == st.report()
+    st.clear()
+    assert {} == st.report()
+
+
+def test_stats_digest():
+    with NamedTemporaryFile(mode="w+b", prefix="notmuch-sync-test-tmp-") as f:
+        f.write(b"mail one")
+        f.flush()
+        with patch.object(ns, "stats", ns.Stats()) as st:
+            ns.digest_file(f.name)
+            ns.digest_file(f.name)
+            report = st.report()
+    assert report["digest"]["files"] == 2
+    assert report["digest"]["bytes"] == 16
+
+
+def test_write_stats():
+    with TemporaryDirectory() as tmpdir:
+        fname = os.path.join(tmpdir, "stats")
+        ns.write_stats(fname, {"foo": 1})
+        ns.write_stats(fname, {"foo": 2})
+        with open(fname, "r", encoding="utf-8") as f:
+            assert [{"foo": 1}, {"foo": 2}] == [json.loads(line) for line in f]
+    with patch("sys.stdout", new_callable=io.StringIO) as out:
+        ns.write_stats("-", {"foo": 3})
+    assert {"foo": 3} == json.loads(out.getvalue())
+
+
+def test_negotiate():
+    assert {"files": "chunked", "changes": "binary", "hashes": "batched", "compression": ns.CAPABILITIES["compression"][0], "streams": "multi", "deletes": "bisect", "delta": "blocks", "dedup": "refs", "digest": ns.CAPABILITIES["digest"][0], "rounds": "multi", "report": "json", "noop": "skip"} == \
+        ns.negotiate(ns.CAPABILITIES, ns.CAPABILITIES)
+    assert ns.LEGACY == ns.negotiate(ns.CAPABILITIES, {})
+    assert {"files": "chunked", "changes": "binary", "hashes": "list", "compression": "none", "streams": "single", "deletes": "list", "delta": "none", "dedup": "none", "digest": "sha256", "rounds": "single", "report": "none", "noop": "full"} == \
+        ns.negotiate(ns.CAPABILITIES, {"files": ["whole", "chunked"], "changes": ["binary"], "foo": ["bar"]})
+    assert {"files": "whole", "changes": "json", "hashes": "list", "compression": "zlib", "streams": "single", "deletes": "list", "delta": "none", "dedup": "none", "digest": "sha256", "rounds": "single", "report": "none", "noop": "full"} == \
+        ns.negotiate({"files": ["whole", "chunked"], "compression": ["zlib"]}, ns.CAPABILITIES)
+
+
+def test_handshake_local():
+    ostream = io.BytesIO()
+    ops = io.BytesIO()
+    ns.write(json.dumps({"version": 1, "features": {"files": ["whole"], "changes": ["binary", "json"]}}).encode("utf-8"), ops)
+    istream = io.BufferedReader(io.BytesIO(ns.HELLO + ops.getvalue()))
+    with patch.dict(ns.features):
+        assert ns.handshake(istream, ostream, local=True)
+        assert {"files": "whole", "changes": "binary", "hashes": "list", "compression": "none", "streams": "single", "deletes": "list", "delta": "none", "dedup": "none", "digest": "sha256", "rounds": "single", "report": "none", "noop": "full"} == ns.features
+    assert ostream.getvalue().startswith(ns.HELLO)
+    hello = json.loads(ns.read(io.BytesIO(ostream.getvalue()[len(ns.HELLO):])).decode("utf-8"))
+    assert {"version": ns.PROTOCOL_VERSION, "role": "sync", "features": ns.CAPABILITIES} == hello
+
+
+def test_handshake_local_files():
+    ostream = io.BytesIO()
+    ops = io.BytesIO()
+    ns.write(json.dumps({"version": 1, "features": ns.CAPABILITIES}).encode("utf-8"), ops)
+    istream = io.BufferedReader(io.BytesIO(ns.HELLO + ops.getvalue()))
+    negotiated = ns.negotiate(ns.CAPABILITIES, ns.CAPABILITIES)
+    with patch.dict(ns.features, negotiated):
+        assert ns.handshake(istream, ostream, local=True, role="files", uuid=uuid)
+        assert negotiated == ns.features
+    hello = json.loads(ns.read(io.BytesIO(ostream.getvalue()[len(ns.HELLO):])).decode("utf-8"))
+    assert {"version": ns.PROTOCOL_VERSION, "role": "files", "features": ns.CAPABILITIES, "uuid": uuid} == hello
+
+
+def test_handshake_local_files_different():
+    ops = io.BytesIO()
+    ns.write(json.dumps({"version": 1, "features": ns.CAPABILITIES | {"files": ["whole"]}}).encode("utf-8"), ops)
+    istream = io.BufferedReader(io.BytesIO(ns.HELLO + ops.getvalue()))
+    negotiated = ns.negotiate(ns.CAPABILITIES, ns.CAPABILITIES)
+    # the main connection's features are left alone
+    with patch.dict(ns.features, negotiated):
+        with pytest.raises(ValueError):
+            ns.handshake(istream, io.BytesIO(), local=True, role="files", uuid=uuid)
+        assert negotiated == ns.features
+        istream = io.BufferedReader(io.BytesIO(b"00000000-0000-0000-0000-000000000001"))
+        assert not ns.handshake(istream, io.BytesIO(), local=True, role="files", uuid=uuid)
+        assert negotiated == ns.features
+
+
+def test_handshake_local_legacy():
+    ostream = io.BytesIO()
+    istream = io.BufferedReader(io.BytesIO(b"00000000-0000-0000-0000-000000000001"))
+    with patch.dict(ns.features):
+        assert not ns.handshake(istream, ostream, local=True)
+        assert ns.LEGACY == ns.features
+
+
+def test_handshake_local_closed():
+    # e.g. a legacy remote that exited because of unknown options
+    ostream = io.BytesIO()
+    istream = io.BufferedReader(io.BytesIO(b""))
+    with patch.dict(ns.features):
+        assert ns.handshake(istream, ostream, local=True) is None
+        assert ns.LEGACY == ns.features
+
+
+def test_handshake_remote_closed():
+    istream = io.BufferedReader(io.BytesIO(b""))
+    with patch.dict(ns.features):
+        with pytest.raises(ValueError, match="Connection closed"):
+            ns.handshake(istream, io.BytesIO(), local=False)
+
+
+def test_handshake_remote():
+    ostream = io.BytesIO()
+    ops = io.BytesIO()
+    ns.write(json.dumps({"version": 1, "features": {"files": ["whole", "chunked"], "changes": ["json", "binary"], "hashes": ["batched"]}}).encode("utf-8"), ops)
+    istream = io.BufferedReader(io.BytesIO(ns.HELLO + ops.getvalue() + b"rest"))
+    with patch.dict(ns.features):
+        assert ns.handshake(istream, ostream, local=False)
+        assert {"files": "whole", "changes": "json", "hashes": "batched", "compression": "none", "streams": "single", "deletes": "list", "delta": "none", "dedup": "none", "digest": "sha256", "rounds": "single", "report": "none", "noop": "full"} == ns.features
+    assert ostream.getvalue().startswith(ns.HELLO)
+    assert b"rest" == istream.read()
+
+
+def test_handshake_remote_legacy():
+    ostream = io.BytesIO()
+    istream = io.BufferedReader(io.BytesIO(b"00000000-0000-0000-0000-000000000001"))
+    with patch.dict(ns.features):
+        assert not ns.handshake(istream, ostream, local=False)
+        assert ns.LEGACY == ns.features
+    assert b"" == ostream.getvalue()
+    assert b"00000000-0000-0000-0000-000000000001" == istream.read()
+
+
+def test_legacy_send_recv_file():
+    with TemporaryDirectory() as tmp:
+        fname = os.path.join(tmp, "foo")
+        with open(fname, "wb") as f:
+            f.write(b"x" * (ns.CHUNK_SIZE + 10))
+        stream = io.BytesIO()
+        with patch.dict(ns.features, ns.LEGACY):
+            ns.send_file(fname, stream)
+            assert 4 + ns.CHUNK_SIZE + 10 == len(stream.getvalue())
+            stream.seek(0)
+            ns.recv_file(os.path.join(tmp, "bar"), stream)
+        with open(os.path.join(tmp, "bar"), "rb") as f:
+            assert b"x" * (ns.CHUNK_SIZE + 10) == f.read()
+
+
+def test_legacy_changes():
+    changes = {"foo": {"tags": ["bar"], "files": ["a/b"]}}
+    stream = io.BytesIO()
+    with patch.dict(ns.features, ns.LEGACY):
+        ns.send_changes(changes.items(), stream)
+        assert json.dumps(changes).encode("utf-8") == stream.getvalue()[4:]
+        stream.seek(0)
+        assert {"foo": ns.Change(["bar"], ["a/b"])} == ns.recv_changes(stream)
+
+
 def test_missing_files_empty():
     db = lambda: None
-    istream = io.BytesIO(b"\x00\x00\x00\x02[]\x00\x00\x00\x02[]")
+    db.atomic = MagicMock()
+    istream = io.BytesIO(b"\x00\x00\x00\x02[]")
     ostream = io.BytesIO()
-    assert ({}, 0, 0) == ns.get_missing_files(db, prefix, {}, {}, istream, ostream)
-    assert b"\x00\x00\x00\x02[]\x00\x00\x00\x02[]" == ostream.getvalue()
+    assert ({}, 0, 0) == missing_files(db, prefix, {}, {}, istream, ostream)
+    assert b"\x00\x00\x00\x02[]" == ostream.getvalue()
 
 
 def test_missing_files_new():
@@ -355,6 +1027,7 @@ def test_missing_files_new():
     m.filenames = MagicMock(return_value=[os.path.join(gettempdir(), "foofile")])
     m.ghost = False
     db = lambda: None
+    db.atomic = MagicMock()
 
     def effect(*args, **kwargs):
         yield m
@@ -368,38 +1041,40 @@ def test_missing_files_new():
     changes = {"foo": {"tags": ["foo"], "files": ["foofile"]},
                "bar": {"tags": ["bar"], "files": ["barfile"]}}
 
-    istream = io.BytesIO(b"\x00\x00\x00\x02[]\x00\x00\x00\x02[]")
+    istream = io.BytesIO(b"\x00\x00\x00\x02[]")
     ostream = io.BytesIO()
     exp = {"bar": {"tags": ["bar"], "files": ["barfile"]}}
-    assert (exp, 0, 0) == ns.get_missing_files(db, prefix, {}, changes, istream, ostream)
-    assert b"\x00\x00\x00\x02[]\x00\x00\x00\x02[]" == ostream.getvalue()
+    assert (exp, 0, 0) == missing_files(db, prefix, {}, changes, istream, ostream)
+    assert b"\x00\x00\x00\x02[]" == ostream.getvalue()
 
-    assert m.filenames.call_count == 2
-    assert db.find.mock_calls == [call('foo'), call('bar'), call('foo'), call('bar')]
+    assert m.filenames.call_count == 1
+    assert db.find.mock_calls == [call("foo"), call("bar")]
 
 
 def test_missing_files_ghost():
     m = MagicMock()
     m.ghost = True
     db = lambda: None
+    db.atomic = MagicMock()
 
     db.find = MagicMock(return_value=m)
 
     changes = {"bar": {"tags": ["bar"], "files": ["foo"]}}
 
-    istream = io.BytesIO(b"\x00\x00\x00\x02[]\x00\x00\x00\x02[]")
+    istream = io.BytesIO(b"\x00\x00\x00\x02[]")
     ostream = io.BytesIO()
     exp = {"bar": {"tags": ["bar"], "files": ["foo"]}}
-    assert (exp, 0, 0) == ns.get_missing_files(db, prefix, {}, changes, istream, ostream)
-    assert b"\x00\x00\x00\x02[]\x00\x00\x00\x02[]" == ostream.getvalue()
+    assert (exp, 0, 0) == missing_files(db, prefix, {}, changes, istream, ostream)
+    assert b"\x00\x00\x00\x02[]" == ostream.getvalue()
 
-    assert db.find.mock_calls == [ call("bar"), call("bar") ]
+    assert db.find.mock_calls == [ call("bar") ]
 
 
 def test_missing_files_inconsistent_no_move():
     m = MagicMock()
     m.ghost = False
     db = lambda: None
+    db.atomic = MagicMock()
 
     db.find = MagicMock(return_value=m)
     db.add = MagicMock(return_value=(m, True))
@@ -418,22 +1093,23 @@ def test_missing_files_inconsistent_no_move():
                 f2name = f2.name.removeprefix(prefix)
                 changes_mine = {"foo": {"tags": ["foo"], "files": [f1.name.removeprefix(prefix)]}}
                 changes_theirs = {"foo": {"tags": ["foo"], "files": [f2name]}}
-                assert ({}, 0, 0) == ns.get_missing_files(db, prefix, changes_mine, changes_theirs, istream, ostream, move_on_change=False)
+                assert ({}, 0, 0) == missing_files(db, prefix, changes_mine, changes_theirs, istream, ostream, move_on_change=False)
                 tmp = json.dumps([f2name])
-                assert struct.pack("!I", len(tmp)) + tmp.encode("utf-8") + b"\x00\x00\x00\x02[]" == ostream.getvalue()
+                assert struct.pack("!I", len(tmp)) + tmp.encode("utf-8") == ostream.getvalue()
 
                 assert sm.call_count == 0
                 assert db.add.call_count == 0
                 assert db.remove.call_count == 0
-                assert db.find.mock_calls == [ call("foo"), call("foo") ]
+                assert db.find.mock_calls == [ call("foo") ]
 
-    assert m.filenames.call_count == 3
+    assert m.filenames.call_count == 1
 
 
 def test_missing_files_inconsistent_move():
     m = MagicMock()
     m.ghost = False
     db = lambda: None
+    db.atomic = MagicMock()
 
     db.find = MagicMock(return_value=m)
     db.add = MagicMock(return_value=(m, True))
@@ -452,22 +1128,23 @@ def test_missing_files_inconsistent_move():
                 f2name = f2.name.removeprefix(prefix)
                 changes_mine = {"foo": {"tags": ["foo"], "files": [f1.name.removeprefix(prefix)]}}
                 changes_theirs = {"foo": {"tags": ["foo"], "files": [f2name]}}
-                assert ({}, 1, 0) == ns.get_missing_files(db, prefix, changes_mine, changes_theirs, istream, ostream, move_on_change=True)
+                assert ({}, 1, 0) == missing_files(db, prefix, changes_mine, changes_theirs, istream, ostream, move_on_change=True)
                 tmp = json.dumps([f2name])
-                assert struct.pack("!I", len(tmp)) + tmp.encode("utf-8") + b"\x00\x00\x00\x02[]" == ostream.getvalue()
+                assert struct.pack("!I", len(tmp)) + tmp.encode("utf-8") == ostream.getvalue()
 
                 sm.assert_called_once_with(f1.name, f2.name)
                 db.add.assert_called_once_with(f2.name)
                 db.remove.assert_called_once_with(f1.name)
-                assert m.filenames.call_count == 3
+                assert m.filenames.call_count == 1
 
-    assert db.find.mock_calls == [ call("foo"), call("foo") ]
+    assert db.find.mock_calls == [ call("foo") ]
 
 
 def test_missing_files_multiple_dups():
     m = MagicMock()
     m.ghost = False
     db = lambda: None
+    db.atomic = MagicMock()
 
     db.find = MagicMock(return_value=m)
     db.add = MagicMock(return_value=(m, True))
@@ -493,22 +1170,23 @@ def test_missing_files_multiple_dups():
                         f4name = f4.name.removeprefix(prefix)
                         changes_mine = {}
                         changes_theirs = {"foo": {"tags": ["foo"], "files": [f3name, f4name]}}
-                        assert ({}, 2, 0) == ns.get_missing_files(db, prefix, changes_mine, changes_theirs, istream, ostream, move_on_change=True)
+                        assert ({}, 2, 0) == missing_files(db, prefix, changes_mine, changes_theirs, istream, ostream, move_on_change=True)
                         tmp = json.dumps([f3name, f4name])
-                        assert struct.pack("!I", len(tmp)) + tmp.encode("utf-8") + b"\x00\x00\x00\x02[]" == ostream.getvalue()
+                        assert struct.pack("!I", len(tmp)) + tmp.encode("utf-8") == ostream.getvalue()
 
                         assert sm.mock_calls == [ call(f1.name, f3.name), call(f2.name, f4.name) ]
                         assert db.add.mock_calls == [ call(f3.name), call(f4.name) ]
                         assert db.remove.mock_calls == [ call(f1.name), call(f2.name) ]
-                        assert m.filenames.call_count == 3
+                        assert m.filenames.call_count == 1
 
-    assert db.find.mock_calls == [ call("foo"), call("foo") ]
+    assert db.find.mock_calls == [ call("foo") ]
 
 
 def test_missing_files_multiple_dups_copy_move():
     m = MagicMock()
     m.ghost = False
     db = lambda: None
+    db.atomic = MagicMock()
 
     db.find = MagicMock(return_value=m)
     db.add = MagicMock(return_value=(m, True))
@@ -532,23 +1210,24 @@ def test_missing_files_multiple_dups_copy_move():
                         f3name = f3.name.removeprefix(prefix)
                         changes_mine = {}
                         changes_theirs = {"foo": {"tags": ["foo"], "files": [f2name, f3name]}}
-                        assert ({}, 2, 0) == ns.get_missing_files(db, prefix, changes_mine, changes_theirs, istream, ostream, move_on_change=True)
+                        assert ({}, 2, 0) == missing_files(db, prefix, changes_mine, changes_theirs, istream, ostream, move_on_change=True)
                         tmp = json.dumps([f2name, f3name])
-                        assert struct.pack("!I", len(tmp)) + tmp.encode("utf-8") + b"\x00\x00\x00\x02[]" == ostream.getvalue()
+                        assert struct.pack("!I", len(tmp)) + tmp.encode("utf-8") == ostream.getvalue()
 
                         assert sm.mock_calls == [ call(f1.name, f2.name) ]
                         assert sc.mock_calls == [ call(f2.name, f3.name) ]
                         assert db.add.mock_calls == [ call(f2.name), call(f3.name) ]
                         assert db.remove.mock_calls == [ call(f1.name) ]
-                        assert m.filenames.call_count == 3
+                        assert m.filenames.call_count == 1
 
-    assert db.find.mock_calls == [ call("foo"), call("foo") ]
+    assert db.find.mock_calls == [ call("foo") ]
 
 
 def test_missing_files_moved():
     m = MagicMock()
     m.ghost = False
     db = lambda: None
+    db.atomic = MagicMock()
 
     db.find = MagicMock(return_value=m)
     db.add = MagicMock(return_value=(m, True))
@@ -564,22 +1243,109 @@ def test_missing_files_moved():
                 f1.flush()
                 f2name = f2.name.removeprefix(prefix)
                 changes = {"foo": {"tags": ["foo"], "files": [f2name]}}
-                assert ({}, 1, 0) == ns.get_missing_files(db, prefix, {}, changes, istream, ostream)
+                assert ({}, 1, 0) == missing_files(db, prefix, {}, changes, istream, ostream)
                 tmp = json.dumps([f2name])
-                assert struct.pack("!I", len(tmp)) + tmp.encode("utf-8") + b"\x00\x00\x00\x02[]" == ostream.getvalue()
+                assert struct.pack("!I", len(tmp)) + tmp.encode("utf-8") == ostream.getvalue()
 
                 sm.assert_called_once_with(f1.name, f2.name)
                 db.add.assert_called_once_with(f2.name)
                 db.remove.assert_called_once_with(f1.name)
-                assert m.filenames.call_count == 3
+                assert m.filenames.call_count == 1
+
+    assert db.find.mock_calls == [ call("foo") ]
+
+
+def test_missing_files_local_digests():
+    m = MagicMock()
+    m.ghost = False
+    db = lambda: None
+    db.atomic = MagicMock()
+
+    db.find = MagicMock(return_value=m)
+    db.add = MagicMock(return_value=(m, True))
+    db.remove = MagicMock()
+
+    threads = []
+    digest = ns.digests.digest
+
+    def _digest(fname):
+        threads.append(threading.current_thread().name)
+        return digest(fname)
+
+    with patch("shutil.move"):
+        with NamedTemporaryFile(mode="w+t", prefix="notmuch-sync-test-tmp-") as f1:
+            with NamedTemporaryFile(mode="w+t", prefix="notmuch-sync-test-tmp-") as f2:
+                istream = io.BytesIO(b"\x00\x00\x00\x02[]\x00\x00\x00\x44[\"a983f58ef9ef755c4e5e3755f10cf3e08d9b189b388bcb59d29b56d35d7d6b9d\"]")
+                ostream = io.BytesIO()
+                m.filenames = MagicMock(return_value=[f1.name])
+                f1.write("mail one")
+                f1.flush()
+                f2name = f2.name.removeprefix(prefix)
+                changes = {"foo": {"tags": ["foo"], "files": [f2name]}}
+                with patch.object(ns.digests, "digest", side_effect=_digest):
+                    assert ({}, 1, 0) == missing_files(db, prefix, {}, changes, istream, ostream)
+
+    # computed once, on a worker thread rather than while processing messages
+    # on the thread receiving hashes
+    assert len(threads) == 1
+    assert threads[0] != threading.current_thread().name
+    assert not threads[0].startswith("notmuch-sync-io")
 
-    assert db.find.mock_calls == [ call("foo"), call("foo") ]
+
+def test_missing_files_moved_pending():
+    m = MagicMock()
+    m.ghost = False
+    db = lambda: None
+    db.find = MagicMock(return_value=m)
+
+    with TemporaryDirectory() as tmpdir:
+        tprefix = os.path.join(tmpdir, "")
+        with open(os.path.join(tmpdir, "one"), "wb") as f:
+            f.write(b"mail one")
+        m.filenames = MagicMock(return_value=[os.path.join(tmpdir, "one")])
+        istream = io.BytesIO(b"\x00\x00\x00\x02[]\x00\x00\x00\x44[\"a983f58ef9ef755c4e5e3755f10cf3e08d9b189b388bcb59d29b56d35d7d6b9d\"]")
+        ostream = io.BytesIO()
+        changes = {"foo": {"tags": ["foo"], "files": ["new/two"]}}
+        pending = ns.PendingChanges(tprefix, ns.staging_dir(tprefix, uuid))
+        assert ({}, 1, 0) == ns.get_missing_files(db, tprefix, {}, changes, istream, ostream, pending)
+
+        # nothing happens until the changes are applied
+        assert ["one"] == os.listdir(tmpdir)
+        assert [("move", os.path.join(tmpdir, "one"), os.path.join(tmpdir, "new", "two"))] == pending.ops
+
+        db.atomic = MagicMock()
+        db.add = MagicMock(return_value=(m, True))
+        db.remove = MagicMock()
+        assert 0 == pending.apply(db)
+        assert ["new"] == os.listdir(tmpdir)
+        db.add.assert_called_once_with(os.path.join(tmpdir, "new", "two"))
+        db.remove.assert_called_once_with(os.path.join(tmpdir, "one"))
+        assert [] == pending.ops
+
+
+def test_pending_changes_disappeared():
+    db = lambda: None
+    db.atomic = MagicMock()
+    db.add = MagicMock()
+    db.remove = MagicMock()
+
+    with TemporaryDirectory() as tmpdir:
+        tprefix = os.path.join(tmpdir, "")
+        pending = ns.PendingChanges(tprefix, ns.staging_dir(tprefix, uuid))
+        pending.move(os.path.join(tmpdir, "one"), os.path.join(tmpdir, "two"))
+        pending.copy(os.path.join(tmpdir, "one"), os.path.join(tmpdir, "three"))
+        assert 0 == pending.apply(db)
+        assert [] == os.listdir(tmpdir)
+
+    db.add.assert_not_called()
+    db.remove.assert_not_called()
 
 
 def test_missing_files_copied():
     m = MagicMock()
     m.ghost = False
     db = lambda: None
+    db.atomic = MagicMock()
 
     db.find = MagicMock(return_value=m)
     db.add = MagicMock(return_value=(m, True))
@@ -597,14 +1363,14 @@ def test_missing_files_copied():
             fname = f.name.removeprefix(prefix)
             f1name = f1.name.removeprefix(prefix)
             changes = {"foo": {"tags": ["foo"], "files": [f1name, fname]}}
-            assert ({}, 1, 0) == ns.get_missing_files(db, prefix, {}, changes, istream, ostream)
+            assert ({}, 1, 0) == missing_files(db, prefix, {}, changes, istream, ostream)
             tmp = json.dumps([f1name, fname])
-            assert struct.pack("!I", len(tmp)) + tmp.encode("utf-8") + b"\x00\x00\x00\x02[]" == ostream.getvalue()
+            assert struct.pack("!I", len(tmp)) + tmp.encode("utf-8") == ostream.getvalue()
 
             sc.assert_called_once_with(f1.name, f.name)
 
-    assert m.filenames.call_count == 3
-    assert db.find.mock_calls == [ call("foo"), call("foo") ]
+    assert m.filenames.call_count == 1
+    assert db.find.mock_calls == [ call("foo") ]
     db.add.assert_called_once_with(f.name)
 
 
@@ -612,6 +1378,7 @@ def test_missing_files_added():
     m = MagicMock()
     m.ghost = False
     db = lambda: None
+    db.atomic = MagicMock()
 
     db.find = MagicMock(return_value=m)
 
@@ -627,22 +1394,78 @@ def test_missing_files_added():
                     f1name = f1.name.removeprefix(prefix)
                     changes = {"foo": {"tags": ["foo"], "files": [f1name, "bar"]}}
                     exp = {"foo": {"files": ["bar"]}}
-                    assert (exp, 0, 0) == ns.get_missing_files(db, prefix, {}, changes, istream, ostream)
+                    assert (exp, 0, 0) == missing_files(db, prefix, {}, changes, istream, ostream)
                     tmp = json.dumps([f1name, "bar"])
-                    assert struct.pack("!I", len(tmp)) + tmp.encode("utf-8") + b"\x00\x00\x00\x02[]" == ostream.getvalue()
+                    assert struct.pack("!I", len(tmp)) + tmp.encode("utf-8") == ostream.getvalue()
                     assert pu.call_count == 0
 
             assert sm.call_count == 0
             assert sc.call_count == 0
 
-    assert db.find.mock_calls == [ call("foo"), call("foo") ]
-    assert m.filenames.call_count == 3
+    assert db.find.mock_calls == [ call("foo") ]
+    assert m.filenames.call_count == 1
+
+
+def test_missing_files_send_hashes():
+    db = lambda: None
+    db.atomic = MagicMock()
+    with NamedTemporaryFile(mode="w+t", prefix="notmuch-sync-test-tmp-") as f1:
+        with NamedTemporaryFile(mode="w+t", prefix="notmuch-sync-test-tmp-") as f2:
+            f1.write("mail one")
+            f1.flush()
+            f2.write("mail two")
+            f2.flush()
+            tmp = json.dumps([f1.name.removeprefix(prefix), f2.name.removeprefix(prefix)]).encode("utf-8")
+            istream = io.BytesIO(struct.pack("!I", len(tmp)) + tmp)
+            ostream = io.BytesIO()
+            with patch.object(ns, "HASH_BATCH", 1):
+                assert ({}, 0, 0) == missing_files(db, prefix, {}, {}, istream, ostream)
+            h1 = json.dumps([ns.digest(b"mail one")]).encode("utf-8")
+            h2 = json.dumps([ns.digest(b"mail two")]).encode("utf-8")
+            assert b"\x00\x00\x00\x02[]" + struct.pack("!I", len(h1)) + h1 + struct.pack("!I", len(h2)) + h2 == ostream.getvalue()
+
+
+def test_missing_files_recv_hashes_batches():
+    m1 = MagicMock()
+    m1.ghost = False
+    m2 = MagicMock()
+    m2.ghost = False
+    db = lambda: None
+    db.atomic = MagicMock()
+
+    db.find = MagicMock(side_effect=lambda mid: m1 if mid == "foo" else m2)
+    db.add = MagicMock(return_value=(m1, True))
+    db.remove = MagicMock()
+
+    with patch("shutil.move") as sm:
+        with NamedTemporaryFile(mode="w+t", prefix="notmuch-sync-test-tmp-") as f1:
+            with NamedTemporaryFile(mode="w+t", prefix="notmuch-sync-test-tmp-") as f2:
+                f1.write("mail one")
+                f1.flush()
+                f2.write("mail two")
+                f2.flush()
+                m1.filenames = MagicMock(return_value=[f1.name])
+                m2.filenames = MagicMock(return_value=[f2.name])
+                changes = {"foo": {"tags": ["foo"], "files": ["foo1"]},
+                           "bar": {"tags": ["bar"], "files": ["bar1"]}}
+                h1 = json.dumps([ns.digest(b"mail one")]).encode("utf-8")
+                h2 = json.dumps([ns.digest(b"mail two")]).encode("utf-8")
+                # hashes for the two messages arrive separately
+                istream = io.BytesIO(b"\x00\x00\x00\x02[]" + struct.pack("!I", len(h1)) + h1 + struct.pack("!I", len(h2)) + h2)
+                ostream = io.BytesIO()
+                assert ({}, 2, 0) == missing_files(db, prefix, {}, changes, istream, ostream)
+                assert sm.mock_calls == [
+                    call(f1.name, prefix + "foo1"),
+                    call(f2.name, prefix + "bar1")
+                ]
+                assert istream.read() == b""
 
 
 def test_missing_files_delete():
     m = MagicMock()
     m.ghost = False
     db = lambda: None
+    db.atomic = MagicMock()
 
     db.find = MagicMock(return_value=m)
     db.remove = MagicMock()
@@ -652,7 +1475,7 @@ def test_missing_files_delete():
             with patch("pathlib.Path.unlink") as pu:
                 with NamedTemporaryFile(mode="w+t", prefix="notmuch-sync-test-tmp-") as f1:
                     with NamedTemporaryFile(mode="w+t", prefix="notmuch-sync-test-tmp-") as f2:
-                        istream = io.BytesIO(b"\x00\x00\x00\x02[]\x00\x00\x00\x02[]")
+                        istream = io.BytesIO(b"\x00\x00\x00\x02[]")
                         ostream = io.BytesIO()
                         m.filenames = MagicMock(return_value=[f1.name, f2.name])
                         f1.write("mail one")
@@ -660,21 +1483,22 @@ def test_missing_files_delete():
                         f2.write("mail one")
                         f2.flush()
                         changes = {"foo": {"tags": ["foo"], "files": [f1.name.removeprefix(prefix)]}}
-                        assert ({}, 0, 1) == ns.get_missing_files(db, prefix, {}, changes, istream, ostream)
-                        assert b"\x00\x00\x00\x02[]\x00\x00\x00\x02[]" == ostream.getvalue()
+                        assert ({}, 0, 1) == missing_files(db, prefix, {}, changes, istream, ostream)
+                        assert b"\x00\x00\x00\x02[]" == ostream.getvalue()
                         db.remove.assert_called_once_with(f2.name)
                         pu.assert_called_once()
             assert sm.call_count == 0
             assert sc.call_count == 0
 
-    assert db.find.mock_calls == [ call("foo"), call("foo") ]
-    assert m.filenames.call_count == 2
+    assert db.find.mock_calls == [ call("foo") ]
+    assert m.filenames.call_count == 1
 
 
 def test_missing_files_delete_changed():
     m = MagicMock()
     m.ghost = False
     db = lambda: None
+    db.atomic = MagicMock()
 
     db.find = MagicMock(return_value=m)
     db.remove = MagicMock()
@@ -684,7 +1508,7 @@ def test_missing_files_delete_changed():
             with patch("pathlib.Path.unlink") as pu:
                 with NamedTemporaryFile(mode="w+t", prefix="notmuch-sync-test-tmp-") as f1:
                     with NamedTemporaryFile(mode="w+t", prefix="notmuch-sync-test-tmp-") as f2:
-                        istream = io.BytesIO(b"\x00\x00\x00\x02[]\x00\x00\x00\x02[]")
+                        istream = io.BytesIO(b"\x00\x00\x00\x02[]")
                         ostream = io.BytesIO()
                         m.filenames = MagicMock(return_value=[f1.name, f2.name])
                         f1.write("mail one")
@@ -693,21 +1517,22 @@ def test_missing_files_delete_changed():
                         f2.flush()
                         changes_theirs = {"foo": {"tags": ["foo"], "files": [f1.name.removeprefix(prefix)]}}
                         changes_mine = {"foo": {"tags": ["foo"], "files": [f2.name.removeprefix(prefix)]}}
-                        assert ({}, 0, 0) == ns.get_missing_files(db, prefix, changes_mine, changes_theirs, istream, ostream)
-                        assert b"\x00\x00\x00\x02[]\x00\x00\x00\x02[]" == ostream.getvalue()
+                        assert ({}, 0, 0) == missing_files(db, prefix, changes_mine, changes_theirs, istream, ostream)
+                        assert b"\x00\x00\x00\x02[]" == ostream.getvalue()
                         assert pu.call_count == 0
             assert sm.call_count == 0
             assert sc.call_count == 0
 
     assert db.remove.call_count == 0
-    assert db.find.mock_calls == [ call("foo"), call("foo") ]
-    assert m.filenames.call_count == 2
+    assert db.find.mock_calls == [ call("foo") ]
+    assert m.filenames.call_count == 1
 
 
 def test_missing_files_copy_delete():
     m = MagicMock()
     m.ghost = False
     db = lambda: None
+    db.atomic = MagicMock()
 
     db.find = MagicMock(return_value=m)
     db.add = MagicMock()
@@ -729,9 +1554,9 @@ def test_missing_files_copy_delete():
                         f3.flush()
                         f2name = f2.name.removeprefix(prefix)
                         changes_theirs = {"foo": {"tags": ["foo"], "files": [f2name]}}
-                        assert ({}, 1, 1) == ns.get_missing_files(db, prefix, {}, changes_theirs, istream, ostream)
+                        assert ({}, 1, 1) == missing_files(db, prefix, {}, changes_theirs, istream, ostream)
                         tmp = json.dumps([f2name])
-                        assert struct.pack("!I", len(tmp)) + tmp.encode("utf-8") + b"\x00\x00\x00\x02[]" == ostream.getvalue()
+                        assert struct.pack("!I", len(tmp)) + tmp.encode("utf-8") == ostream.getvalue()
 
                         sm.assert_called_once_with(f1.name, f2.name)
                         db.add.assert_called_once_with(f2.name)
@@ -741,14 +1566,15 @@ def test_missing_files_copy_delete():
                         ]
                         pu.assert_called_once()
 
-    assert db.find.mock_calls == [ call("foo"), call("foo") ]
-    assert m.filenames.call_count == 3
+    assert db.find.mock_calls == [ call("foo") ]
+    assert m.filenames.call_count == 1
 
 
 def test_missing_files_delete_mismatch():
     m = MagicMock()
     m.ghost = False
     db = lambda: None
+    db.atomic = MagicMock()
 
     db.find = MagicMock(return_value=m)
     db.add = MagicMock(return_value=(m, True))
@@ -767,17 +1593,17 @@ def test_missing_files_delete_mismatch():
                 f2name = f2.name.removeprefix(prefix)
                 changes_theirs = {"foo": {"tags": ["foo"], "files": [f2name]}}
                 with pytest.raises(ValueError) as pwe:
-                    ns.get_missing_files(db, prefix, {}, changes_theirs, istream, ostream)
+                    missing_files(db, prefix, {}, changes_theirs, istream, ostream)
                 assert pwe.type == ValueError
                 assert str(pwe.value) == f"Message 'foo' has ['{f2name}'] on remote and different ['{f1.name.removeprefix(prefix)}'] locally!"
                 tmp = json.dumps([f2name])
-                assert struct.pack("!I", len(tmp)) + tmp.encode("utf-8") + b"\x00\x00\x00\x02[]" == ostream.getvalue()
+                assert struct.pack("!I", len(tmp)) + tmp.encode("utf-8") == ostream.getvalue()
 
                 assert db.add.call_count == 0
                 assert pu.call_count == 0
 
-    assert db.find.mock_calls == [ call("foo"), call("foo") ]
-    assert m.filenames.call_count == 3
+    assert db.find.mock_calls == [ call("foo") ]
+    assert m.filenames.call_count == 1
 
 
 def test_send_file():
@@ -788,49 +1614,350 @@ def test_send_file():
         stream = io.BytesIO()
         ns.send_file(f1.name, stream)
         out = stream.getvalue()
-        assert b"\x00\x00\x00\x0email one\nmail\n" == out
+        assert b"\x00\x00\x00\x0email one\nmail\n\x00\x00\x00\x00" == out
+
 
+def test_send_file_chunks():
+    with NamedTemporaryFile(mode="w+b", prefix="notmuch-sync-test-tmp-", delete_on_close=False) as f1:
+        f1.write(b"a" * (ns.CHUNK_SIZE + 1))
+        f1.close()
+        stream = io.BytesIO()
+        ns.send_file(f1.name, stream)
+        out = stream.getvalue()
+        assert struct.pack("!I", ns.CHUNK_SIZE) + b"a" * ns.CHUNK_SIZE + b"\x00\x00\x00\x01a\x00\x00\x00\x00" == out
+
+
+def test_send_file_empty():
+    with NamedTemporaryFile(mode="w+t", prefix="notmuch-sync-test-tmp-", delete_on_close=False) as f1:
+        f1.close()
+        stream = io.BytesIO()
+        ns.send_file(f1.name, stream)
+        assert b"\x00\x00\x00\x00" == stream.getvalue()
 
 
 def test_recv_file():
-    fname = "foo"
-    with patch("builtins.open", mock_open()) as o:
-        stream = io.BytesIO(b"\x00\x00\x00\x0email one\nmail\n")
-        ns.recv_file("foo", stream, "3d0ea99df44f734ef462d85bfeb1352edcb7af528f3386cdaa0939ac27cd8cb3")
-        o.assert_called_once_with("foo", "wb")
-        hdl = o()
-        hdl.write.assert_called_once()
-        args = hdl.write.call_args.args
-        assert b"mail one\nmail\n" == args[0]
+    with TemporaryDirectory() as tmpdir:
+        fname = os.path.join(tmpdir, "cur", "foo")
+        stream = io.BytesIO(b"\x00\x00\x00\x09mail one\n\x00\x00\x00\x05mail\n\x00\x00\x00\x00")
+        ns.recv_file(fname, stream)
+        with open(fname, "rb") as f:
+            assert b"mail one\nmail\n" == f.read()
+        assert ["foo"] == os.listdir(os.path.join(tmpdir, "cur"))
 
 
 def test_recv_file_exists():
-    fname = "foo"
-    with patch("builtins.open", mock_open()) as o:
-        with patch("pathlib.Path.exists") as pe:
-            with patch("pathlib.Path.read_bytes") as prb:
-                pe.return_value = True
-                prb.return_value = b"mail one"
-                stream = io.BytesIO(b"\x00\x00\x00\x0email one\nmail\n")
-                with pytest.raises(ValueError) as pwe:
-                    ns.recv_file("foo", stream, "3d0ea99df44f734ef462d85bfeb1352edcb7af528f3386cdaa0939ac27cd8cb3")
-                assert pwe.type == ValueError
-                assert str(pwe.value) == "Receiving 'foo', but already exists with different content!"
-                assert pe.call_count == 1
-                assert o.call_count == 0
+    with TemporaryDirectory() as tmpdir:
+        fname = os.path.join(tmpdir, "foo")
+        with open(fname, "wb") as f:
+            f.write(b"mail one")
+        stream = io.BytesIO(b"\x00\x00\x00\x0email one\nmail\n\x00\x00\x00\x00")
+        with pytest.raises(ValueError) as pwe:
+            ns.recv_file(fname, stream)
+        assert pwe.type == ValueError
+        assert str(pwe.value) == f"Receiving '{fname}', but already exists with different content!"
+        with open(fname, "rb") as f:
+            assert b"mail one" == f.read()
+        assert ["foo"] == os.listdir(tmpdir)
+
+
+def test_recv_file_exists_same():
+    with TemporaryDirectory() as tmpdir:
+        fname = os.path.join(tmpdir, "foo")
+        with open(fname, "wb") as f:
+            f.write(b"mail one\nX-TUID: foo\nmail\n")
+        stream = io.BytesIO(b"\x00\x00\x00\x09mail one\n\x00\x00\x00\x05mail\n\x00\x00\x00\x00")
+        ns.recv_file(fname, stream)
+        with open(fname, "rb") as f:
+            assert b"mail one\nmail\n" == f.read()
+
+
+def test_recv_file_exists_no_raise():
+    with TemporaryDirectory() as tmpdir:
+        fname = os.path.join(tmpdir, "foo")
+        with open(fname, "wb") as f:
+            f.write(b"mail one")
+        stream = io.BytesIO(b"\x00\x00\x00\x05mail\n\x00\x00\x00\x00")
+        ns.recv_file(fname, stream, overwrite_raise=False)
+        with open(fname, "rb") as f:
+            assert b"mail\n" == f.read()
+
+
+def test_file_signature():
+    with TemporaryDirectory() as tmpdir:
+        fname = os.path.join(tmpdir, "foo")
+        with open(fname, "wb") as f:
+            f.write(b"a" * (ns.DELTA_MIN - 1))
+        assert b'' == ns.file_signature(fname)
+        with open(fname, "wb") as f:
+            f.write(b"a" * (ns.DELTA_BLOCK * 20 + 5))
+        sig = ns.file_signature(fname)
+        assert ns.DELTA_BLOCK == struct.unpack_from("!I", sig)[0]
+        # incomplete last block is left out
+        assert 4 + 20 * 12 == len(sig)
+
+
+def test_send_recv_delta():
+    body = os.urandom(200000)
+    with TemporaryDirectory() as tmpdir:
+        basis = os.path.join(tmpdir, "basis")
+        with open(basis, "wb") as f:
+            f.write(b"X-TUID: foo\nSubject: bar\n\n" + body)
+        src = os.path.join(tmpdir, "src")
+        with open(src, "wb") as f:
+            f.write(b"X-TUID: foobar\nX-Spam: no\nSubject: bar\n\n" + body[:100000] + b"baz" + body[100000:])
+        sig = ns.file_signature(basis)
+        stream = io.BytesIO()
+        with patch.dict(ns.features, {"compression": "none"}):
+            ns.send_file(src, stream, sig)
+            # only the changed blocks are sent
+            assert len(stream.getvalue()) < 3 * struct.unpack_from("!I", sig)[0] + 200
+            stream.seek(0)
+            dst = os.path.join(tmpdir, "dst")
+            ns.recv_file(dst, stream, basis=basis, signature=sig)
+        with open(src, "rb") as f1, open(dst, "rb") as f2:
+            assert f1.read() == f2.read()
+
+
+def test_send_recv_delta_chunks():
+    body = os.urandom(200000)
+    with TemporaryDirectory() as tmpdir:
+        basis = os.path.join(tmpdir, "basis")
+        with open(basis, "wb") as f:
+            f.write(body)
+        src = os.path.join(tmpdir, "src")
+        with open(src, "wb") as f:
+            f.write(body[:50000] + os.urandom(10000) + body[70000:150000] + body[:30000])
+        sig = ns.file_signature(basis)
+        stream = io.BytesIO()
+        # blocks span chunks and literal data is longer than a chunk
+        with patch.dict(ns.features, {"compression": "none"}), patch.object(ns, "CHUNK_SIZE", 4096):
+            ns.send_file(src, stream, sig)
+            assert len(stream.getvalue()) < 10000 + 3 * struct.unpack_from("!I", sig)[0] + 200
+            stream.seek(0)
+            dst = os.path.join(tmpdir, "dst")
+            ns.recv_file(dst, stream, basis=basis, signature=sig)
+        with open(src, "rb") as f1, open(dst, "rb") as f2:
+            assert f1.read() == f2.read()
+
+
+def test_send_recv_delta_different():
+    with TemporaryDirectory() as tmpdir:
+        basis = os.path.join(tmpdir, "basis")
+        with open(basis, "wb") as f:
+            f.write(os.urandom(50000))
+        src = os.path.join(tmpdir, "src")
+        with open(src, "wb") as f:
+            f.write(os.urandom(ns.CHUNK_SIZE + 5))
+        sig = ns.file_signature(basis)
+        stream = io.BytesIO()
+        ns.send_file(src, stream, sig)
+        stream.seek(0)
+        dst = os.path.join(tmpdir, "dst")
+        ns.recv_file(dst, stream, basis=basis, signature=sig)
+        with open(src, "rb") as f1, open(dst, "rb") as f2:
+            assert f1.read() == f2.read()
+
+
+def test_recv_delta_corrupted():
+    with TemporaryDirectory() as tmpdir:
+        basis = os.path.join(tmpdir, "basis")
+        with open(basis, "wb") as f:
+            f.write(os.urandom(50000))
+        sig = ns.file_signature(basis)
+        stream = io.BytesIO()
+        ns.send_file(basis, stream, sig)
+        # basis changed in the meantime
+        with open(basis, "r+b") as f:
+            f.write(b"foo")
+        stream.seek(0)
+        dst = os.path.join(tmpdir, "dst")
+        with pytest.raises(ValueError) as pwe:
+            ns.recv_file(dst, stream, basis=basis, signature=sig)
+        assert str(pwe.value) == f"File received as differences to '{basis}' is corrupted!"
+        assert ["basis"] == os.listdir(tmpdir)
+
+
+def test_sync_files_delta():
+    body = os.urandom(50000)
+    with TemporaryDirectory() as tmpdir:
+        tprefix = os.path.join(tmpdir, "")
+        basis = os.path.join(tmpdir, "one")
+        with open(basis, "wb") as f:
+            f.write(b"X-TUID: foo\n" + body)
+        with open(os.path.join(tmpdir, "three"), "wb") as f:
+            f.write(b"X-TUID: bar\n" + body)
+        missing = {"foo": {"files": ["two"], "basis": basis}}
+        db = lambda: None
+        db.atomic = MagicMock()
+        db.add = MagicMock(return_value=(lambda: None, True))
+
+        # remote sends its requests and differences for file two
+        sig = ns.file_signature(basis)
+        delta = io.BytesIO()
+        with open(os.path.join(tmpdir, "src"), "wb") as f:
+            f.write(b"X-TUID: foobar\n" + body)
+        with patch.dict(ns.features, {"compression": "none"}):
+            ns.send_file(os.path.join(tmpdir, "src"), delta, sig)
+        tmp = json.dumps(["three"]).encode("utf-8")
+        istream = io.BytesIO(struct.pack("!I", len(tmp)) + tmp + struct.pack("!I", len(sig)) + sig +
+                             delta.getvalue())
+        ostream = io.BytesIO()
+        with patch.dict(ns.features, {"delta": "blocks", "compression": "none"}):
+            assert (0, 1) == sync_files(db, tprefix, missing, istream, ostream)
+
+        with open(os.path.join(tmpdir, "two"), "rb") as f:
+            assert b"X-TUID: foobar\n" + body == f.read()
+        out = ostream.getvalue()
+        tmp = json.dumps(["two"]).encode("utf-8")
+        assert out.startswith(struct.pack("!I", len(tmp)) + tmp + struct.pack("!I", len(sig)) + sig)
+        # file three is sent as differences to file one on the remote
+        assert len(out) < len(body) / 10
+
+
+def test_fsync_paths():
+    with TemporaryDirectory() as tmpdir:
+        fname = os.path.join(tmpdir, "foo")
+        with open(fname, "wb") as f:
+            f.write(b"mail one")
+        with patch("os.fsync", wraps=os.fsync) as fs:
+            ns.fsync_paths([fname, tmpdir])
+            assert fs.call_count == 2
+        with pytest.raises(FileNotFoundError):
+            ns.fsync_paths([fname + "bar"])
+
+
+def test_copy_file():
+    with TemporaryDirectory() as tmpdir:
+        src = os.path.join(tmpdir, "src")
+        with open(src, "w") as f:
+            f.write("mail")
+        os.chmod(src, 0o600)
+        for method in ns.COPY_METHODS:
+            dst = os.path.join(tmpdir, method)
+            ns.copy_file(src, dst, method)
+            with open(dst, "r") as f:
+                assert "mail" == f.read()
+            assert 0o600 == os.stat(dst).st_mode & 0o777
+        assert os.stat(src).st_ino == os.stat(os.path.join(tmpdir, "hardlink")).st_ino
+        assert os.stat(src).st_ino != os.stat(os.path.join(tmpdir, "copy")).st_ino
+        assert os.stat(src).st_ino != os.stat(os.path.join(tmpdir, "reflink")).st_ino
+
+
+def test_copy_file_fallback():
+    with TemporaryDirectory() as tmpdir:
+        src = os.path.join(tmpdir, "src")
+        with open(src, "w") as f:
+            f.write("mail")
+        with patch("os.link", side_effect=OSError(18, "Invalid cross-device link")), \
+             patch("fcntl.ioctl", side_effect=OSError(95, "Operation not supported")):
+            for method in ns.COPY_METHODS:
+                dst = os.path.join(tmpdir, method)
+                ns.copy_file(src, dst, method)
+                with open(dst, "r") as f:
+                    assert "mail" == f.read()
+                assert os.stat(src).st_ino != os.stat(dst).st_ino
+
+
+def test_find_duplicates():
+    with TemporaryDirectory() as tmpdir:
+        tprefix = os.path.join(tmpdir, "")
+        contents = {"a": b"mail one\n", "b": b"mail two\n", "c": b"mail one\n",
+                    "d": b"X-TUID: foo\nmail\n", "e": b"X-TUID: bar\nmail\n",
+                    "f": b"mail one\n", "g": b"mail three\n", "h": b"mail two\n"}
+        for name, content in contents.items():
+            with open(os.path.join(tmpdir, name), "wb") as f:
+                f.write(content)
+        ns.digests.load(os.path.join(tmpdir, "digests"), tprefix)
+        # only files hashed earlier are considered
+        for name in "abcdefg":
+            ns.digests.digest(os.path.join(tmpdir, name))
+        # same digest, but X-TUID differs
+        assert {2: 0, 5: 0} == ns.find_duplicates(tprefix, list(contents))
+
+
+def test_sync_files_dedup():
+    with TemporaryDirectory() as tmpdir:
+        tprefix = os.path.join(tmpdir, "")
+        for name in ["three", "four", "five"]:
+            with open(os.path.join(tmpdir, name), "wb") as f:
+                f.write(b"mail three\n" if name != "four" else b"mail four\n")
+        ns.digests.load(os.path.join(tmpdir, "digests"), tprefix)
+        for name in ["three", "four", "five"]:
+            ns.digests.digest(os.path.join(tmpdir, name))
+        missing = {"foo": {"tags": [], "files": ["one", "two"]}, "bar": {"tags": [], "files": ["six"]}}
+        db = lambda: None
+        db.atomic = MagicMock()
+        db.add = MagicMock(return_value=(lambda: None, True))
+
+        tmp = json.dumps(["three", "four", "five"]).encode("utf-8")
+        istream = io.BytesIO(struct.pack("!I", len(tmp)) + tmp + b"\x00\x00\x00\x08[[2, 0]]" +
+                             b"\x00\x00\x00\x09mail one\n\x00\x00\x00\x00" +
+                             b"\x00\x00\x00\x09mail two\n\x00\x00\x00\x00")
+        ostream = io.BytesIO()
+        with patch.dict(ns.features, {"dedup": "refs"}):
+            assert (0, 3) == sync_files(db, tprefix, missing, istream, ostream)
+
+        with open(os.path.join(tmpdir, "six"), "rb") as f:
+            assert b"mail one\n" == f.read()
+        assert db.add.mock_calls == [
+            call(os.path.join(tmpdir, "one")),
+            call(os.path.join(tmpdir, "two")),
+            call(os.path.join(tmpdir, "six"))
+        ]
+        # file five is the same as file three
+        tmp = json.dumps(["one", "two", "six"]).encode("utf-8")
+        assert struct.pack("!I", len(tmp)) + tmp + b"\x00\x00\x00\x08[[2, 0]]" + \
+            b"\x00\x00\x00\x0bmail three\n\x00\x00\x00\x00" + \
+            b"\x00\x00\x00\x0amail four\n\x00\x00\x00\x00" == ostream.getvalue()
+
+
+def test_find_duplicates_same_message():
+    with TemporaryDirectory() as tmpdir:
+        tprefix = os.path.join(tmpdir, "")
+        contents = {"a": b"mail one\n", "b": b"mail one\n", "c": b"mail one\n", "d": b"mail two\n"}
+        for name, content in contents.items():
+            with open(os.path.join(tmpdir, name), "wb") as f:
+                f.write(content)
+        ns.digests.load(os.path.join(tmpdir, "digests"), tprefix)
+        # c is a different message and hasn't been hashed before
+        with patch.object(ns, "digest_file", wraps=ns.digest_file) as df:
+            assert {1: 0} == ns.find_duplicates(tprefix, list(contents), {"a": "foo", "b": "foo", "c": "bar", "d": "foo"})
+            assert df.call_count == 3
+
+
+def test_sync_files_dedup_new_message():
+    with TemporaryDirectory() as tmpdir:
+        tprefix = os.path.join(tmpdir, "")
+        for name in ["one", "two"]:
+            os.mkdir(os.path.join(tmpdir, name))
+            with open(os.path.join(tmpdir, name, "mail"), "wb") as f:
+                f.write(b"mail one\n")
+        # nothing cached, e.g. the first sync with a new remote
+        ns.digests.load(os.path.join(tmpdir, "digests"), tprefix)
+        changes = {"foo": ns.Change([], ["one/mail", "two/mail"])}
+        tmp = json.dumps(["one/mail", "two/mail"]).encode("utf-8")
+        istream = io.BytesIO(struct.pack("!I", len(tmp)) + tmp + b"\x00\x00\x00\x02[]")
+        ostream = io.BytesIO()
+        pending = ns.PendingChanges(tprefix, ns.staging_dir(tprefix, uuid))
+        with patch.dict(ns.features, {"dedup": "refs"}):
+            assert 0 == ns.sync_files(tprefix, {}, istream, ostream, pending, changes=changes)
+        # only the first file is sent, the second one as a reference to it
+        assert b"\x00\x00\x00\x02[]\x00\x00\x00\x08[[1, 0]]\x00\x00\x00\x09mail one\n\x00\x00\x00\x00" == \
+            ostream.getvalue()
 
 
 def test_sync_files_nothing():
     db = lambda: None
+    db.atomic = MagicMock()
     istream = io.BytesIO(b"\x00\x00\x00\x02[]")
     ostream = io.BytesIO()
-    assert (0, 0) == ns.sync_files(db, prefix, {}, istream, ostream)
+    assert (0, 0) == sync_files(db, prefix, {}, istream, ostream)
     out = ostream.getvalue()
     assert b"\x00\x00\x00\x02[]" == out
 
 
 def test_sync_files_recv_add():
-    istream = io.BytesIO(b"\x00\x00\x00\x02[]\x00\x00\x00\x09mail one\n\x00\x00\x00\x09mail two\n")
+    istream = io.BytesIO(b"\x00\x00\x00\x02[]\x00\x00\x00\x09mail one\n\x00\x00\x00\x00\x00\x00\x00\x09mail two\n\x00\x00\x00\x00")
     ostream = io.BytesIO()
 
     # this is only to get filenames that are guaranteed to be unique
@@ -843,16 +1970,24 @@ def test_sync_files_recv_add():
     missing = {"foo": {"files": [f1name, f2name]}}
 
     db = lambda: None
+    db.atomic = MagicMock()
     db.add = MagicMock(return_value=(lambda: None, True))
 
-    with patch("builtins.open", mock_open()) as o:
-        assert (0, 2) == ns.sync_files(db, prefix, missing, istream, ostream)
-        assert call(f1.name, "wb") in o.mock_calls
+    with patch("builtins.open", mock_open()) as o, patch("os.replace") as rep, patch.object(ns, "fsync_paths") as fs:
+        assert (0, 2) == sync_files(db, prefix, missing, istream, ostream)
+        assert call(tmpname(staged(f1.name)), "wb") in o.mock_calls
         assert call().write(b'mail one\n') in o.mock_calls
-        assert call(f2.name, "wb") in o.mock_calls
+        assert call(tmpname(staged(f2.name)), "wb") in o.mock_calls
         assert call().write(b'mail two\n') in o.mock_calls
         hdl = o()
         assert hdl.write.call_count == 2
+        assert rep.mock_calls == [call(tmpname(staged(f1.name)), staged(f1.name)),
+                                  call(tmpname(staged(f2.name)), staged(f2.name)),
+                                  call(staged(f1.name), f1.name),
+                                  call(staged(f2.name), f2.name)]
+        # staged files flushed before moving them, then their directories
+        assert [list(c.args[0]) for c in fs.call_args_list] == [[staged(f1.name), staged(f2.name)],
+                                                               [os.path.dirname(f1.name)]]
 
     assert db.add.mock_calls == [
         call(f1.name),
@@ -863,7 +1998,7 @@ def test_sync_files_recv_add():
 
 
 def test_sync_files_recv_new():
-    istream = io.BytesIO(b"\x00\x00\x00\x02[]\x00\x00\x00\x09mail one\n\x00\x00\x00\x09mail two\n")
+    istream = io.BytesIO(b"\x00\x00\x00\x02[]\x00\x00\x00\x09mail one\n\x00\x00\x00\x00\x00\x00\x00\x09mail two\n\x00\x00\x00\x00")
     ostream = io.BytesIO()
 
     # this is only to get filenames that are guaranteed to be unique
@@ -888,17 +2023,22 @@ def test_sync_files_recv_new():
     type(m).tags = PropertyMock(return_value=mt)
 
     db = lambda: None
+    db.atomic = MagicMock()
     db.add = MagicMock()
     db.add.side_effect = [(m, False), (m, True)]
 
-    with patch("builtins.open", mock_open()) as o:
-        assert (1, 2) == ns.sync_files(db, prefix, missing, istream, ostream)
-        assert call(f1.name, "wb") in o.mock_calls
+    with patch("builtins.open", mock_open()) as o, patch("os.replace") as rep, patch.object(ns, "fsync_paths") as fs:
+        assert (1, 2) == sync_files(db, prefix, missing, istream, ostream)
+        assert call(tmpname(staged(f1.name)), "wb") in o.mock_calls
         assert call().write(b'mail one\n') in o.mock_calls
-        assert call(f2.name, "wb") in o.mock_calls
+        assert call(tmpname(staged(f2.name)), "wb") in o.mock_calls
         assert call().write(b'mail two\n') in o.mock_calls
         hdl = o()
         assert hdl.write.call_count == 2
+        assert rep.mock_calls == [call(tmpname(staged(f1.name)), staged(f1.name)),
+                                  call(tmpname(staged(f2.name)), staged(f2.name)),
+                                  call(staged(f1.name), f1.name),
+                                  call(staged(f2.name), f2.name)]
 
     assert db.add.mock_calls == [
         call(f1.name),
@@ -916,6 +2056,7 @@ def test_sync_files_recv_new():
 
 def test_sync_files_send():
     db = lambda: None
+    db.atomic = MagicMock()
     with NamedTemporaryFile(mode="w+t", prefix="notmuch-sync-test-tmp-") as f1:
         f1.write("mail one\n")
         f1.flush()
@@ -925,9 +2066,9 @@ def test_sync_files_send():
             tmp = json.dumps([f1.name, f2.name]).encode("utf-8")
             istream = io.BytesIO(struct.pack("!I", len(tmp)) + tmp)
             ostream = io.BytesIO()
-            assert (0, 0) == ns.sync_files(db, prefix, {}, istream, ostream)
+            assert (0, 0) == sync_files(db, prefix, {}, istream, ostream)
             out = ostream.getvalue()
-            assert b"\x00\x00\x00\x02[]\x00\x00\x00\x09mail one\n\x00\x00\x00\x09mail two\n" == out
+            assert b"\x00\x00\x00\x02[]\x00\x00\x00\x09mail one\n\x00\x00\x00\x00\x00\x00\x00\x09mail two\n\x00\x00\x00\x00" == out
 
 
 def test_sync_files_send_recv_add():
@@ -941,25 +2082,30 @@ def test_sync_files_send_recv_add():
     missing = {"foo": {"files": [f1name, f2name]}}
 
     db = lambda: None
+    db.atomic = MagicMock()
     db.add = MagicMock(return_value=(lambda: None, True))
 
-    with patch("builtins.open", mock_open(read_data=b"mail three\n")) as o:
+    with patch("builtins.open", mock_open(read_data=b"mail three\n")) as o, patch("os.replace") as rep, patch.object(ns, "fsync_paths") as fs:
         tmp = json.dumps([f1.name]).encode("utf-8")
-        istream = io.BytesIO(struct.pack("!I", len(tmp)) + tmp + b"\x00\x00\x00\x09mail one\n\x00\x00\x00\x09mail two\n")
+        istream = io.BytesIO(struct.pack("!I", len(tmp)) + tmp + b"\x00\x00\x00\x09mail one\n\x00\x00\x00\x00\x00\x00\x00\x09mail two\n\x00\x00\x00\x00")
         ostream = io.BytesIO()
-        assert (0, 2) == ns.sync_files(db, prefix, missing, istream, ostream)
-        assert call(f1.name, "wb") in o.mock_calls
+        assert (0, 2) == sync_files(db, prefix, missing, istream, ostream)
+        assert call(tmpname(staged(f1.name)), "wb") in o.mock_calls
         assert call().write(b'mail one\n') in o.mock_calls
-        assert call(f2.name, "wb") in o.mock_calls
+        assert call(tmpname(staged(f2.name)), "wb") in o.mock_calls
         assert call().write(b'mail two\n') in o.mock_calls
         assert call(f1.name, "rb") in o.mock_calls
         assert call().write(b'mail one\n') in o.mock_calls
         hdl = o()
         assert hdl.write.call_count == 2
-        assert hdl.read.call_count == 1
+        assert hdl.read.call_count == 2
+        assert rep.mock_calls == [call(tmpname(staged(f1.name)), staged(f1.name)),
+                                  call(tmpname(staged(f2.name)), staged(f2.name)),
+                                  call(staged(f1.name), f1.name),
+                                  call(staged(f2.name), f2.name)]
 
         tmp = json.dumps([f1name, f2name])
-        assert struct.pack("!I", len(tmp)) + tmp.encode("utf-8") + b"\x00\x00\x00\x0bmail three\n" == ostream.getvalue()
+        assert struct.pack("!I", len(tmp)) + tmp.encode("utf-8") + b"\x00\x00\x00\x0bmail three\n\x00\x00\x00\x00" == ostream.getvalue()
 
     assert db.add.mock_calls == [
         call(f1.name),
@@ -967,6 +2113,173 @@ def test_sync_files_send_recv_add():
     ]
 
 
+def test_sync_files_streams_local():
+    with TemporaryDirectory() as tmpdir:
+        tprefix = os.path.join(tmpdir, "")
+        for name in ["three", "four"]:
+            with open(os.path.join(tmpdir, name), "wb") as f:
+                f.write(f"mail {name}\n".encode("utf-8"))
+        missing = {"foo": {"tags": [], "files": ["one", "two"]}}
+        db = lambda: None
+        db.atomic = MagicMock()
+        db.add = MagicMock(return_value=(lambda: None, True))
+
+        tmp = json.dumps(["three", "four"]).encode("utf-8")
+        istream = io.BytesIO(struct.pack("!I", len(tmp)) + tmp + b"\x00\x00\x00\x09mail one\n\x00\x00\x00\x00")
+        ostream = io.BytesIO()
+        histream = io.BytesIO(b"\x00\x00\x00\x09mail two\n\x00\x00\x00\x00\x00\x00\x00\x00")
+        hostream = io.BytesIO()
+        with patch.dict(ns.features, {"streams": "multi"}):
+            assert (0, 2) == sync_files(db, tprefix, missing, istream, ostream, [(histream, hostream)])
+
+        for name in ["one", "two"]:
+            with open(os.path.join(tmpdir, name), "rb") as f:
+                assert f"mail {name}\n".encode("utf-8") == f.read()
+        assert db.add.mock_calls == [
+            call(os.path.join(tmpdir, "one")),
+            call(os.path.join(tmpdir, "two"))
+        ]
+        tmp = json.dumps(["one", "two"]).encode("utf-8")
+        assert struct.pack("!I", len(tmp)) + tmp + b"\x00\x00\x00\x012" + \
+            b"\x00\x00\x00\x0bmail three\n\x00\x00\x00\x00\x00\x00\x00\x00" == ostream.getvalue()
+        assert b"\x00\x00\x00\x07[\"two\"]\x00\x00\x00\x08[\"four\"]" + \
+            b"\x00\x00\x00\x0amail four\n\x00\x00\x00\x00" == hostream.getvalue()
+
+
+def test_sync_files_streams_remote():
+    with TemporaryDirectory() as tmpdir:
+        tprefix = os.path.join(tmpdir, "")
+        for name in ["three", "four"]:
+            with open(os.path.join(tmpdir, name), "wb") as f:
+                f.write(f"mail {name}\n".encode("utf-8"))
+        missing = {"foo": {"tags": [], "files": ["one", "two"]}}
+        db = lambda: None
+        db.atomic = MagicMock()
+        db.add = MagicMock(return_value=(lambda: None, True))
+
+        tmp = json.dumps(["three", "four"]).encode("utf-8")
+        istream = io.BytesIO(struct.pack("!I", len(tmp)) + tmp + b"\x00\x00\x00\x012" +
+                             b"\x00\x00\x00\x09mail one\n\x00\x00\x00\x00\x00\x00\x00\x00")
+        ostream = io.BytesIO()
+        recv_file = ns.recv_file
+
+        def _recv_file(*args, **kwargs):
+            recv_file(*args, **kwargs)
+            # file two is received by serve_files() in the meantime
+            with open(ns.staging_dir(tprefix, uuid) + "/two", "wb") as f:
+                f.write(b"mail two\n")
+
+        with patch.dict(ns.features, {"streams": "multi"}), patch.object(ns, "recv_file", _recv_file):
+            assert (0, 2) == sync_files(db, tprefix, missing, istream, ostream)
+
+        with open(os.path.join(tmpdir, "one"), "rb") as f:
+            assert b"mail one\n" == f.read()
+        assert db.add.mock_calls == [
+            call(os.path.join(tmpdir, "one")),
+            call(os.path.join(tmpdir, "two"))
+        ]
+        tmp = json.dumps(["one", "two"]).encode("utf-8")
+        assert struct.pack("!I", len(tmp)) + tmp + b"\x00\x00\x00\x0bmail three\n\x00\x00\x00\x00" == ostream.getvalue()
+
+
+def test_sync_files_resume():
+    with TemporaryDirectory() as tmpdir:
+        tprefix = os.path.join(tmpdir, "")
+        tstaging = ns.staging_dir(tprefix, uuid)
+        # file one was received by an earlier, interrupted sync
+        os.makedirs(os.path.join(tstaging, "cur"))
+        with open(os.path.join(tstaging, "cur", "one"), "wb") as f:
+            f.write(b"mail one\n")
+        missing = {"foo": {"tags": ["foo"], "files": ["cur/one", "cur/two"]}}
+        db = lambda: None
+        db.atomic = MagicMock()
+        db.add = MagicMock(return_value=(lambda: None, True))
+
+        istream = io.BytesIO(b"\x00\x00\x00\x02[]\x00\x00\x00\x09mail two\n\x00\x00\x00\x00")
+        ostream = io.BytesIO()
+        assert (0, 2) == sync_files(db, tprefix, missing, istream, ostream)
+
+        for name in ["one", "two"]:
+            with open(os.path.join(tmpdir, "cur", name), "rb") as f:
+                assert f"mail {name}\n".encode("utf-8") == f.read()
+        assert not os.path.exists(tstaging)
+        assert db.add.mock_calls == [
+            call(os.path.join(tmpdir, "cur", "one")),
+            call(os.path.join(tmpdir, "cur", "two"))
+        ]
+        tmp = json.dumps(["cur/two"]).encode("utf-8")
+        assert struct.pack("!I", len(tmp)) + tmp == ostream.getvalue()
+
+
+def test_serve_files():
+    with TemporaryDirectory() as tmpdir:
+        tprefix = os.path.join(tmpdir, "")
+        with open(os.path.join(tmpdir, "four"), "wb") as f:
+            f.write(b"mail four\n")
+        istream = io.BytesIO(b"\x00\x00\x00\x08[\"four\"]\x00\x00\x00\x07[\"two\"]" +
+                             b"\x00\x00\x00\x09mail two\n\x00\x00\x00\x00")
+        ostream = io.BytesIO()
+        ns.serve_files(tprefix, ns.staging_dir(tprefix, uuid), istream, ostream)
+        assert not os.path.exists(os.path.join(tmpdir, "two"))
+        with open(ns.staging_dir(tprefix, uuid) + "/two", "rb") as f:
+            assert b"mail two\n" == f.read()
+        assert b"\x00\x00\x00\x0amail four\n\x00\x00\x00\x00\x00\x00\x00\x00" == ostream.getvalue()
+
+
+def test_atomic_batches():
+    db = lambda: None
+    db.atomic = MagicMock()
+    with ns.AtomicBatches(db, 2) as batch:
+        for _ in range(5):
+            batch.step()
+    assert db.atomic.call_count == 3
+    assert db.atomic().__enter__.call_count == 3
+    assert db.atomic().__exit__.call_count == 3
+
+
+def test_sync_files_pending():
+    with TemporaryDirectory() as tmpdir:
+        tprefix = os.path.join(tmpdir, "")
+        missing = {"foo": {"tags": ["foo"], "files": ["cur/one"]}}
+        istream = io.BytesIO(b"\x00\x00\x00\x02[]\x00\x00\x00\x09mail one\n\x00\x00\x00\x00")
+        ostream = io.BytesIO()
+        pending = ns.PendingChanges(tprefix, ns.staging_dir(tprefix, uuid))
+        assert 1 == ns.sync_files(tprefix, missing, istream, ostream, pending)
+
+        # received file stays in the staging directory until added
+        assert [".notmuch"] == os.listdir(tmpdir)
+        with open(ns.staging_dir(tprefix, uuid) + "/cur/one", "rb") as f:
+            assert b"mail one\n" == f.read()
+        assert [(os.path.join(tmpdir, "cur", "one"), ["foo"])] == pending.added
+
+        m = MagicMock()
+        db = lambda: None
+        db.atomic = MagicMock()
+        db.add = MagicMock(return_value=(m, False))
+        assert 1 == pending.apply(db)
+        with open(os.path.join(tmpdir, "cur", "one"), "rb") as f:
+            assert b"mail one\n" == f.read()
+        assert not os.path.exists(ns.staging_dir(tprefix, uuid))
+        db.add.assert_called_once_with(os.path.join(tmpdir, "cur", "one"))
+        m.tags.add.assert_called_once_with("foo")
+
+
+def test_sync_files_batches():
+    with TemporaryDirectory() as tmpdir:
+        tprefix = os.path.join(tmpdir, "")
+        missing = {"foo": {"tags": [], "files": ["one", "two", "three"]}}
+        db = lambda: None
+        db.add = MagicMock(return_value=(lambda: None, True))
+        db.atomic = MagicMock()
+        istream = io.BytesIO(b"\x00\x00\x00\x02[]" + b"\x00\x00\x00\x04mail\x00\x00\x00\x00" * 3)
+        ostream = io.BytesIO()
+        assert (0, 3) == sync_files(db, tprefix, missing, istream, ostream, batch_size=2)
+        assert db.add.call_count == 3
+        assert db.atomic.call_count == 2
+        assert db.atomic().__exit__.call_count == 2
+
+
+@patch.dict(ns.features, {"deletes": "list"})
 def test_sync_deletes_local():
     m1 = lambda: None
     m1.messageid = "foo"
@@ -1000,6 +2313,7 @@ def test_sync_deletes_local():
     m2.filenames.assert_called_once()
 
 
+@patch.dict(ns.features, {"deletes": "list"})
 def test_sync_deletes_local_no_deleted():
     m1 = lambda: None
     m1.messageid = "foo"
@@ -1045,6 +2359,7 @@ def test_sync_deletes_local_no_deleted():
     mt.discard.assert_called_once_with("foo")
 
 
+@patch.dict(ns.features, {"deletes": "list"})
 def test_sync_deletes_local_no_deleted_no_check():
     m1 = lambda: None
     m1.messageid = "foo"
@@ -1079,6 +2394,7 @@ def test_sync_deletes_local_no_deleted_no_check():
     m2.filenames.assert_called_once()
 
 
+@patch.dict(ns.features, {"deletes": "list"})
 def test_sync_deletes_local_ghost():
     m1 = lambda: None
     m1.messageid = "foo"
@@ -1112,6 +2428,7 @@ def test_sync_deletes_local_ghost():
     assert m2.filenames.call_count == 0
 
 
+@patch.dict(ns.features, {"deletes": "list"})
 def test_sync_deletes_local_none():
     m1 = lambda: None
     m1.messageid = "foo"
@@ -1140,6 +2457,7 @@ def test_sync_deletes_local_none():
     assert db.remove.call_count == 0
 
 
+@patch.dict(ns.features, {"deletes": "list"})
 def test_sync_deletes_remote():
     m1 = lambda: None
     m1.messageid = "foo"
@@ -1176,6 +2494,7 @@ def test_sync_deletes_remote():
     m2.filenames.assert_called_once()
 
 
+@patch.dict(ns.features, {"deletes": "list"})
 def test_sync_deletes_remote_no_deleted():
     m1 = lambda: None
     m1.messageid = "foo"
@@ -1223,6 +2542,7 @@ def test_sync_deletes_remote_no_deleted():
     mt.discard.assert_called_once_with("foo")
 
 
+@patch.dict(ns.features, {"deletes": "list"})
 def test_sync_deletes_remote_no_deleted_no_check():
     m1 = lambda: None
     m1.messageid = "foo"
@@ -1259,6 +2579,7 @@ def test_sync_deletes_remote_no_deleted_no_check():
     m2.filenames.assert_called_once()
 
 
+@patch.dict(ns.features, {"deletes": "list"})
 def test_sync_deletes_remote_ghost():
     m1 = lambda: None
     m1.messageid = "foo"
@@ -1294,6 +2615,7 @@ def test_sync_deletes_remote_ghost():
     assert m2.filenames.call_count == 0
 
 
+@patch.dict(ns.features, {"deletes": "list"})
 def test_sync_deletes_remote_none():
     m1 = lambda: None
     m1.messageid = "foo"
@@ -1325,40 +2647,423 @@ def test_sync_deletes_remote_none():
 
 
 def test_get_ids():
-    p1 = lambda: None
-    p1.docid = 1
-    p2 = lambda: None
-    p2.docid = 2
-    p3 = lambda: None
-    p3.docid = 3
+    def item(docid, value=b""):
+        i = lambda: None
+        i.docid = docid
+        i.value = value
+        return i
     db = lambda: None
-    db.postlist = MagicMock(return_value=[p1, p2, p3])
-    db.get_lastdocid = MagicMock(return_value=6)
+    db.postlist = MagicMock(return_value=[item(1), item(3), item(4), item(9)])
+    db.valuestream = MagicMock(return_value=[item(1, b"x"), item(2, b"a"),
+                                             item(3, b"y"), item(5, b"b"),
+                                             item(6), item(7, b"c")])
     db.close = MagicMock()
-    doc = lambda: None
-    doc.get_value = MagicMock()
-    doc.get_value.side_effect = [b"a", b"b", b"c"]
-    db.get_document = MagicMock(return_value=doc)
 
     with patch("xapian.Database", return_value=db) as xdb:
-        assert ["a", "b", "c"] == ns.get_ids(prefix)
+        ids = ns.get_ids(prefix)
+        xdb.assert_not_called()
+        assert ["a", "b", "c"] == list(ids)
         xdb.assert_called_once_with(prefix + ".notmuch/xapian")
         db.postlist.assert_called_once_with("Tghost")
-        db.get_lastdocid.assert_called_once()
-        assert db.get_document.mock_calls == [call(4), call(5), call(6)]
-        assert doc.get_value.mock_calls == [call(1), call(1), call(1)]
+        db.valuestream.assert_called_once_with(1)
         db.close.assert_called_once()
 
 
-def test_sync_mbsync_local_nothing():
-    def effect(*args, **kwargs):
-        yield []
-        yield []
+def test_get_ids_close():
+    db = lambda: None
+    db.postlist = MagicMock(return_value=[])
+    db.valuestream = MagicMock(side_effect=RuntimeError("foo"))
+    db.close = MagicMock()
+
+    with patch("xapian.Database", return_value=db):
+        with pytest.raises(RuntimeError):
+            list(ns.get_ids(prefix))
+        db.close.assert_called_once()
+
+
+
+def test_get_ids_layout():
+    db = lambda: None
+    db.postlist = MagicMock(return_value=[])
+    db.valuestream = MagicMock(return_value=[lambda: None])
+    db.close = MagicMock()
+
+    with patch("xapian.Database", return_value=db):
+        with pytest.raises(RuntimeError, match="database layout not as expected"):
+            list(ns.get_ids(prefix))
+        db.close.assert_called_once()
+
+def test_id_summary():
+    summary = ns.IdSummary()
+    for mid in ["foo", "bar", "baz"]:
+        summary.add(mid)
+    summary.add("foo")
+    assert {"foo", "bar", "baz"} == set(summary)
+    assert [(ns.id_hash("foo") ^ ns.id_hash("bar") ^ ns.id_hash("baz"), 3)] == summary.summary(0)
+    assert 3 == sum(c for _, c in summary.summary(4))
+    assert 16 == len(summary.summary(4))
+    summary.remove("baz")
+    summary.remove("baz")
+    assert [(ns.id_hash("foo") ^ ns.id_hash("bar"), 2)] == summary.summary(0)
+    assert {ns.id_hash("foo"): "foo"} == summary.bucket_hashes(ns.ID_BUCKET_BITS, [ns.id_hash("foo") >> (64 - ns.ID_BUCKET_BITS)])
+    assert {ns.id_hash("foo"): "foo", ns.id_hash("bar"): "bar"} == summary.bucket_hashes(0, [0])
+    assert {} == summary.bucket_hashes(0, [])
+
+
+def test_id_summary_encoding():
+    summary = ns.IdSummary()
+    for mid in ["foo", "bar", "baz"]:
+        summary.add(mid)
+    data = ns.encode_summary(summary.summary(3))
+    assert 1 + 8 * (8 + 4) == len(data)
+    assert summary.summary(3) == ns.decode_summary(data)
+
+
+def test_summary_bits():
+    assert 0 == ns.summary_bits(0)
+    assert 0 == ns.summary_bits(ns.ID_BUCKET_SIZE - 1)
+    assert 0 == ns.summary_bits(ns.ID_BUCKET_SIZE)
+    assert 1 == ns.summary_bits(ns.ID_BUCKET_SIZE * 2)
+    assert 12 == ns.summary_bits(ns.ID_BUCKET_SIZE * 4096)
+    assert ns.ID_BUCKET_BITS == ns.summary_bits(1 << 40)
+
+
+def test_id_summary_save_load():
+    with TemporaryDirectory() as tmpdir:
+        fname = os.path.join(tmpdir, "ids")
+        summary = ns.IdSummary()
+        summary.load(fname)
+        summary.add("foo")
+        summary.add("bar")
+        summary.uuid = "uuid"
+        summary.rev = 3
+        summary.save()
+
+        loaded = ns.IdSummary()
+        loaded.load(fname)
+        assert {"foo", "bar"} == set(loaded)
+        assert "uuid" == loaded.uuid
+        assert 3 == loaded.rev
+        assert summary.summary(4) == loaded.summary(4)
+
+        with open(fname, "w", encoding="utf-8") as f:
+            f.write("{")
+        loaded.load(fname)
+        assert set() == set(loaded)
+        assert -1 == loaded.rev
+
+
+def test_id_summary_save_changes():
+    with TemporaryDirectory() as tmpdir:
+        fname = os.path.join(tmpdir, "ids")
+        mids = [f"mid{idx}" for idx in range(50)]
+        summary = ns.IdSummary()
+        summary.load(fname)
+        for mid in mids:
+            summary.add(mid)
+        summary.save()
+
+        loaded = ns.IdSummary()
+        loaded.load(fname)
+        loaded.remove("mid3")
+        loaded.add("new")
+        # only the buckets of the changed IDs are written
+        assert {ns.id_hash(mid) >> (64 - ns.ID_BUCKET_BITS) for mid in ["mid3", "new"]} == loaded.changed
+        loaded.save()
+
+        expected = ns.IdSummary()
+        for mid in mids[:3] + mids[4:] + ["new"]:
+            expected.add(mid)
+        loaded = ns.IdSummary()
+        loaded.load(fname)
+        assert 50 == len(loaded)
+        assert "mid3" not in loaded and "new" in loaded
+        assert expected.summary(ns.ID_BUCKET_BITS) == loaded.summary(ns.ID_BUCKET_BITS)
+        # hashes with the highest bit set survive being stored
+        assert {ns.id_hash(mid): mid for mid in set(expected)} == loaded.bucket_hashes(1, [0, 1])
+
+
+def id_summary_db(messages, count):
+    rev = lambda: None
+    rev.rev = 5
+    rev.uuid = b"uuid"
+    msgs = []
+    for mid in messages:
+        msg = lambda: None
+        msg.messageid = mid
+        msgs.append(msg)
+    db = lambda: None
+    db.revision = MagicMock(return_value=rev)
+    db.messages = MagicMock(return_value=msgs)
+    db.count_messages = MagicMock(return_value=count)
+    mock_ctx = MagicMock()
+    mock_ctx.__enter__.return_value = db
+    mock_ctx.__exit__.return_value = False
+    return db, mock_ctx
+
 
+def test_id_summary_update_incremental():
+    summary = ns.IdSummary()
+    summary.uuid = "uuid"
+    summary.rev = 3
+    summary.add("foo")
+    summary.add("bar")
+    db, mock_ctx = id_summary_db(["bar", "baz"], 3)
+    with patch("notmuch2.Database", return_value=mock_ctx):
+        with patch.object(ns, "get_ids") as gi:
+            summary.update(prefix)
+            gi.assert_not_called()
+    db.messages.assert_called_once_with("lastmod:4..")
+    assert {"foo", "bar", "baz"} == set(summary)
+    assert 5 == summary.rev
+
+
+def test_id_summary_update_unchanged():
+    summary = ns.IdSummary()
+    summary.uuid = "uuid"
+    summary.rev = 5
+    summary.add("foo")
+    summary.dirty = False
+    db, mock_ctx = id_summary_db(["foo"], 1)
+    with patch("notmuch2.Database", return_value=mock_ctx):
+        summary.update(prefix)
+    # nothing to save
+    assert not summary.dirty
+
+
+def test_id_summary_update_deleted():
+    summary = ns.IdSummary()
+    summary.uuid = "uuid"
+    summary.rev = 3
+    summary.add("foo")
+    summary.add("bar")
+    db, mock_ctx = id_summary_db(["baz"], 2)
+    with patch("notmuch2.Database", return_value=mock_ctx):
+        with patch.object(ns, "get_ids", return_value=["foo", "baz"]) as gi:
+            summary.update(prefix)
+            gi.assert_called_once_with(prefix)
+    assert {"foo", "baz"} == set(summary)
+    assert [(ns.id_hash("foo") ^ ns.id_hash("baz"), 2)] == summary.summary(0)
+    assert 5 == summary.rev
+
+
+def test_id_summary_update_other_db():
+    summary = ns.IdSummary()
+    summary.uuid = "other"
+    summary.rev = 3
+    summary.add("foo")
+    db, mock_ctx = id_summary_db([], 1)
+    with patch("notmuch2.Database", return_value=mock_ctx):
+        with patch.object(ns, "get_ids", return_value=["bar"]) as gi:
+            summary.update(prefix)
+            gi.assert_called_once_with(prefix)
+    db.messages.assert_not_called()
+    assert {"bar"} == set(summary)
+    assert "uuid" == summary.uuid
+
+
+def test_split_select_buckets():
+    hashes = [0x1234 << 48, 0x1334 << 48, 0x1335 << 48, 0x2000 << 48]
+    split = ns.split_buckets(hashes, 4, [1, 3])
+    assert 2 << ns.SPLIT_BITS == len(split)
+    assert (0x1234 << 48, 1) == split[2]
+    assert ((0x1334 << 48) ^ (0x1335 << 48), 2) == split[3]
+    assert 3 == sum(c for _, c in split)
+    assert [0x1334 << 48, 0x1335 << 48] == ns.select_buckets(hashes, 8, [0x13])
+    assert [] == ns.select_buckets(hashes, 8, [])
+
+
+def reconcile(mine, theirs):
+    bits = ns.summary_bits(len(theirs))
+    summary = ns.encode_summary(theirs.summary(bits))
+    to_remote = os.pipe()
+    from_remote = os.pipe()
+    ret = {}
+    with open(to_remote[0], "rb") as rin, open(to_remote[1], "wb") as lout, \
+            open(from_remote[0], "rb") as lin, open(from_remote[1], "wb") as rout:
+        def _local():
+            ret["local"] = ns.reconcile_local(mine, ns.decode_summary(summary), lin, lout)
+
+        def _remote():
+            ret["remote"] = ns.reconcile_remote(theirs, rin, rout)
+
+        ns.run_async(_local, _remote)
+    return ret
+
+
+def test_reconcile():
+    mine = ns.IdSummary()
+    theirs = ns.IdSummary()
+    for i in range(20000):
+        mine.add(f"mid{i}")
+        theirs.add(f"mid{i}")
+    for mid in ["foo", "bar", "baz"]:
+        mine.add(mid)
+    for mid in ["qux", "quux"]:
+        theirs.add(mid)
+
+    before = dict(ns.transfer)
+    ret = reconcile(mine, theirs)
+    mine_only, theirs_only = ret["local"]
+    assert {"foo", "bar", "baz"} == set(mine_only)
+    assert sorted([ns.id_hash("qux"), ns.id_hash("quux")]) == theirs_only
+    assert {"qux", "quux"} <= set(ret["remote"].values())
+    # much less than the IDs themselves
+    assert ns.transfer["read"] - before["read"] < 4000
+    assert ns.transfer["write"] - before["write"] < 4000
+
+
+def test_reconcile_same():
+    mine = ns.IdSummary()
+    theirs = ns.IdSummary()
+    for i in range(1000):
+        mine.add(f"mid{i}")
+        theirs.add(f"mid{i}")
+    ret = reconcile(mine, theirs)
+    assert ([], []) == ret["local"]
+    assert {} == ret["remote"]
+
+
+def test_reconcile_empty():
+    mine = ns.IdSummary()
+    theirs = ns.IdSummary()
+    for i in range(100):
+        theirs.add(f"mid{i}")
+    ret = reconcile(mine, theirs)
+    assert ([], sorted(ns.id_hash(f"mid{i}") for i in range(100))) == ret["local"]
+    ret = reconcile(theirs, mine)
+    assert ({f"mid{i}" for i in range(100)}, []) == (set(ret["local"][0]), ret["local"][1])
+
+
+@patch.dict(ns.features, {"deletes": "bisect"})
+def test_sync_deletes_local_bisect():
+    mine = ns.IdSummary()
+    for i in range(10):
+        mine.add(f"mid{i}")
+    mine.add("foo")
+
+    m = lambda: None
+    m.filenames = MagicMock(return_value=["foofile"])
+    m.tags = ["deleted"]
+    m.ghost = False
+    db = lambda: None
+    db.remove = MagicMock()
+    db.find = MagicMock(return_value=m)
+    mock_ctx = MagicMock()
+    mock_ctx.__enter__.return_value = db
+    mock_ctx.__exit__.return_value = False
+
+    theirs = ns.IdSummary()
+    for i in range(10):
+        theirs.add(f"mid{i}")
+    theirs.add("bar")
+    summary = ns.encode_summary(theirs.summary(0))
+    hashes = ns.select_buckets(theirs.bucket_hashes(0, [0]), 0, [0])
+    istream = io.BytesIO(struct.pack("!I", len(summary)) + summary +
+                         struct.pack("!I", 8 * len(hashes)) + struct.pack(f"!{len(hashes)}Q", *hashes))
+    ostream = io.BytesIO()
+    with patch.object(ns, "id_summary", mine), patch.object(mine, "load"), patch.object(mine, "update"), \
+            patch.object(mine, "save") as save:
+        with patch("notmuch2.Database", return_value=mock_ctx):
+            with patch("pathlib.Path.unlink") as pu:
+                with patch.object(ns, "get_ids") as gi:
+                    assert 1 == ns.sync_deletes_local(prefix, istream, ostream)
+                    gi.assert_not_called()
+                    pu.assert_called_once()
+        save.assert_called_once()
+
+    db.find.assert_called_once_with("foo")
+    db.remove.assert_called_once_with("foofile")
+    assert "foo" not in mine
+    out = io.BytesIO(ostream.getvalue())
+    assert {"bits": 0, "split": [], "hashes": [0]} == json.loads(ns.read(out).decode("utf-8"))
+    assert [ns.id_hash("bar")] == json.loads(ns.read(out).decode("utf-8"))
+
+
+@patch.dict(ns.features, {"deletes": "bisect"})
+def test_sync_deletes_remote_bisect():
+    mine = ns.IdSummary()
+    for i in range(10):
+        mine.add(f"mid{i}")
+    mine.add("bar")
+    summary = mine.summary(0)
+    hashes = ns.select_buckets(mine.bucket_hashes(0, [0]), 0, [0])
+
+    m = lambda: None
+    m.filenames = MagicMock(return_value=["barfile"])
+    m.tags = ["deleted"]
+    m.ghost = False
+    db = lambda: None
+    db.remove = MagicMock()
+    db.find = MagicMock(return_value=m)
+    mock_ctx = MagicMock()
+    mock_ctx.__enter__.return_value = db
+    mock_ctx.__exit__.return_value = False
+
+    req = json.dumps({"bits": 0, "split": [], "hashes": [0]}).encode("utf-8")
+    dels = json.dumps([ns.id_hash("bar"), 123]).encode("utf-8")
+    istream = io.BytesIO(struct.pack("!I", len(req)) + req + struct.pack("!I", len(dels)) + dels)
+    ostream = io.BytesIO()
+    with patch.object(ns, "id_summary", mine), patch.object(mine, "load"), patch.object(mine, "update"), \
+            patch.object(mine, "save"):
+        with patch("notmuch2.Database", return_value=mock_ctx):
+            with patch("pathlib.Path.unlink") as pu:
+                assert 1 == ns.sync_deletes_remote(prefix, istream, ostream)
+                pu.assert_called_once()
+
+    db.find.assert_called_once_with("bar")
+    db.remove.assert_called_once_with("barfile")
+    assert "bar" not in mine
+    out = io.BytesIO(ostream.getvalue())
+    assert summary == ns.decode_summary(ns.read(out))
+    data = ns.read(out)
+    assert hashes == list(struct.unpack(f"!{len(data) // 8}Q", data))
+
+
+def test_mbsync_index():
+    with TemporaryDirectory() as _tmpdir:
+        tmpdir = _tmpdir + os.sep
+        for d in [".notmuch", "INBOX/cur", "INBOX/new", "INBOX/tmp", "Lists/foo/cur"]:
+            os.makedirs(os.path.join(tmpdir, d))
+        for f in ["INBOX/.mbsyncstate", "INBOX/.uidvalidity", "Lists/foo/.mbsyncstate",
+                  "INBOX/cur/.mbsyncstate", ".notmuch/.uidvalidity"]:
+            with open(os.path.join(tmpdir, f), "w") as fh:
+                fh.write("state")
+            os.utime(os.path.join(tmpdir, f), (1.0, 1.0))
+        # not recently changed
+        for d in ["", "INBOX", "Lists", "Lists/foo"]:
+            os.utime(os.path.join(tmpdir, d), (1.0, 1.0))
+
+        exp = {"INBOX/.mbsyncstate": 1.0, "INBOX/.uidvalidity": 1.0, "Lists/foo/.mbsyncstate": 1.0}
+        with patch("os.scandir", wraps=os.scandir) as sd:
+            assert exp == ns.find_mbsync_files(tmpdir)
+            # maildir directories and .notmuch not listed
+            assert sd.call_count == 4
+        with patch("os.scandir", wraps=os.scandir) as sd:
+            assert exp == ns.find_mbsync_files(tmpdir)
+            assert sd.call_count == 0
+
+        # only changed directories listed again
+        os.makedirs(os.path.join(tmpdir, "Lists/bar"))
+        with open(os.path.join(tmpdir, "Lists/bar/.uidvalidity"), "w") as fh:
+            fh.write("state")
+        os.utime(os.path.join(tmpdir, "Lists/bar/.uidvalidity"), (2.0, 2.0))
+        exp["Lists/bar/.uidvalidity"] = 2.0
+        with patch("os.scandir", wraps=os.scandir) as sd:
+            assert exp == ns.find_mbsync_files(tmpdir)
+            assert sd.mock_calls == [call(os.path.join(tmpdir, "Lists")), call(os.path.join(tmpdir, "Lists/bar"))]
+
+        shutil.rmtree(os.path.join(tmpdir, "INBOX"))
+        del exp["INBOX/.mbsyncstate"]
+        del exp["INBOX/.uidvalidity"]
+        assert exp == ns.find_mbsync_files(tmpdir)
+        assert "INBOX" not in ns.mbsync_index.dirs
+
+
+def test_sync_mbsync_local_nothing():
     with TemporaryDirectory() as _tmpdir:
         tmpdir = _tmpdir + os.sep
-        with patch("pathlib.Path.rglob") as pr:
-            pr.side_effect = effect()
+        with patch.object(ns, "find_mbsync_files", return_value={}):
             istream = io.BytesIO(b"\x00\x00\x00\x02{}")
             ostream = io.BytesIO()
             ns.sync_mbsync_local(tmpdir, istream, ostream)
@@ -1371,65 +3076,52 @@ def test_sync_mbsync_local():
     with TemporaryDirectory() as _tmpdir:
         tmpdir = _tmpdir + os.sep
         m1 = MagicMock()
-        m1.__str__ = MagicMock(return_value=(tmpdir + ".uidvalidity"))
         s1 = lambda: None
         s1.st_mtime = 1.0
         m1.stat = MagicMock(return_value=s1)
         m2 = MagicMock()
-        m2.__str__ = MagicMock(return_value=(tmpdir + ".mbsyncstate"))
         s2 = lambda: None
         s2.st_mtime = 0.0
         m2.stat = MagicMock(return_value=s2)
 
-        def effect_glob(*args, **kwargs):
-            yield [m1]
-            yield [m2]
         def effect_stat(*args, **kwargs):
             yield m1
             yield m2
 
-        with patch("pathlib.Path.rglob") as pr:
-            pr.side_effect = effect_glob()
-            istream = io.BytesIO(b"\x00\x00\x00\x27{\".uidvalidity\":0.0,\".mbsyncstate\":1.0}\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01b")
+        with patch.object(ns, "find_mbsync_files", return_value={".uidvalidity": 1.0, ".mbsyncstate": 0.0}):
+            istream = io.BytesIO(b"\x00\x00\x00\x27{\".uidvalidity\":0.0,\".mbsyncstate\":1.0}\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01b\x00\x00\x00\x00")
             ostream = io.BytesIO()
             with patch("pathlib.Path.stat") as ps:
                 ps.side_effect = effect_stat()
                 with patch("pathlib.Path.mkdir") as pm:
-                    with patch("os.utime") as ut:
+                    with patch("os.utime") as ut, patch("os.replace") as rep:
                         with patch("builtins.open", mock_open(read_data=b"a")) as o:
                             ns.sync_mbsync_local(tmpdir, istream, ostream)
                             assert call(tmpdir + ".uidvalidity", "rb") in o.mock_calls
-                            assert call(tmpdir + ".mbsyncstate", "wb") in o.mock_calls
+                            assert call(tmpname(tmpdir + ".mbsyncstate"), "wb") in o.mock_calls
                             hdl = o()
-                            hdl.read.assert_called_once()
+                            assert hdl.read.call_count == 2
                             hdl.write.assert_called_once()
                             args = hdl.write.call_args.args
                             assert b"b" == args[0]
                             assert ut.mock_calls == [call(tmpdir + ".mbsyncstate", (0.0, 0.0))]
 
-            assert b"\x00\x00\x00\x10[\".mbsyncstate\"]\x00\x00\x00\x10[\".uidvalidity\"]\x3F\xF0\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01a" == ostream.getvalue()
+            assert b"\x00\x00\x00\x10[\".mbsyncstate\"]\x00\x00\x00\x10[\".uidvalidity\"]\x3F\xF0\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01a\x00\x00\x00\x00" == ostream.getvalue()
 
 
 def test_sync_mbsync_local_no_changes():
     with TemporaryDirectory() as _tmpdir:
         tmpdir = _tmpdir + os.sep
         m1 = MagicMock()
-        m1.__str__ = MagicMock(return_value=(tmpdir + ".uidvalidity"))
         s1 = lambda: None
         s1.st_mtime = 1
         m1.stat = MagicMock(return_value=s1)
         m2 = MagicMock()
-        m2.__str__ = MagicMock(return_value=(tmpdir + ".mbsyncstate"))
         s2 = lambda: None
         s2.st_mtime = 1
         m2.stat = MagicMock(return_value=s2)
 
-        def effect(*args, **kwargs):
-            yield [m1]
-            yield [m2]
-
-        with patch("pathlib.Path.rglob") as pr:
-            pr.side_effect = effect()
+        with patch.object(ns, "find_mbsync_files", return_value={".uidvalidity": 1, ".mbsyncstate": 1}):
             istream = io.BytesIO(b"\x00\x00\x00\x23{\".uidvalidity\":1,\".mbsyncstate\":1}")
             ostream = io.BytesIO()
             with patch("builtins.open", mock_open(read_data=b"a")) as o:
@@ -1444,49 +3136,39 @@ def test_sync_mbsync_local_missing():
     with TemporaryDirectory() as _tmpdir:
         tmpdir = _tmpdir + os.sep
         m1 = MagicMock()
-        m1.__str__ = MagicMock(return_value=(tmpdir + ".uidvalidity"))
         s1 = lambda: None
         s1.st_mtime = 1.0
         m1.stat = MagicMock(return_value=s1)
 
-        def effect_glob(*args, **kwargs):
-            yield [m1]
-            yield []
         def effect_stat(*args, **kwargs):
             while True:
                 yield m1
 
-        with patch("pathlib.Path.rglob") as pr:
-            pr.side_effect = effect_glob()
-            istream = io.BytesIO(b"\x00\x00\x00\x14{\".mbsyncstate\":1.0}\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01b")
+        with patch.object(ns, "find_mbsync_files", return_value={".uidvalidity": 1.0}):
+            istream = io.BytesIO(b"\x00\x00\x00\x14{\".mbsyncstate\":1.0}\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01b\x00\x00\x00\x00")
             ostream = io.BytesIO()
             with patch("pathlib.Path.stat") as ps:
                 ps.side_effect = effect_stat()
                 with patch("pathlib.Path.mkdir") as pm:
-                    with patch("os.utime") as ut:
+                    with patch("os.utime") as ut, patch("os.replace") as rep:
                         with patch("builtins.open", mock_open(read_data=b"a")) as o:
                             ns.sync_mbsync_local(tmpdir, istream, ostream)
                             assert call(tmpdir + ".uidvalidity", "rb") in o.mock_calls
-                            assert call(tmpdir + ".mbsyncstate", "wb") in o.mock_calls
+                            assert call(tmpname(tmpdir + ".mbsyncstate"), "wb") in o.mock_calls
                             hdl = o()
-                            hdl.read.assert_called_once()
+                            assert hdl.read.call_count == 2
                             hdl.write.assert_called_once()
                             args = hdl.write.call_args.args
                             assert b"b" == args[0]
                             assert ut.mock_calls == [call(tmpdir + ".mbsyncstate", (0.0, 0.0))]
 
-            assert b"\x00\x00\x00\x10[\".mbsyncstate\"]\x00\x00\x00\x10[\".uidvalidity\"]\x3F\xF0\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01a" == ostream.getvalue()
+            assert b"\x00\x00\x00\x10[\".mbsyncstate\"]\x00\x00\x00\x10[\".uidvalidity\"]\x3F\xF0\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01a\x00\x00\x00\x00" == ostream.getvalue()
 
 
 def test_sync_mbsync_remote_nothing():
-    def effect(*args, **kwargs):
-        yield []
-        yield []
-
     with TemporaryDirectory() as _tmpdir:
         tmpdir = _tmpdir + os.sep
-        with patch("pathlib.Path.rglob") as pr:
-            pr.side_effect = effect()
+        with patch.object(ns, "find_mbsync_files", return_value={}):
             istream = io.BytesIO(b"\x00\x00\x00\x02[]\x00\x00\x00\x02[]")
             ostream = io.BytesIO()
             ns.sync_mbsync_remote(tmpdir, istream, ostream)
@@ -1499,68 +3181,58 @@ def test_sync_mbsync_remote():
     with TemporaryDirectory() as _tmpdir:
         tmpdir = _tmpdir + os.sep
         m1 = MagicMock()
-        m1.__str__ = MagicMock(return_value=(tmpdir + ".uidvalidity"))
         s1 = lambda: None
         s1.st_mtime = 0.0
         m1.stat = MagicMock(return_value=s1)
         m2 = MagicMock()
-        m2.__str__ = MagicMock(return_value=(tmpdir + ".mbsyncstate"))
         s2 = lambda: None
         s2.st_mtime = 1.0
         m2.stat = MagicMock(return_value=s2)
 
-        def effect_glob(*args, **kwargs):
-            yield [m1]
-            yield [m2]
         def effect_stat(*args, **kwargs):
             yield m1
             yield m2
             yield m1
             yield m2
 
-        with patch("pathlib.Path.rglob") as pr:
-            pr.side_effect = effect_glob()
-            istream = io.BytesIO(b"\x00\x00\x00\x10[\".mbsyncstate\"]\x00\x00\x00\x10[\".uidvalidity\"]\x3F\xF0\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01a")
+        with patch.object(ns, "find_mbsync_files", return_value={".uidvalidity": 0.0, ".mbsyncstate": 1.0}):
+            istream = io.BytesIO(b"\x00\x00\x00\x10[\".mbsyncstate\"]\x00\x00\x00\x10[\".uidvalidity\"]\x3F\xF0\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01a\x00\x00\x00\x00")
             ostream = io.BytesIO()
             with patch("pathlib.Path.stat") as ps:
                 ps.side_effect = effect_stat()
                 with patch("pathlib.Path.mkdir") as pm:
-                    with patch("os.utime") as ut:
-                        with patch("builtins.open", mock_open(read_data=b"b")) as o:
+                    with patch("os.utime") as ut, patch("os.replace") as rep:
+                        # sending and receiving share the mocked file, so
+                        # they must not run at the same time
+                        with patch("builtins.open", mock_open(read_data=b"b")) as o, \
+                                patch.object(ns, "run_async", lambda m1, m2: (m1(), m2())):
                             ns.sync_mbsync_remote(tmpdir, istream, ostream)
-                            assert call(tmpdir + ".uidvalidity", "wb") in o.mock_calls
+                            assert call(tmpname(tmpdir + ".uidvalidity"), "wb") in o.mock_calls
                             assert call(tmpdir + ".mbsyncstate", "rb") in o.mock_calls
                             hdl = o()
-                            hdl.read.assert_called_once()
+                            assert hdl.read.call_count == 2
                             hdl.write.assert_called_once()
                             args = hdl.write.call_args.args
                             assert b"a" == args[0]
                             assert ut.mock_calls == [call(tmpdir + ".uidvalidity", (1.0, 1.0))]
 
                 out = ostream.getvalue()
-                assert b"\x00\x00\x00\x2A{\".uidvalidity\": 0.0, \".mbsyncstate\": 1.0}\x3F\xF0\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01b" == out
+                assert b"\x00\x00\x00\x2A{\".uidvalidity\": 0.0, \".mbsyncstate\": 1.0}\x3F\xF0\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01b\x00\x00\x00\x00" == out
 
 
 def test_sync_mbsync_remote_no_changes():
     with TemporaryDirectory() as _tmpdir:
         tmpdir = _tmpdir + os.sep
         m1 = MagicMock()
-        m1.__str__ = MagicMock(return_value=(tmpdir + ".uidvalidity"))
         s1 = lambda: None
         s1.st_mtime = 1
         m1.stat = MagicMock(return_value=s1)
         m2 = MagicMock()
-        m2.__str__ = MagicMock(return_value=(tmpdir + ".mbsyncstate"))
         s2 = lambda: None
         s2.st_mtime = 1
         m2.stat = MagicMock(return_value=s2)
 
-        def effect(*args, **kwargs):
-            yield [m1]
-            yield [m2]
-
-        with patch("pathlib.Path.rglob") as pr:
-            pr.side_effect = effect()
+        with patch.object(ns, "find_mbsync_files", return_value={".uidvalidity": 1, ".mbsyncstate": 1}):
             istream = io.BytesIO(b"\x00\x00\x00\x02[]\x00\x00\x00\x02[]")
             ostream = io.BytesIO()
             with patch("builtins.open", mock_open(read_data=b"a")) as o:
@@ -1575,39 +3247,77 @@ def test_sync_mbsync_remote_missing():
     with TemporaryDirectory() as _tmpdir:
         tmpdir = _tmpdir + os.sep
         m1 = MagicMock()
-        m1.__str__ = MagicMock(return_value=(tmpdir + ".uidvalidity"))
         s1 = lambda: None
         s1.st_mtime = 1.0
         m1.stat = MagicMock(return_value=s1)
 
-        def effect_glob(*args, **kwargs):
-            yield [m1]
-            yield []
         def effect_stat(*args, **kwargs):
             while True:
                 yield m1
 
-        with patch("pathlib.Path.rglob") as pr:
-            pr.side_effect = effect_glob()
-            istream = io.BytesIO(b"\x00\x00\x00\x10[\".mbsyncstate\"]\x00\x00\x00\x10[\".uidvalidity\"]\x3F\xF0\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01b")
+        with patch.object(ns, "find_mbsync_files", return_value={".uidvalidity": 1.0}):
+            istream = io.BytesIO(b"\x00\x00\x00\x10[\".mbsyncstate\"]\x00\x00\x00\x10[\".uidvalidity\"]\x3F\xF0\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01b\x00\x00\x00\x00")
             ostream = io.BytesIO()
             with patch("pathlib.Path.stat") as ps:
                 ps.side_effect = effect_stat()
                 with patch("pathlib.Path.mkdir") as pm:
-                    with patch("os.utime") as ut:
+                    with patch("os.utime") as ut, patch("os.replace") as rep:
                         with patch("builtins.open", mock_open(read_data=b"a")) as o:
                             ns.sync_mbsync_remote(tmpdir, istream, ostream)
-                            assert call(tmpdir + ".uidvalidity", "wb") in o.mock_calls
+                            assert call(tmpname(tmpdir + ".uidvalidity"), "wb") in o.mock_calls
                             assert call(tmpdir + ".mbsyncstate", "rb") in o.mock_calls
                             hdl = o()
-                            hdl.read.assert_called_once()
+                            assert hdl.read.call_count == 2
                             hdl.write.assert_called_once()
                             args = hdl.write.call_args.args
                             assert b"b" == args[0]
                             assert ut.mock_calls == [call(tmpdir + ".uidvalidity", (1.0, 1.0))]
 
             out = ostream.getvalue()
-            assert b"\x00\x00\x00\x15{\".uidvalidity\": 1.0}\x3F\xF0\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01a" == out
+            assert b"\x00\x00\x00\x15{\".uidvalidity\": 1.0}\x3F\xF0\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01a\x00\x00\x00\x00" == out
+
+
+def test_sync_mbsync_delta():
+    with TemporaryDirectory() as local, TemporaryDirectory() as remote:
+        local += os.sep
+        remote += os.sep
+        lines = [f"{i} {i} S\n".encode("utf-8") for i in range(10000)]
+        old = b"FarUidValidity 1\n" + b"".join(lines)
+        lines[5000] = b"5000 5000 FS\n"
+        new = b"FarUidValidity 1\n" + b"".join(lines)
+        for prefix, content, mtime in [(local, new, 2.0), (remote, old, 1.0)]:
+            os.makedirs(prefix + "INBOX")
+            with open(prefix + "INBOX/.mbsyncstate", "wb") as f:
+                f.write(content)
+            os.utime(prefix + "INBOX/.mbsyncstate", (mtime, mtime))
+        # only on remote
+        with open(remote + ".uidvalidity", "wb") as f:
+            f.write(b"1\n")
+
+        def _files(prefix):
+            return {f: os.stat(os.path.join(prefix, f)).st_mtime
+                    for f in ["INBOX/.mbsyncstate", ".uidvalidity"] if os.path.exists(os.path.join(prefix, f))}
+
+        r1, w1 = os.pipe()
+        r2, w2 = os.pipe()
+        with open(r1, "rb") as from_local, open(w1, "wb") as to_remote, \
+                open(r2, "rb") as from_remote, open(w2, "wb") as to_local:
+            with patch.dict(ns.features, {"delta": "blocks"}), \
+                    patch.object(ns, "find_mbsync_files", side_effect=_files), \
+                    patch.dict(ns.transfer, {"read": 0, "write": 0}):
+                with ThreadPoolExecutor() as pool:
+                    rem = pool.submit(ns.sync_mbsync_remote, remote, from_local, to_local)
+                    ns.sync_mbsync_local(local, from_remote, to_remote)
+                    rem.result()
+                # both directions counted in the same process
+                assert ns.transfer["write"] < len(new) / 4
+
+        for prefix in [local, remote]:
+            with open(prefix + "INBOX/.mbsyncstate", "rb") as f:
+                assert new == f.read()
+            assert 2.0 == os.stat(prefix + "INBOX/.mbsyncstate").st_mtime
+            with open(prefix + ".uidvalidity", "rb") as f:
+                assert b"1\n" == f.read()
 
 
 def test_digest():
@@ -1615,3 +3325,265 @@ def test_digest():
     assert "578f2f7c0b2e8ea5be4c8d245b07dec37c62ce4644fadb2a5c23839b39d6c260" == ns.digest(b"foo\nbar\nfoobar")
     assert "578f2f7c0b2e8ea5be4c8d245b07dec37c62ce4644fadb2a5c23839b39d6c260" == ns.digest(b"foo\nbar\nX-TUID: bla\nfoobar")
     assert "578f2f7c0b2e8ea5be4c8d245b07dec37c62ce4644fadb2a5c23839b39d6c260" == ns.digest(b"foo\nbar\nX-TUID: blarg\nfoobar")
+
+
+def test_digest_incremental():
+    data = b"foo\nbar\nX-TUID: blarg\nfoobar"
+    for size in range(1, len(data) + 1):
+        dig = ns.Digest()
+        for i in range(0, len(data), size):
+            dig.update(data[i:i + size])
+        assert ns.digest(data) == dig.hexdigest()
+
+    # no newline after X-TUID, nothing removed
+    dig = ns.Digest()
+    dig.update(b"foo\nX-TU")
+    dig.update(b"ID: bla")
+    assert ns.digest(b"foo\nX-TUID: bla") == dig.hexdigest()
+
+
+def other_hash():
+    # hash function other than SHA256, whether or not blake3 is installed
+    return patch.dict(ns.HASHES, {"blake3": lambda: hashlib.blake2b(digest_size=32)})
+
+
+def test_digest_headers():
+    with other_hash(), patch.dict(ns.features, {"digest": "blake3"}):
+        assert hashlib.blake2b(b"foo", digest_size=32).hexdigest() == ns.digest(b"foo")
+        assert hashlib.blake2b(b"foo\nbar\n\nfoobar", digest_size=32).hexdigest() == ns.digest(b"foo\nX-TUID: bla\nbar\n\nfoobar")
+        assert hashlib.blake2b(b"foo\r\nbar\r\n\r\nfoobar", digest_size=32).hexdigest() == ns.digest(b"foo\r\nX-TUID: bla\r\nbar\r\n\r\nfoobar")
+        # only in headers
+        assert hashlib.blake2b(b"foo\n\nX-TUID: bla\nfoobar", digest_size=32).hexdigest() == ns.digest(b"foo\n\nX-TUID: bla\nfoobar")
+    # SHA256 as before
+    assert hashlib.sha256(b"foo\n\nfoobar").hexdigest() == ns.digest(b"foo\n\nX-TUID: bla\nfoobar")
+
+
+def test_digest_headers_incremental():
+    with other_hash(), patch.dict(ns.features, {"digest": "blake3"}):
+        for data in [b"foo\nbar\nX-TUID: blarg\n\nfoobar", b"foo\nbar\n\nX-TUID: blarg\nfoobar",
+                     b"foo\r\nbar\r\n\r\nX-TUID: blarg\r\nfoobar", b"foo\nX-TUID: blarg"]:
+            for size in range(1, len(data) + 1):
+                dig = ns.Digest()
+                for i in range(0, len(data), size):
+                    dig.update(data[i:i + size])
+                assert ns.digest(data) == dig.hexdigest()
+
+
+def test_digest_file():
+    with NamedTemporaryFile(mode="w+b", prefix="notmuch-sync-test-tmp-") as f:
+        f.write(b"foo\nbar\nX-TUID: bla\nfoobar")
+        f.flush()
+        assert "578f2f7c0b2e8ea5be4c8d245b07dec37c62ce4644fadb2a5c23839b39d6c260" == ns.digest_file(f.name)
+
+
+def test_digest_cache():
+    with TemporaryDirectory() as _tmpdir:
+        tmpdir = _tmpdir + os.sep
+        cname = os.path.join(tmpdir, "cache")
+        fname = os.path.join(tmpdir, "foo")
+        with open(fname, "wb") as f:
+            f.write(b"mail one")
+
+        cache = ns.DigestCache()
+        cache.load(cname, tmpdir)
+        with patch.object(ns, "digest_file", wraps=ns.digest_file) as df:
+            assert ns.digest(b"mail one") == cache.digest(fname)
+            assert ns.digest(b"mail one") == cache.digest(fname)
+            assert df.call_count == 1
+        cache.save()
+
+        with open(cname, "r", encoding="utf-8") as f:
+            tmp = json.load(f)
+        assert list(tmp["entries"].keys()) == ["foo"]
+        assert tmp["entries"]["foo"][3] == {"sha256": ns.digest(b"mail one")}
+
+        # digests with other hash functions are added
+        cache = ns.DigestCache()
+        cache.load(cname, tmpdir)
+        with other_hash(), patch.dict(ns.features, {"digest": "blake3"}):
+            with patch.object(ns, "digest_file", wraps=ns.digest_file) as df:
+                assert ns.digest(b"mail one") == cache.digest(fname)
+                assert df.call_count == 1
+            cache.save()
+            with open(cname, "r", encoding="utf-8") as f:
+                tmp = json.load(f)
+            assert tmp["entries"]["foo"][3] == {"sha256": hashlib.sha256(b"mail one").hexdigest(), "blake3": ns.digest(b"mail one")}
+        with patch.object(ns, "digest_file", wraps=ns.digest_file) as df:
+            assert ns.digest(b"mail one") == cache.digest(fname)
+            assert df.call_count == 0
+
+        # renamed file found through stat
+        os.rename(fname, fname + "bar")
+        cache = ns.DigestCache()
+        cache.load(cname, tmpdir)
+        with patch.object(ns, "digest_file", wraps=ns.digest_file) as df:
+            assert ns.digest(b"mail one") == cache.digest(fname + "bar")
+            assert df.call_count == 0
+        cache.save()
+
+        # old name dropped as file doesn't exist anymore
+        with open(cname, "r", encoding="utf-8") as f:
+            tmp = json.load(f)
+        assert list(tmp["entries"].keys()) == ["foobar"]
+
+        # changed file
+        with open(fname + "bar", "wb") as f:
+            f.write(b"mail two")
+        cache = ns.DigestCache()
+        cache.load(cname, tmpdir)
+        with patch.object(ns, "digest_file", wraps=ns.digest_file) as df:
+            assert ns.digest(b"mail two") == cache.digest(fname + "bar")
+            assert df.call_count == 1
+
+
+
+def test_digest_cache_threads():
+    with TemporaryDirectory() as _tmpdir:
+        tmpdir = _tmpdir + os.sep
+        fnames = [os.path.join(tmpdir, f"foo{idx}") for idx in range(100)]
+        for idx, fname in enumerate(fnames):
+            with open(fname, "wb") as f:
+                f.write(f"mail {idx}".encode("utf-8"))
+
+        cache = ns.DigestCache()
+        cache.load(os.path.join(tmpdir, "cache"), tmpdir)
+        with ThreadPoolExecutor(max_workers=8) as pool:
+            res = list(pool.map(cache.digest, fnames + fnames))
+        assert res == [ns.digest(f"mail {idx}".encode("utf-8")) for idx in range(100)] * 2
+        assert len(cache.entries) == len(cache.changed) == len(cache.used) == 100
+        cache.save()
+        cache = ns.DigestCache()
+        cache.load(os.path.join(tmpdir, "cache"), tmpdir)
+        assert len(cache.entries) == 100
+
+def test_digest_cache_reload():
+    with TemporaryDirectory() as _tmpdir:
+        tmpdir = _tmpdir + os.sep
+        cname = os.path.join(tmpdir, "cache")
+        fname = os.path.join(tmpdir, "foo")
+        with open(fname, "wb") as f:
+            f.write(b"mail one")
+
+        cache = ns.DigestCache()
+        cache.load(cname, tmpdir)
+        cache.digest(fname)
+        cache.save()
+
+        # unchanged since saved, kept in memory
+        with patch("pathlib.Path.read_text") as rt:
+            cache.load(cname, tmpdir)
+            rt.assert_not_called()
+        assert list(cache.entries.keys()) == ["foo"]
+
+        # replaced by something else
+        tmp = cname + ".tmp"
+        with open(tmp, "w", encoding="utf-8") as f:
+            json.dump({"version": ns.DigestCache.version, "entries": {}}, f)
+        os.replace(tmp, cname)
+        cache.load(cname, tmpdir)
+        assert cache.entries == {}
+
+
+def test_digest_cache_log():
+    with TemporaryDirectory() as _tmpdir:
+        tmpdir = _tmpdir + os.sep
+        cname = os.path.join(tmpdir, "cache")
+        for idx in range(20):
+            with open(os.path.join(tmpdir, str(idx)), "wb") as f:
+                f.write(f"mail {idx}".encode("utf-8"))
+
+        cache = ns.DigestCache()
+        cache.load(cname, tmpdir)
+        for idx in range(16):
+            cache.digest(os.path.join(tmpdir, str(idx)))
+        cache.save()
+        assert not os.path.exists(cname + ".log")
+
+        # few changes only appended to the log
+        cache = ns.DigestCache()
+        cache.load(cname, tmpdir)
+        cache.digest(os.path.join(tmpdir, "16"))
+        os.remove(os.path.join(tmpdir, "0"))
+        cache.save()
+        with open(cname, "r", encoding="utf-8") as f:
+            assert len(json.load(f)["entries"]) == 16
+        with open(cname + ".log", "r", encoding="utf-8") as f:
+            assert [json.loads(line)[0] for line in f] == ["16", "0"]
+
+        cache = ns.DigestCache()
+        cache.load(cname, tmpdir)
+        assert sorted(cache.entries.keys(), key=int) == [str(idx) for idx in range(1, 17)]
+        with patch.object(ns, "digest_file", wraps=ns.digest_file) as df:
+            assert ns.digest(b"mail 16") == cache.digest(os.path.join(tmpdir, "16"))
+            df.assert_not_called()
+
+        # merged once the log gets too large
+        for idx in range(17, 20):
+            cache.digest(os.path.join(tmpdir, str(idx)))
+        cache.save()
+        assert not os.path.exists(cname + ".log")
+        with open(cname, "r", encoding="utf-8") as f:
+            assert sorted(json.load(f)["entries"].keys(), key=int) == [str(idx) for idx in range(1, 20)]
+
+
+def test_digest_cache_log_corrupted():
+    with TemporaryDirectory() as _tmpdir:
+        tmpdir = _tmpdir + os.sep
+        cname = os.path.join(tmpdir, "cache")
+        fname = os.path.join(tmpdir, "foo")
+        with open(fname, "wb") as f:
+            f.write(b"mail one")
+        cache = ns.DigestCache()
+        cache.load(cname, tmpdir)
+        cache.digest(fname)
+        cache.save()
+        with open(cname + ".log", "w", encoding="utf-8") as f:
+            f.write('["bar", null]\n["foo", [1, 2')
+        cache = ns.DigestCache()
+        cache.load(cname, tmpdir)
+        assert list(cache.entries.keys()) == ["foo"]
+        # merged with what could be read
+        cache.save()
+        assert not os.path.exists(cname + ".log")
+
+
+def test_digest_cache_prune_sample():
+    with TemporaryDirectory() as _tmpdir:
+        tmpdir = _tmpdir + os.sep
+        cname = os.path.join(tmpdir, "cache")
+        cache = ns.DigestCache()
+        cache.load(cname, tmpdir)
+        cache.entries = {str(idx): [idx, 1, 1, {}] for idx in range(10)}
+        with patch.object(ns, "DIGEST_PRUNE", 3), patch("os.path.exists", return_value=False) as ex:
+            cache.save()
+            assert ex.call_count == 3
+        assert len(cache.entries) == 7
+
+
+def test_digest_cache_old_version():
+    with TemporaryDirectory() as _tmpdir:
+        tmpdir = _tmpdir + os.sep
+        cname = os.path.join(tmpdir, "cache")
+        fname = os.path.join(tmpdir, "foo")
+        with open(fname, "wb") as f:
+            f.write(b"mail one")
+        st = os.stat(fname)
+        with open(cname, "w", encoding="utf-8") as f:
+            json.dump({"version": 1, "entries": {"foo": [st.st_ino, st.st_size, st.st_mtime_ns, "bar"]}}, f)
+        cache = ns.DigestCache()
+        cache.load(cname, tmpdir)
+        assert "bar" == cache.digest(fname)
+
+
+def test_digest_cache_corrupted():
+    with TemporaryDirectory() as _tmpdir:
+        tmpdir = _tmpdir + os.sep
+        cname = os.path.join(tmpdir, "cache")
+        with open(cname, "w", encoding="utf-8") as f:
+            f.write("foo")
+        cache = ns.DigestCache()
+        cache.load(cname, tmpdir)
+        assert cache.entries == {}
+        cache.save()
+        with open(cname, "r", encoding="utf-8") as f:
+            assert f.read() == "foo"